@@ -0,0 +1,71 @@
+--[[
+    Compares the default allocator with the slab allocator, i.e. states
+    created with option { allocator = "slab" }. Each thread invokes its own
+    state with a workload that allocates many small objects.
+    
+    Usage: lua bench01.lua [threads [loops]]
+--]]
+
+local llthreads = require("llthreads2.ex")
+local mtstates  = require("mtstates")
+
+local THREADS = tonumber(arg and arg[1]) or 8
+local LOOPS   = tonumber(arg and arg[2]) or 50
+
+local now = mtstates.now
+
+local function setup()
+    return function()
+        local t = {}
+        for i = 1, 20000 do
+            t[i] = { i, tostring(i), function() return i end }
+        end
+        for i = 1, #t, 2 do
+            t[i] = nil
+        end
+        local s = {}
+        for i = 1, 5000 do
+            s[#s + 1] = "item"..i
+        end
+        return #table.concat(s, ",")
+    end
+end
+
+local function run(allocator)
+    local states = {}
+    for i = 1, THREADS do
+        states[i] = mtstates.newstate({ allocator = allocator }, setup)
+    end
+    local startTime = now()
+    local threads = {}
+    for i = 1, THREADS do
+        threads[i] = llthreads.new(function(id, loops)
+                                       local mtstates = require("mtstates")
+                                       local s = mtstates.state(id)
+                                       for i = 1, loops do
+                                           s:call()
+                                       end
+                                   end,
+                                   states[i]:id(), LOOPS)
+        threads[i]:start()
+    end
+    for i = 1, THREADS do
+        assert(threads[i]:join())
+    end
+    local duration = now() - startTime
+    local peak = 0
+    for i = 1, THREADS do
+        local _, p = states[i]:memory()
+        peak = math.max(peak, p or 0)
+    end
+    return duration, peak
+end
+
+print(string.format("threads: %d, loops: %d", THREADS, LOOPS))
+for round = 1, 2 do
+    for _, allocator in ipairs{ "default", "slab" } do
+        local duration, peak = run(allocator)
+        print(string.format("%-8s %8.3f sec, peak state memory: %d kB", allocator, 
+                                                                       duration, math.floor(peak / 1024)))
+    end
+end
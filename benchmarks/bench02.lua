@@ -0,0 +1,74 @@
+--[[
+    Shows the latency and CPU trade-off of spinning callers, i.e. compares
+    states created with option { spin = true } and { spin = false }
+    (the default). Several threads invoke one shared state whose callback
+    is either short (a few microseconds) or long (about a millisecond).
+
+    For short callbacks waiting callers spin and take over the state without
+    being parked, which lowers the latency but costs CPU time. For long
+    callbacks waiting callers are always parked, so both variants should
+    show the same numbers.
+
+    The CPU time is measured with os.clock() and covers all threads of the
+    process. Spinning is disabled on single processor machines.
+
+    Usage: lua bench02.lua [threads [loops]]
+--]]
+
+local llthreads = require("llthreads2.ex")
+local mtstates  = require("mtstates")
+
+local THREADS = tonumber(arg and arg[1]) or 4
+local LOOPS   = tonumber(arg and arg[2]) or 20000
+
+local now = mtstates.now
+
+local function setup(n)
+    return function()
+        local x = 0
+        for i = 1, n do
+            x = x + i
+        end
+        return x
+    end
+end
+
+local function run(spin, n, loops)
+    local state = mtstates.newstate({ spin = spin }, setup, n)
+    local startTime = now()
+    local startCpu  = os.clock()
+    local threads = {}
+    for i = 1, THREADS do
+        threads[i] = llthreads.new(function(id, loops)
+                                       local mtstates = require("mtstates")
+                                       local s = mtstates.state(id)
+                                       for i = 1, loops do
+                                           s:call()
+                                       end
+                                   end,
+                                   state:id(), loops)
+        threads[i]:start()
+    end
+    for i = 1, THREADS do
+        assert(threads[i]:join())
+    end
+    local duration = now() - startTime
+    local cpu      = os.clock() - startCpu
+    state:close()
+    return duration, cpu
+end
+
+print(string.format("threads: %d, loops: %d", THREADS, LOOPS))
+for _, workload in ipairs{ { "short", 50,     LOOPS },
+                           { "long",  100000, math.max(1, math.floor(LOOPS / 100)) } } do
+    local name, n, loops = workload[1], workload[2], workload[3]
+    for round = 1, 2 do
+        for _, spin in ipairs{ true, false } do
+            local duration, cpu = run(spin, n, loops)
+            local calls = THREADS * loops
+            print(string.format("%-5s spin=%-5s %8.3f sec, %8.2f usec/call, cpu: %8.3f sec (%.2f cores)",
+                                name, tostring(spin), duration, duration / calls * 1000000,
+                                cpu, cpu / duration))
+        end
+    end
+end
@@ -0,0 +1,265 @@
+#include "allocator.h"
+
+#define SLAB_PAGE_SIZE  (16 * 1024)
+
+typedef struct SlabBlock {
+    struct SlabBlock* nextBlock;
+} SlabBlock;
+
+typedef struct SlabPage {
+    struct SlabPage* nextPage;
+    char             align[MTSTATES_SLAB_GRANULARITY - sizeof(void*)]; /* blocks are aligned */
+} SlabPage;
+
+void mtstates_allocator_init(StateAllocator* a, size_t limit, bool useSlabs)
+{
+    memset(a, 0, sizeof(StateAllocator));
+    a->limit    = limit;
+    a->useSlabs = useSlabs;
+}
+
+static void* allocate(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    StateAllocator* a = (StateAllocator*) ud;
+    
+    if (ptr == NULL) {
+        osize = 0; /* osize is type of object */
+    }
+    if (nsize == 0) {
+        free(ptr);
+        a->current -= osize;
+        return NULL;
+    }
+    if (nsize > osize && a->limit > 0 && a->current + (nsize - osize) > a->limit) {
+        return NULL;
+    }
+    void* rslt = realloc(ptr, nsize);
+    if (rslt) {
+        a->current = a->current - osize + nsize;
+        if (a->current > a->peak) {
+            a->peak = a->current;
+        }
+    }
+    return rslt;
+}
+
+static inline int sizeClass(size_t size)
+{
+    return (int)((size - 1) / MTSTATES_SLAB_GRANULARITY);
+}
+
+static bool newSlabPage(StateAllocator* a, int c)
+{
+    SlabPage* page = malloc(SLAB_PAGE_SIZE);
+    if (!page) {
+        return false;
+    }
+    page->nextPage = a->pages;
+    a->pages       = page;
+    
+    size_t blockSize = (c + 1) * MTSTATES_SLAB_GRANULARITY;
+    size_t count     = (SLAB_PAGE_SIZE - sizeof(SlabPage)) / blockSize;
+    char*  start     = ((char*)page) + sizeof(SlabPage);
+    
+    /* lowest address is used first */
+    SlabBlock* next = a->freeBlocks[c];
+    for (size_t i = count; i > 0; --i) {
+        SlabBlock* b = (SlabBlock*)(start + (i - 1) * blockSize);
+        b->nextBlock = next;
+        next = b;
+    }
+    a->freeBlocks[c] = next;
+    return true;
+}
+
+static inline void* takeBlock(StateAllocator* a, size_t size)
+{
+    if (size > MTSTATES_SLAB_MAX_SIZE) {
+        return malloc(size);
+    }
+    int c = sizeClass(size);
+    if (!a->freeBlocks[c] && !newSlabPage(a, c)) {
+        return NULL;
+    }
+    SlabBlock* b = a->freeBlocks[c];
+    a->freeBlocks[c] = b->nextBlock;
+    return b;
+}
+
+/*
+ * Adopted blocks are malloc blocks that were kept when shrinking to a slab 
+ * size because no slab block was available. Only these are not within a page.
+ */
+static bool isAdopted(StateAllocator* a, void* ptr)
+{
+    SlabPage* page = a->pages;
+    while (page) {
+        if ((char*)ptr > (char*)page && (char*)ptr < ((char*)page) + SLAB_PAGE_SIZE) {
+            return false;
+        }
+        page = page->nextPage;
+    }
+    return true;
+}
+
+static inline void releaseBlock(StateAllocator* a, void* ptr, size_t size)
+{
+    if (size > MTSTATES_SLAB_MAX_SIZE) {
+        free(ptr);
+    } else if (a->adoptedBlocks > 0 && isAdopted(a, ptr)) {
+        free(ptr);
+        a->adoptedBlocks -= 1;
+    } else {
+        int c = sizeClass(size);
+        SlabBlock* b = (SlabBlock*)ptr;
+        b->nextBlock = a->freeBlocks[c];
+        a->freeBlocks[c] = b;
+    }
+}
+
+/*
+ * Allocator for many small objects: blocks up to MTSTATES_SLAB_MAX_SIZE bytes 
+ * are taken from per state free lists, larger blocks are allocated by malloc.
+ * A lua state is only used by one thread at a time, therefore no locking is 
+ * needed. Slab pages are only released when the state is closed, even if
+ * all blocks of a page are free.
+ */
+static void* allocateSlab(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    StateAllocator* a = (StateAllocator*) ud;
+    
+    if (ptr == NULL) {
+        osize = 0; /* osize is type of object */
+    }
+    if (nsize == 0) {
+        if (ptr) {
+            releaseBlock(a, ptr, osize);
+            a->current -= osize;
+        }
+        return NULL;
+    }
+    if (nsize > osize && a->limit > 0 && a->current + (nsize - osize) > a->limit) {
+        return NULL;
+    }
+    void* rslt;
+    if (ptr == NULL) {
+        rslt = takeBlock(a, nsize);
+    }
+    else if (osize > MTSTATES_SLAB_MAX_SIZE && nsize > MTSTATES_SLAB_MAX_SIZE) {
+        rslt = realloc(ptr, nsize);
+    }
+    else if (osize <= MTSTATES_SLAB_MAX_SIZE && nsize <= MTSTATES_SLAB_MAX_SIZE 
+                                             && sizeClass(osize) == sizeClass(nsize)) 
+    {
+        rslt = ptr;
+    }
+    else {
+        rslt = takeBlock(a, nsize);
+        if (rslt) {
+            memcpy(rslt, ptr, (osize < nsize) ? osize : nsize);
+            releaseBlock(a, ptr, osize);
+        }
+        else if (nsize < osize) {
+            /* shrinking must not fail, the larger block is kept */
+            rslt = ptr;
+            if (osize > MTSTATES_SLAB_MAX_SIZE) {
+                a->adoptedBlocks += 1;
+            }
+        }
+    }
+    if (rslt) {
+        a->current = a->current - osize + nsize;
+        if (a->current > a->peak) {
+            a->peak = a->current;
+        }
+    }
+    return rslt;
+}
+
+static int panic(lua_State* L) 
+{
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+                    lua_tostring(L, -1));
+    fflush(stderr);
+    return 0;  /* return to Lua to abort */
+}
+
+#if LUA_VERSION_NUM >= 504
+
+/* warning functions as in lauxlib.c, warnings are off by default */
+
+static void warnfoff(void* ud, const char* message, int tocont);
+static void warnfon (void* ud, const char* message, int tocont);
+static void warnfcont(void* ud, const char* message, int tocont);
+
+static int checkcontrol(lua_State* L, const char* message, int tocont) 
+{
+    if (tocont || *(message++) != '@') {  /* not a control message? */
+        return 0;
+    } else {
+        if (strcmp(message, "off") == 0) {
+            lua_setwarnf(L, warnfoff, L);  /* turn warnings off */
+        } else if (strcmp(message, "on") == 0) {
+            lua_setwarnf(L, warnfon, L);   /* turn warnings on */
+        }
+        return 1;  /* it was a control message */
+    }
+}
+
+static void warnfoff(void* ud, const char* message, int tocont) 
+{
+    checkcontrol((lua_State*)ud, message, tocont);
+}
+
+static void warnfcont(void* ud, const char* message, int tocont) 
+{
+    lua_State* L = (lua_State*)ud;
+    fprintf(stderr, "%s", message);
+    if (tocont) {  /* not the last part? */
+        lua_setwarnf(L, warnfcont, L);  /* to be continued */
+    } else {  /* last part */
+        fprintf(stderr, "\n");
+        fflush(stderr);
+        lua_setwarnf(L, warnfon, L);  /* next call is a new message */
+    }
+}
+
+static void warnfon(void* ud, const char* message, int tocont) 
+{
+    if (checkcontrol((lua_State*)ud, message, tocont)) {  /* control message? */
+        return;
+    }
+    fprintf(stderr, "Lua warning: ");  /* start a new warning */
+    warnfcont(ud, message, tocont);
+}
+
+#endif /* LUA_VERSION_NUM >= 504 */
+
+lua_State* mtstates_allocator_newstate(StateAllocator* a)
+{
+    lua_State* L = lua_newstate(a->useSlabs ? allocateSlab : allocate, a);
+    if (L) {
+        a->isActive = true;
+        lua_atpanic(L, &panic);
+    #if LUA_VERSION_NUM >= 504
+        lua_setwarnf(L, warnfoff, L);
+    #endif
+    }
+    return L;
+}
+
+
+void mtstates_allocator_closestate(StateAllocator* a, lua_State* L)
+{
+    lua_close(L);
+
+    SlabPage* page = a->pages;
+    while (page) {
+        SlabPage* next = page->nextPage;
+        free(page);
+        page = next;
+    }
+    a->pages         = NULL;
+    a->adoptedBlocks = 0;
+    memset(a->freeBlocks, 0, sizeof(a->freeBlocks));
+}
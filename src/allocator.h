@@ -0,0 +1,42 @@
+#ifndef MTSTATES_ALLOCATOR_H
+#define MTSTATES_ALLOCATOR_H
+
+#include "util.h"
+
+/* small blocks up to MTSTATES_SLAB_MAX_SIZE bytes are taken from slab pages */
+#define MTSTATES_SLAB_GRANULARITY   16
+#define MTSTATES_SLAB_CLASS_COUNT   16
+#define MTSTATES_SLAB_MAX_SIZE      (MTSTATES_SLAB_GRANULARITY * MTSTATES_SLAB_CLASS_COUNT)
+
+struct SlabBlock;
+struct SlabPage;
+
+typedef struct StateAllocator {
+    bool    isActive;
+    bool    useSlabs;
+    size_t  current;
+    size_t  peak;
+    size_t  limit;   /* 0 : no limit */
+    
+    struct SlabBlock* freeBlocks[MTSTATES_SLAB_CLASS_COUNT];
+    struct SlabPage*  pages;
+    size_t            adoptedBlocks;
+} StateAllocator;
+
+void mtstates_allocator_init(StateAllocator* a, size_t limit, bool useSlabs);
+
+/**
+ * Creates a new lua state like luaL_newstate() but uses the given 
+ * allocator. Returns NULL if the lua state could not be created.
+ */
+lua_State* mtstates_allocator_newstate(StateAllocator* a);
+
+/**
+ * Closes the lua state and releases the slab pages of the allocator.
+ * Must be used instead of lua_close() for states created with
+ * mtstates_allocator_newstate().
+ */
+void mtstates_allocator_closestate(StateAllocator* a, lua_State* L);
+
+
+#endif /* MTSTATES_ALLOCATOR_H */
@@ -10,6 +10,20 @@ bool async_util_abort(int rc, int line)
     return false;
 }
 
+int mtstates_async_processor_count()
+{
+#if defined(MTSTATES_ASYNC_USE_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int)n : 1;
+#else
+    return 2; /* unknown */
+#endif
+}
+
 void mtstates_async_lock_init(Lock* lock)
 {
 #if defined(MTSTATES_ASYNC_USE_PTHREAD)
@@ -58,7 +72,20 @@ void mtstates_async_mutex_init(Mutex* mutex)
     rc = pthread_mutex_init(&mutex->mutex, &mutex->attr);
     if (rc != 0) { async_util_abort(rc, __LINE__); }
 
+    mutex->monotonic = false;
+#if defined(CLOCK_MONOTONIC) && !defined(__APPLE__)
+    pthread_condattr_t condattr;
+    rc = pthread_condattr_init(&condattr);
+    if (rc != 0) { async_util_abort(rc, __LINE__); }
+    
+    if (pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC) == 0) {
+        mutex->monotonic = true;
+    }
+    rc = pthread_cond_init(&mutex->condition, &condattr);
+    pthread_condattr_destroy(&condattr);
+#else
     rc = pthread_cond_init(&mutex->condition, NULL);
+#endif
     if (rc != 0) { async_util_abort(rc, __LINE__); }
 
 #elif defined(MTSTATES_ASYNC_USE_WINTHREAD)
@@ -128,10 +155,18 @@ bool mtstates_async_mutex_wait_millis(Mutex* mutex, int timeoutMillis)
 {
 #if defined(MTSTATES_ASYNC_USE_PTHREAD)
     struct timespec abstime;
-    struct timeval tv;  gettimeofday(&tv, NULL);
-    
-    abstime.tv_sec = tv.tv_sec + timeoutMillis / 1000;
-    abstime.tv_nsec = tv.tv_usec * 1000 + 1000 * 1000 * (timeoutMillis % 1000);
+#if defined(CLOCK_MONOTONIC) && !defined(__APPLE__)
+    if (mutex->monotonic) {
+        clock_gettime(CLOCK_MONOTONIC, &abstime);
+    } else
+#endif
+    {
+        struct timeval tv;  gettimeofday(&tv, NULL);
+        abstime.tv_sec  = tv.tv_sec;
+        abstime.tv_nsec = tv.tv_usec * 1000;
+    }
+    abstime.tv_sec += timeoutMillis / 1000;
+    abstime.tv_nsec += 1000 * 1000 * (timeoutMillis % 1000);
     abstime.tv_sec += abstime.tv_nsec / (1000 * 1000 * 1000);
     abstime.tv_nsec %= (1000 * 1000 * 1000);
     
@@ -177,3 +212,126 @@ bool mtstates_async_mutex_wait_millis(Mutex* mutex, int timeoutMillis)
 
 #endif
 }
+
+bool mtstates_async_mutex_wait_until(Mutex* mutex, double deadline)
+{
+    double remaining = deadline - mtstates_monotonic_time_seconds();
+    if (remaining <= 0) {
+        return false;
+    }
+#if defined(MTSTATES_ASYNC_USE_PTHREAD) || defined(MTSTATES_ASYNC_USE_STDTHREAD)
+    struct timespec abstime;
+#if defined(MTSTATES_ASYNC_USE_PTHREAD) && defined(CLOCK_MONOTONIC) && !defined(__APPLE__)
+    if (mutex->monotonic) {
+        /* same clock as mtstates_monotonic_time_seconds() */
+        abstime.tv_sec  = (time_t)deadline;
+        abstime.tv_nsec = (long)((deadline - (double)abstime.tv_sec) * 1000000000);
+    } else
+#endif
+    {
+        struct timeval tv;  gettimeofday(&tv, NULL);
+        time_t secs = (time_t)remaining;
+        abstime.tv_sec  = tv.tv_sec + secs;
+        abstime.tv_nsec = tv.tv_usec * 1000 + (long)((remaining - (double)secs) * 1000000000);
+        abstime.tv_sec += abstime.tv_nsec / (1000 * 1000 * 1000);
+        abstime.tv_nsec %= (1000 * 1000 * 1000);
+    }
+#endif
+#if defined(MTSTATES_ASYNC_USE_PTHREAD)
+    int rc = pthread_cond_timedwait(&mutex->condition, &mutex->mutex, &abstime);
+    
+    if (rc == 0 || rc == ETIMEDOUT) {
+        return (rc == 0);
+    }
+    else {
+        return async_util_abort(rc, __LINE__);
+    }
+#elif defined(MTSTATES_ASYNC_USE_WINTHREAD)
+    /* round up, waking up too early would lead to busy waiting */
+    double millis = remaining * 1000;
+    DWORD  timeoutMillis = (DWORD)millis;
+    if (timeoutMillis < millis) {
+        timeoutMillis += 1;
+    }
+    return async_mutex_wait_millis(mutex, timeoutMillis);
+    
+#elif defined(MTSTATES_ASYNC_USE_STDTHREAD)
+    int rc = cnd_timedwait(&mutex->condition, &mutex->mutex, &abstime);
+
+    if (rc == thrd_success || rc == thrd_timedout) {
+        return (rc == thrd_success);
+    }
+    else {
+        return async_util_abort(rc, __LINE__);
+    }
+#endif
+}
+
+typedef struct ThreadStart {
+    AsyncThreadFunc func;
+    void*           arg;
+} ThreadStart;
+
+#if defined(MTSTATES_ASYNC_USE_PTHREAD)
+static void* threadMain(void* arg)
+#elif defined(MTSTATES_ASYNC_USE_WINTHREAD)
+static DWORD WINAPI threadMain(LPVOID arg)
+#elif defined(MTSTATES_ASYNC_USE_STDTHREAD)
+static int threadMain(void* arg)
+#endif
+{
+    ThreadStart start = *((ThreadStart*)arg);
+    free(arg);
+    start.func(start.arg);
+    return 0;
+}
+
+bool mtstates_async_thread_start(AsyncThread* thread, AsyncThreadFunc func, void* arg)
+{
+    ThreadStart* start = malloc(sizeof(ThreadStart));
+    if (!start) {
+        return false;
+    }
+    start->func = func;
+    start->arg  = arg;
+#if defined(MTSTATES_ASYNC_USE_PTHREAD)
+    int rc = pthread_create(thread, NULL, threadMain, start);
+    bool ok = (rc == 0);
+#elif defined(MTSTATES_ASYNC_USE_WINTHREAD)
+    *thread = CreateThread(NULL, 0, threadMain, start, 0, NULL);
+    bool ok = (*thread != NULL);
+#elif defined(MTSTATES_ASYNC_USE_STDTHREAD)
+    int rc = thrd_create(thread, threadMain, start);
+    bool ok = (rc == thrd_success);
+#endif
+    if (!ok) {
+        free(start);
+    }
+    return ok;
+}
+
+void mtstates_async_thread_join(AsyncThread* thread)
+{
+#if defined(MTSTATES_ASYNC_USE_PTHREAD)
+    int rc = pthread_join(*thread, NULL);
+    if (rc != 0) { async_util_abort(rc, __LINE__); }
+#elif defined(MTSTATES_ASYNC_USE_WINTHREAD)
+    DWORD rc = WaitForSingleObject(*thread, INFINITE);
+    if (rc != WAIT_OBJECT_0) { async_util_abort(rc, __LINE__); }
+    CloseHandle(*thread);
+#elif defined(MTSTATES_ASYNC_USE_STDTHREAD)
+    int rc = thrd_join(*thread, NULL);
+    if (rc != thrd_success) { async_util_abort(rc, __LINE__); }
+#endif
+}
+
+void mtstates_async_thread_detach(AsyncThread* thread)
+{
+#if defined(MTSTATES_ASYNC_USE_PTHREAD)
+    pthread_detach(*thread);
+#elif defined(MTSTATES_ASYNC_USE_WINTHREAD)
+    CloseHandle(*thread);
+#elif defined(MTSTATES_ASYNC_USE_STDTHREAD)
+    thrd_detach(*thread);
+#endif
+}
@@ -92,6 +92,17 @@ static inline int atomic_get(AtomicCounter* value)
 #endif
 }
 
+static inline void atomic_memory_barrier()
+{
+#if defined(MTSTATES_ASYNC_USE_WIN32)
+    MemoryBarrier();
+#elif defined(MTSTATES_ASYNC_USE_STDATOMIC)
+    atomic_thread_fence(memory_order_seq_cst);
+#elif defined(MTSTATES_ASYNC_USE_GNU)
+    __sync_synchronize();
+#endif
+}
+
 static inline int atomic_set(AtomicCounter* value, int newValue)
 {
 #if defined(MTSTATES_ASYNC_USE_WIN32)
@@ -107,6 +118,23 @@ static inline int atomic_set(AtomicCounter* value, int newValue)
 
 /* -------------------------------------------------------------------------------------------- */
 
+/* hint to the processor that the caller is busy waiting */
+static inline void atomic_spin_pause()
+{
+#if defined(MTSTATES_ASYNC_USE_WIN32)
+    YieldProcessor();
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+    __builtin_ia32_pause();
+#elif defined(__GNUC__) && defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+#define async_processor_count mtstates_async_processor_count
+int async_processor_count();
+
+/* -------------------------------------------------------------------------------------------- */
+
 #if defined(MTSTATES_ASYNC_USE_PTHREAD)
 typedef pthread_t ThreadId;
 #elif defined(MTSTATES_ASYNC_USE_WINTHREAD)
@@ -128,6 +156,33 @@ static inline ThreadId async_current_threadid()
 
 /* -------------------------------------------------------------------------------------------- */
 
+#if defined(MTSTATES_ASYNC_USE_PTHREAD)
+typedef pthread_t AsyncThread;
+#elif defined(MTSTATES_ASYNC_USE_WINTHREAD)
+typedef HANDLE AsyncThread;
+#elif defined (MTSTATES_ASYNC_USE_STDTHREAD)
+typedef thrd_t AsyncThread;
+#endif
+
+typedef void (*AsyncThreadFunc)(void* arg);
+
+/* -------------------------------------------------------------------------------------------- */
+
+#define async_thread_start mtstates_async_thread_start
+bool async_thread_start(AsyncThread* thread, AsyncThreadFunc func, void* arg);
+
+/* -------------------------------------------------------------------------------------------- */
+
+#define async_thread_join mtstates_async_thread_join
+void async_thread_join(AsyncThread* thread);
+
+/* -------------------------------------------------------------------------------------------- */
+
+#define async_thread_detach mtstates_async_thread_detach
+void async_thread_detach(AsyncThread* thread);
+
+/* -------------------------------------------------------------------------------------------- */
+
 typedef struct
 {
 #if defined(MTSTATES_ASYNC_USE_PTHREAD)
@@ -223,6 +278,7 @@ typedef struct
     pthread_mutexattr_t   attr;
     pthread_mutex_t       mutex;
     pthread_cond_t        condition;
+    bool                  monotonic; /* condition uses CLOCK_MONOTONIC */
 
 #elif defined(MTSTATES_ASYNC_USE_WINTHREAD)
     CRITICAL_SECTION      mutex;
@@ -318,6 +374,12 @@ bool async_mutex_wait_millis(Mutex* mutex, int timeoutMillis);
 
 /* -------------------------------------------------------------------------------------------- */
 
+/* deadline in seconds as given by mtstates_monotonic_time_seconds() */
+#define async_mutex_wait_until mtstates_async_mutex_wait_until
+bool async_mutex_wait_until(Mutex* mutex, double deadline);
+
+/* -------------------------------------------------------------------------------------------- */
+
 static inline void async_mutex_notify(Mutex* mutex) 
 {
 #if defined(MTSTATES_ASYNC_USE_PTHREAD)
@@ -0,0 +1,211 @@
+#include "blob.h"
+#include "error.h"
+
+const char* const MTSTATES_BLOB_CLASS_NAME = "mtstates.blob";
+
+typedef struct BlobUserData {
+    MtBlob*       blob;
+} BlobUserData;
+
+static void setupBlobMeta(lua_State* L);
+
+static int pushBlobMeta(lua_State* L)
+{
+    if (luaL_newmetatable(L, MTSTATES_BLOB_CLASS_NAME)) {
+        setupBlobMeta(L);
+    }
+    return 1;
+}
+
+void mtstates_blob_retain(MtBlob* b)
+{
+    atomic_inc(&b->used);
+}
+
+void mtstates_blob_release(MtBlob* b)
+{
+    if (atomic_dec(&b->used) <= 0) {
+        free(b);
+    }
+}
+
+MtBlob* mtstates_blob_test(lua_State* L, int index)
+{
+    BlobUserData* udata = luaL_testudata(L, index, MTSTATES_BLOB_CLASS_NAME);
+    return udata ? udata->blob : NULL;
+}
+
+static BlobUserData* newBlobUserData(lua_State* L)
+{
+    BlobUserData* udata = lua_newuserdata(L, sizeof(BlobUserData));
+    memset(udata, 0, sizeof(BlobUserData));
+    pushBlobMeta(L);         /* -> udata, meta */
+    lua_setmetatable(L, -2); /* -> udata */
+    return udata;
+}
+
+void mtstates_blob_push(lua_State* L, MtBlob* b)
+{
+    BlobUserData* udata = newBlobUserData(L);
+    udata->blob = b;
+    mtstates_blob_retain(b);
+}
+
+static int Mtstates_newBlob(lua_State* L)
+{
+    size_t        len;
+    const char*   str   = luaL_checklstring(L, 1, &len);
+    BlobUserData* udata = newBlobUserData(L);
+
+    MtBlob* b = malloc(sizeof(MtBlob) + len);
+    if (!b) {
+        return mtstates_ERROR_OUT_OF_MEMORY(L);
+    }
+    atomic_set(&b->used, 1);
+    b->length = len;
+    memcpy(b->data, str, len);
+    b->data[len] = '\0';
+    udata->blob = b;
+    return 1;
+}
+
+/* converts relative string position as in string.sub: negative means back from end */
+static size_t posrelat(lua_Integer pos, size_t len)
+{
+    if (pos >= 0) {
+        return (size_t)pos;
+    } else if (0u - (size_t)pos > len) {
+        return 0;
+    } else {
+        return len - ((size_t)-pos) + 1;
+    }
+}
+
+static int MtBlob_len(lua_State* L)
+{
+    BlobUserData* udata = luaL_checkudata(L, 1, MTSTATES_BLOB_CLASS_NAME);
+    lua_pushinteger(L, (lua_Integer)udata->blob->length);
+    return 1;
+}
+
+static int MtBlob_sub(lua_State* L)
+{
+    BlobUserData* udata = luaL_checkudata(L, 1, MTSTATES_BLOB_CLASS_NAME);
+    MtBlob*       b     = udata->blob;
+    size_t        start = posrelat(luaL_checkinteger(L, 2), b->length);
+    size_t        end   = posrelat(luaL_optinteger(L, 3, -1), b->length);
+    if (start < 1) start = 1;
+    if (end > b->length) end = b->length;
+    if (start <= end) {
+        lua_pushlstring(L, b->data + start - 1, end - start + 1);
+    } else {
+        lua_pushliteral(L, "");
+    }
+    return 1;
+}
+
+static int MtBlob_byte(lua_State* L)
+{
+    BlobUserData* udata = luaL_checkudata(L, 1, MTSTATES_BLOB_CLASS_NAME);
+    MtBlob*       b     = udata->blob;
+    lua_Integer   pi    = luaL_optinteger(L, 2, 1);
+    size_t        start = posrelat(pi, b->length);
+    size_t        end   = posrelat(luaL_optinteger(L, 3, pi), b->length);
+    if (start < 1) start = 1;
+    if (end > b->length) end = b->length;
+    if (start > end) {
+        return 0;
+    }
+    if (end - start >= INT_MAX) {
+        return luaL_error(L, "string slice too long");
+    }
+    int n = (int)(end - start) + 1;
+    luaL_checkstack(L, n, "string slice too long");
+    int i;
+    for (i = 0; i < n; ++i) {
+        lua_pushinteger(L, (unsigned char)b->data[start + i - 1]);
+    }
+    return n;
+}
+
+static int MtBlob_tostring(lua_State* L)
+{
+    BlobUserData* udata = luaL_checkudata(L, 1, MTSTATES_BLOB_CLASS_NAME);
+    lua_pushlstring(L, udata->blob->data, udata->blob->length);
+    return 1;
+}
+
+static int MtBlob_toString(lua_State* L)
+{
+    BlobUserData* udata = luaL_checkudata(L, 1, MTSTATES_BLOB_CLASS_NAME);
+
+    if (udata->blob) {
+        lua_pushfstring(L, "%s: %p (length=%d)", MTSTATES_BLOB_CLASS_NAME, udata->blob,
+                                                  (int)udata->blob->length);
+    } else {
+        lua_pushfstring(L, "%s: invalid", MTSTATES_BLOB_CLASS_NAME);
+    }
+    return 1;
+}
+
+static int MtBlob_release(lua_State* L)
+{
+    BlobUserData* udata = luaL_checkudata(L, 1, MTSTATES_BLOB_CLASS_NAME);
+    if (udata->blob) {
+        mtstates_blob_release(udata->blob);
+        udata->blob = NULL;
+    }
+    return 0;
+}
+
+/* ============================================================================================ */
+
+static const luaL_Reg BlobMethods[] =
+{
+    { "len",        MtBlob_len       },
+    { "sub",        MtBlob_sub       },
+    { "byte",       MtBlob_byte      },
+    { "tostring",   MtBlob_tostring  },
+    { NULL,         NULL } /* sentinel */
+};
+
+static const luaL_Reg BlobMetaMethods[] =
+{
+    { "__len",      MtBlob_len       },
+    { "__tostring", MtBlob_toString  },
+    { "__gc",       MtBlob_release   },
+    { NULL,         NULL } /* sentinel */
+};
+
+static const luaL_Reg ModuleFunctions[] =
+{
+    { "newblob",    Mtstates_newBlob },
+    { NULL,         NULL } /* sentinel */
+};
+
+static void setupBlobMeta(lua_State* L)
+{                                                           /* -> meta */
+    lua_pushstring(L, MTSTATES_BLOB_CLASS_NAME);            /* -> meta, className */
+    lua_setfield(L, -2, "__metatable");                     /* -> meta */
+
+    luaL_setfuncs(L, BlobMetaMethods, 0);                   /* -> meta */
+
+    lua_newtable(L);  /* BlobClass */                       /* -> meta, BlobClass */
+    luaL_setfuncs(L, BlobMethods, 0);                       /* -> meta, BlobClass */
+    lua_setfield (L, -2, "__index");                        /* -> meta */
+}
+
+
+int mtstates_blob_init_module(lua_State* L, int module)
+{
+    if (luaL_newmetatable(L, MTSTATES_BLOB_CLASS_NAME)) {
+        setupBlobMeta(L);
+    }
+    lua_pop(L, 1);
+
+    lua_pushvalue(L, module);
+        luaL_setfuncs(L, ModuleFunctions, 0);
+    lua_pop(L, 1);
+
+    return 0;
+}
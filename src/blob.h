@@ -0,0 +1,35 @@
+#ifndef MTSTATES_BLOB_H
+#define MTSTATES_BLOB_H
+
+#include "util.h"
+
+extern const char* const MTSTATES_BLOB_CLASS_NAME;
+
+/**
+ * Immutable byte buffer that is shared by reference between states.
+ */
+typedef struct MtBlob {
+    AtomicCounter used;
+    size_t        length;
+    char          data[1];
+} MtBlob;
+
+/**
+ * Returns the blob if the value at the given stack index is a blob
+ * userdata, otherwise NULL.
+ */
+MtBlob* mtstates_blob_test(lua_State* L, int index);
+
+/**
+ * Pushes a new userdata referencing the blob, the blob is retained.
+ */
+void mtstates_blob_push(lua_State* L, MtBlob* b);
+
+void mtstates_blob_retain(MtBlob* b);
+
+void mtstates_blob_release(MtBlob* b);
+
+int mtstates_blob_init_module(lua_State* L, int module);
+
+
+#endif /* MTSTATES_BLOB_H */
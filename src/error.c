@@ -62,6 +62,11 @@ int mtstates_ERROR_UNKNOWN_OBJECT_state_id(lua_State* L, lua_Integer id)
     lua_pushfstring(L, "state id %d", (int)id);
     return throwErrorMessage(L, MTSTATES_ERROR_UNKNOWN_OBJECT);
 }
+int mtstates_ERROR_UNKNOWN_OBJECT_pool_id(lua_State* L, lua_Integer id)
+{
+    lua_pushfstring(L, "pool id %d", (int)id);
+    return throwErrorMessage(L, MTSTATES_ERROR_UNKNOWN_OBJECT);
+}
 int mtstates_ERROR_AMBIGUOUS_NAME_state_name(lua_State* L, const char* stateName, size_t nameLength)
 {
     mtstates_util_quote_lstring(L, stateName, nameLength);
@@ -119,6 +124,16 @@ int mtstates_ERROR_OUT_OF_MEMORY_bytes(lua_State* L, size_t bytes)
     return throwErrorMessage(L, MTSTATES_ERROR_OUT_OF_MEMORY);
 }
 
+int mtstates_ERROR_OUT_OF_MEMORY_state(lua_State* L, const char* stateString, const char* errorDetails)
+{
+    if (stateString != NULL) {
+        lua_pushfstring(L, "%s: %s", stateString, errorDetails);
+    } else {
+        lua_pushstring(L, errorDetails);
+    }
+    return throwErrorMessage(L, MTSTATES_ERROR_OUT_OF_MEMORY);
+}
+
 
 static void publishError(lua_State* L, int module, const char* errorName)
 {
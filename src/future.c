@@ -0,0 +1,252 @@
+#include "future.h"
+#include "error.h"
+
+const char* const MTSTATES_FUTURE_CLASS_NAME = "mtstates.future";
+
+typedef struct FutureUserData {
+    MtFuture*        future;
+} FutureUserData;
+
+static void MtFuture_free(MtFuture* f)
+{
+    if (f->errorMsg) {
+        free(f->errorMsg);
+    }
+    mtstates_writer_release_values(&f->results);
+    mtstates_membuf_free(&f->results.mem);
+    async_mutex_destruct(&f->mutex);
+    free(f);
+}
+
+static void setupFutureMeta(lua_State* L);
+
+static int pushFutureMeta(lua_State* L)
+{
+    if (luaL_newmetatable(L, MTSTATES_FUTURE_CLASS_NAME)) {
+        setupFutureMeta(L);
+    }
+    return 1;
+}
+
+MtFuture* mtstates_future_new(lua_State* L, const char* stateString)
+{
+    FutureUserData* udata = lua_newuserdata(L, sizeof(FutureUserData));
+    memset(udata, 0, sizeof(FutureUserData));
+    pushFutureMeta(L);       /* -> udata, meta */
+    lua_setmetatable(L, -2); /* -> udata */
+
+    size_t    len = strlen(stateString);
+    MtFuture* f   = malloc(sizeof(MtFuture) + len);
+    if (!f) {
+        mtstates_ERROR_OUT_OF_MEMORY(L);
+        return NULL;
+    }
+    memset(f, 0, sizeof(MtFuture));
+    if (!mtstates_membuf_init(&f->results.mem, 0, 2)) {
+        free(f);
+        mtstates_ERROR_OUT_OF_MEMORY(L);
+        return NULL;
+    }
+    memcpy(f->stateString, stateString, len + 1);
+    async_mutex_init(&f->mutex);
+    atomic_set(&f->used, 2);
+    udata->future = f;
+    return f;
+}
+
+void mtstates_future_error_handler(void* ehdata, const char* msg, size_t msglen)
+{
+    MtFuture* f = (MtFuture*) ehdata;
+    async_mutex_lock(&f->mutex);
+    if (!f->errorMsg) {
+        f->errorMsg = malloc(msglen + 1);
+        if (f->errorMsg) {
+            memcpy(f->errorMsg, msg, msglen);
+            f->errorMsg[msglen] = '\0';
+            f->errorLength = msglen;
+        } else {
+            f->isMemoryError = true;
+        }
+    }
+    async_mutex_unlock(&f->mutex);
+}
+
+void mtstates_future_complete(MtFuture* f, int rc)
+{
+    async_mutex_lock(&f->mutex);
+    if (rc == 101) {
+        f->closed = true;
+    } 
+    else if (rc == 999) {
+        f->isMemoryError = true;
+    }
+    f->done = true;
+    async_mutex_notify(&f->mutex);
+    async_mutex_unlock(&f->mutex);
+    
+    if (atomic_dec(&f->used) == 0) {
+        MtFuture_free(f);
+    }
+}
+
+/* mutex must be held */
+static bool waitForFuture(MtFuture* f, bool isTimed, lua_Number endTime)
+{
+    while (!f->done) {
+        if (isTimed) {
+            if (mtstates_monotonic_time_seconds() < endTime) {
+                async_mutex_wait_until(&f->mutex, endTime);
+            } else {
+                return false;
+            }
+        } else {
+            async_mutex_wait(&f->mutex);
+        }
+    }
+    async_mutex_notify(&f->mutex); /* other waiting threads */
+    return true;
+}
+
+static int MtFuture_wait(lua_State* L)
+{
+    int arg = 1;
+    FutureUserData* udata = luaL_checkudata(L, arg++, MTSTATES_FUTURE_CLASS_NAME);
+    MtFuture*       f     = udata->future;
+
+    bool       isTimed = !lua_isnoneornil(L, arg);
+    lua_Number endTime = 0;
+    if (isTimed) {
+        endTime = mtstates_monotonic_time_seconds() + luaL_checknumber(L, arg);
+    }
+    async_mutex_lock(&f->mutex);
+    bool done = waitForFuture(f, isTimed, endTime);
+    async_mutex_unlock(&f->mutex);
+
+    lua_pushboolean(L, done);
+    return 1;
+}
+
+MtFuture* mtstates_future_check(lua_State* L, int arg)
+{
+    FutureUserData* udata = luaL_checkudata(L, arg, MTSTATES_FUTURE_CLASS_NAME);
+    return udata->future;
+}
+
+bool mtstates_future_ready(MtFuture* f)
+{
+    async_mutex_lock(&f->mutex);
+    bool done = f->done;
+    async_mutex_unlock(&f->mutex);
+    return done;
+}
+
+int mtstates_future_push_results(lua_State* L, MtFuture* f)
+{
+    async_mutex_lock(&f->mutex);
+    waitForFuture(f, false, 0);
+    async_mutex_unlock(&f->mutex);
+    
+    /* future is done: fields are not modified anymore */
+
+    if (f->closed) {
+        return mtstates_ERROR_OBJECT_CLOSED(L, f->stateString);
+    }
+    if (f->errorMsg) {
+        lua_pushlstring(L, f->errorMsg, f->errorLength);
+        return mtstates_ERROR_INVOKING_STATE(L, f->stateString, lua_tostring(L, -1));
+    }
+    if (f->isMemoryError) {
+        return mtstates_ERROR_OUT_OF_MEMORY_state(L, f->stateString, "not enough memory");
+    }
+    int nrslts = f->results.nargs;
+    if (nrslts > 0) {
+        const struct carray_capi* carrayCapi = NULL;
+        luaL_checkstack(L, nrslts + LUA_MINSTACK, NULL);
+        mtstates_writer_push_values(L, &f->results, &carrayCapi, MTSTATES_BYTES_INTEGERS);
+    }
+    return nrslts;
+}
+
+static int MtFuture_ready(lua_State* L)
+{
+    int arg = 1;
+    MtFuture* f = mtstates_future_check(L, arg++);
+
+    lua_pushboolean(L, mtstates_future_ready(f));
+    return 1;
+}
+
+static int MtFuture_results(lua_State* L)
+{
+    int arg = 1;
+    MtFuture* f = mtstates_future_check(L, arg++);
+    
+    return mtstates_future_push_results(L, f);
+}
+
+static int MtFuture_toString(lua_State* L)
+{
+    FutureUserData* udata = luaL_checkudata(L, 1, MTSTATES_FUTURE_CLASS_NAME);
+    
+    if (udata->future) {
+        lua_pushfstring(L, "%s: %p (%s)", MTSTATES_FUTURE_CLASS_NAME, udata, 
+                                          udata->future->stateString);
+    } else {
+        lua_pushfstring(L, "%s: invalid", MTSTATES_FUTURE_CLASS_NAME);
+    }
+    return 1;
+}
+
+static int MtFuture_release(lua_State* L)
+{
+    FutureUserData* udata = luaL_checkudata(L, 1, MTSTATES_FUTURE_CLASS_NAME);
+    MtFuture*       f     = udata->future;
+    
+    if (f) {
+        if (atomic_dec(&f->used) == 0) {
+            MtFuture_free(f);
+        }
+        udata->future = NULL;
+    }
+    return 0;
+}
+
+/* ============================================================================================ */
+
+static const luaL_Reg FutureMethods[] = 
+{
+    { "wait",       MtFuture_wait     },
+    { "ready",      MtFuture_ready    },
+    { "results",    MtFuture_results  },
+    { NULL,         NULL } /* sentinel */
+};
+
+static const luaL_Reg FutureMetaMethods[] = 
+{
+    { "__tostring", MtFuture_toString },
+    { "__gc",       MtFuture_release  },
+    { NULL,         NULL } /* sentinel */
+};
+
+static void setupFutureMeta(lua_State* L)
+{                                                           /* -> meta */
+    lua_pushstring(L, MTSTATES_FUTURE_CLASS_NAME);          /* -> meta, className */
+    lua_setfield(L, -2, "__metatable");                     /* -> meta */
+
+    luaL_setfuncs(L, FutureMetaMethods, 0);                 /* -> meta */
+    
+    lua_newtable(L);  /* FutureClass */                     /* -> meta, FutureClass */
+    luaL_setfuncs(L, FutureMethods, 0);                     /* -> meta, FutureClass */
+    lua_setfield (L, -2, "__index");                        /* -> meta */
+}
+
+
+int mtstates_future_init_module(lua_State* L, int module)
+{
+    if (luaL_newmetatable(L, MTSTATES_FUTURE_CLASS_NAME)) {
+        setupFutureMeta(L);
+    }
+    lua_pop(L, 1);
+
+    return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef MTSTATES_FUTURE_H
+#define MTSTATES_FUTURE_H
+
+#include "util.h"
+#include "receiver_capi_impl.h"
+
+extern const char* const MTSTATES_FUTURE_CLASS_NAME;
+
+/**
+ * Result of an asynchronous state call. A future is referenced by its
+ * userdata and by the pending mailbox message.
+ */
+typedef struct MtFuture {
+    AtomicCounter    used;
+    Mutex            mutex;       /* protects the fields below */
+    bool             done;
+    bool             closed;      /* state was closed before the call was invoked */
+    bool             isMemoryError;
+    char*            errorMsg;
+    size_t           errorLength;
+    receiver_writer  results;
+    char             stateString[1];
+} MtFuture;
+
+/**
+ * Pushes a new future userdata, the returned future is referenced twice:
+ * by the userdata and by the caller which has to invoke 
+ * mtstates_future_complete() later.
+ */
+MtFuture* mtstates_future_new(lua_State* L, const char* stateString);
+
+void mtstates_future_error_handler(void* ehdata, const char* msg, size_t msglen);
+
+/**
+ * Completes the future with the return code of mtstates_state_call()
+ * and releases the caller's reference.
+ */
+void mtstates_future_complete(MtFuture* f, int rc);
+
+/**
+ * Returns the future of the userdata at the given stack index.
+ */
+MtFuture* mtstates_future_check(lua_State* L, int arg);
+
+bool mtstates_future_ready(MtFuture* f);
+
+/**
+ * Waits for the future and pushes its results or raises its error.
+ */
+int mtstates_future_push_results(lua_State* L, MtFuture* f);
+
+int mtstates_future_init_module(lua_State* L, int module);
+
+
+#endif /* MTSTATES_FUTURE_H */
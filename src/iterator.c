@@ -0,0 +1,173 @@
+#include "iterator.h"
+#include "error.h"
+#include "state_intern.h"
+
+const char* const MTSTATES_ITERATOR_CLASS_NAME = "mtstates.iterator";
+
+typedef struct IteratorUserData {
+    MtState*      state;
+    int           ref;      /* generator in the state, LUA_NOREF if finished */
+    bool          release;  /* state is released between iteration steps */
+    bool          isHeld;   /* state is acquired by the iterator */
+} IteratorUserData;
+
+static void setupIteratorMeta(lua_State* L);
+
+static int pushIteratorMeta(lua_State* L)
+{
+    if (luaL_newmetatable(L, MTSTATES_ITERATOR_CLASS_NAME)) {
+        setupIteratorMeta(L);
+    }
+    return 1;
+}
+
+static void closeIterator(IteratorUserData* udata)
+{
+    if (udata->ref != LUA_NOREF) {
+        mtstates_state_unref(udata->state, udata->ref, udata->isHeld);
+        udata->ref = LUA_NOREF;
+    }
+    if (udata->isHeld) {
+        udata->isHeld = false;
+        mtstates_state_unhold(udata->state);
+    }
+}
+
+int mtstates_iterator_push(lua_State* L, MtState* s, IterStart* iter)
+{
+    IteratorUserData* udata = lua_newuserdata(L, sizeof(IteratorUserData));
+    memset(udata, 0, sizeof(IteratorUserData));
+    udata->ref = LUA_NOREF;
+    pushIteratorMeta(L);        /* -> udata, meta */
+    lua_setmetatable(L, -2);    /* -> udata */
+
+    udata->state   = s;
+    udata->ref     = iter->ref;
+    udata->release = iter->release;
+    udata->isHeld  = iter->isHeld;
+    atomic_inc(&s->used);
+    iter->ref = LUA_NOREF;
+    if (udata->isHeld) {
+        mtstates_state_hold(s, udata);
+    }
+    
+#if LUA_VERSION_NUM >= 504
+    /* to-be-closed variable for the generic for */
+    lua_pushnil(L);
+    lua_pushnil(L);
+    lua_pushvalue(L, -3);
+    return 4;
+#else
+    return 1;
+#endif
+}
+
+static int nextStep2(lua_State* L)
+{
+    IteratorUserData* udata = (IteratorUserData*)lua_touserdata(L, 1);
+    if (udata->isHeld) {
+        /* the iterator may have been passed to another thread */
+        mtstates_state_takeover(udata->state, udata);
+    }
+    return mtstates_state_call_method(L, false, 2, udata->state, udata->ref);
+}
+
+static int MtIterator_call(lua_State* L)
+{
+    IteratorUserData* udata = luaL_checkudata(L, 1, MTSTATES_ITERATOR_CLASS_NAME);
+    
+    if (udata->ref == LUA_NOREF) {
+        return 0;
+    }
+    lua_settop(L, 1);
+    lua_pushcfunction(L, nextStep2);    /* -> udata, nextStep2 */
+    lua_pushlightuserdata(L, udata);    /* -> udata, nextStep2, udataptr */
+    
+    if (lua_pcall(L, 1, LUA_MULTRET, 0) != LUA_OK) {
+        closeIterator(udata);
+        return lua_error(L);
+    }
+    int nrslts = lua_gettop(L) - 1;
+    if (nrslts == 0 || lua_isnil(L, 2)) {
+        closeIterator(udata);
+        return 0;
+    }
+    return nrslts;
+}
+
+static int MtIterator_close(lua_State* L)
+{
+    IteratorUserData* udata = luaL_checkudata(L, 1, MTSTATES_ITERATOR_CLASS_NAME);
+    closeIterator(udata);
+    return 0;
+}
+
+static int MtIterator_toString(lua_State* L)
+{
+    IteratorUserData* udata = luaL_checkudata(L, 1, MTSTATES_ITERATOR_CLASS_NAME);
+    
+    if (udata->state) {
+        const char* stateString = mtstates_state_tostring(L, udata->state);
+        lua_pushfstring(L, "%s: %p (%s)", MTSTATES_ITERATOR_CLASS_NAME, udata, stateString);
+    } else {
+        lua_pushfstring(L, "%s: invalid", MTSTATES_ITERATOR_CLASS_NAME);
+    }
+    return 1;
+}
+
+static int MtIterator_release(lua_State* L)
+{
+    IteratorUserData* udata = luaL_checkudata(L, 1, MTSTATES_ITERATOR_CLASS_NAME);
+    MtState*          s     = udata->state;
+    
+    if (s) {
+        closeIterator(udata);
+        if (atomic_dec(&s->used) <= 0) {
+            mtstates_state_free(s);
+        }
+        udata->state = NULL;
+    }
+    return 0;
+}
+
+/* ============================================================================================ */
+
+static const luaL_Reg IteratorMethods[] = 
+{
+    { "close",      MtIterator_close    },
+    { NULL,         NULL } /* sentinel */
+};
+
+static const luaL_Reg IteratorMetaMethods[] = 
+{
+    { "__call",     MtIterator_call     },
+    { "__tostring", MtIterator_toString },
+    { "__gc",       MtIterator_release  },
+#if LUA_VERSION_NUM >= 504
+    { "__close",    MtIterator_close    },
+#endif
+    { NULL,         NULL } /* sentinel */
+};
+
+static void setupIteratorMeta(lua_State* L)
+{                                                           /* -> meta */
+    lua_pushstring(L, MTSTATES_ITERATOR_CLASS_NAME);        /* -> meta, className */
+    lua_setfield(L, -2, "__metatable");                     /* -> meta */
+
+    luaL_setfuncs(L, IteratorMetaMethods, 0);               /* -> meta */
+    
+    lua_newtable(L);  /* IteratorClass */                   /* -> meta, IteratorClass */
+    luaL_setfuncs(L, IteratorMethods, 0);                   /* -> meta, IteratorClass */
+    lua_setfield (L, -2, "__index");                        /* -> meta */
+}
+
+
+int mtstates_iterator_init_module(lua_State* L, int module)
+{
+    if (luaL_newmetatable(L, MTSTATES_ITERATOR_CLASS_NAME)) {
+        setupIteratorMeta(L);
+    }
+    lua_pop(L, 1);
+
+    return 0;
+}
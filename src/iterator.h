@@ -0,0 +1,20 @@
+#ifndef MTSTATES_ITERATOR_H
+#define MTSTATES_ITERATOR_H
+
+#include "util.h"
+
+extern const char* const MTSTATES_ITERATOR_CLASS_NAME;
+
+struct MtState;
+struct IterStart;
+
+/**
+ * Pushes an iterator that takes over the generator and the acquired state
+ * from iter. Returns the number of values pushed for the generic for.
+ */
+int mtstates_iterator_push(lua_State* L, struct MtState* s, struct IterStart* iter);
+
+int mtstates_iterator_init_module(lua_State* L, int module);
+
+
+#endif /* MTSTATES_ITERATOR_H */
@@ -0,0 +1,282 @@
+#include "mailbox.h"
+#include "future.h"
+#include "state.h"
+#include "error.h"
+#include "state_intern.h"
+
+void mtstates_mailbox_init(Mailbox* m)
+{
+    memset(m, 0, sizeof(Mailbox));
+    async_mutex_init(&m->mutex);
+    async_mutex_init(&m->doneMutex);
+}
+
+static MailboxMessage* newMessage()
+{
+    MailboxMessage* msg = malloc(sizeof(MailboxMessage));
+    if (msg) {
+        if (mtstates_membuf_init(&msg->writer.mem, 0, 2)) {
+            msg->nextMessage  = NULL;
+            msg->future       = NULL;
+            msg->writer.nargs = 0;
+            msg->writer.retained = 0;
+        } else {
+            free(msg);
+            msg = NULL;
+        }
+    }
+    return msg;
+}
+
+static void freeMessage(MailboxMessage* msg)
+{
+    mtstates_writer_release_values(&msg->writer);
+    mtstates_membuf_free(&msg->writer.mem);
+    free(msg);
+}
+
+/* completes a future of a message that was not invoked */
+static void dropMessage(MailboxMessage* msg)
+{
+    if (msg->future) {
+        mtstates_future_complete(msg->future, 101);
+    }
+    freeMessage(msg);
+}
+
+static void addDone(Mailbox* m, lua_Integer count)
+{
+    async_mutex_lock(&m->doneMutex);
+    m->doneCount += count;
+    async_mutex_notify(&m->doneMutex);
+    async_mutex_unlock(&m->doneMutex);
+}
+
+/* mutex must be held */
+static void discardMessages(Mailbox* m)
+{
+    lua_Integer count = 0;
+    while (m->firstMessage) {
+        MailboxMessage* msg = m->firstMessage;
+        m->firstMessage = msg->nextMessage;
+        dropMessage(msg);
+        count += 1;
+    }
+    m->lastMessage = NULL;
+    if (count > 0) {
+        addDone(m, count);
+    }
+}
+
+void mtstates_mailbox_error_handler(void* ehdata, const char* msg, size_t msglen)
+{
+    Mailbox* m = (Mailbox*) ehdata;
+    async_mutex_lock(&m->doneMutex);
+    if (!m->errorMsg) {
+        m->errorMsg = malloc(msglen + 1);
+        if (m->errorMsg) {
+            memcpy(m->errorMsg, msg, msglen);
+            m->errorMsg[msglen] = '\0';
+            m->errorLength = msglen;
+        }
+    }
+    async_mutex_unlock(&m->doneMutex);
+}
+
+/*
+ * The worker thread is detached and holds a reference to the state, i.e. the
+ * state is freed by the worker if it is the last one referencing the state.
+ */
+static void workerMain(void* arg)
+{
+    MtState* s = (MtState*) arg;
+    Mailbox* m = &s->mailbox;
+
+    async_mutex_lock(&m->mutex);
+    while (true) {
+        while (!m->firstMessage && !m->stopping) {
+            async_mutex_wait(&m->mutex);
+        }
+        if (m->stopping) {
+            break;
+        }
+        MailboxMessage* msg = m->firstMessage;
+        m->firstMessage = msg->nextMessage;
+        if (!m->firstMessage) {
+            m->lastMessage = NULL;
+        }
+        async_mutex_unlock(&m->mutex);
+
+        MtFuture* f = msg->future;
+        if (f) {
+            int rc = mtstates_state_call(NULL, false, 0, s, &msg->writer, &f->results, 
+                                         mtstates_future_error_handler, f);
+            mtstates_future_complete(f, rc);
+        } else {
+            int rc = mtstates_state_call(NULL, false, 0, s, &msg->writer, NULL, 
+                                         mtstates_mailbox_error_handler, m);
+            if (rc == 999) {
+                const char* details = "not enough memory";
+                mtstates_mailbox_error_handler(m, details, strlen(details));
+            }
+        }
+        freeMessage(msg);
+        addDone(m, 1);
+
+        async_mutex_lock(&m->mutex);
+    }
+    m->hasWorker = false;
+    m->stopping  = false;
+    discardMessages(m);
+    async_mutex_unlock(&m->mutex);
+    
+    if (atomic_dec(&s->used) <= 0) {
+        mtstates_state_free(s);
+    }
+}
+
+void mtstates_mailbox_stop(MtState* s)
+{
+    Mailbox* m = &s->mailbox;
+
+    async_mutex_lock(&m->mutex);
+    if (!m->hasWorker || m->stopping) {
+        async_mutex_unlock(&m->mutex);
+        return;
+    }
+    m->stopping = true;
+    async_mutex_notify(&m->mutex);
+    async_mutex_unlock(&m->mutex);
+}
+
+void mtstates_mailbox_free(Mailbox* m)
+{
+    discardMessages(m);
+    if (m->errorMsg) {
+        free(m->errorMsg);
+    }
+    async_mutex_destruct(&m->doneMutex);
+    async_mutex_destruct(&m->mutex);
+}
+
+static void raisePendingError(lua_State* L, MtState* s)
+{
+    Mailbox* m = &s->mailbox;
+
+    async_mutex_lock(&m->doneMutex);
+    char*  errorMsg    = m->errorMsg;
+    size_t errorLength = m->errorLength;
+    m->errorMsg = NULL;
+    async_mutex_unlock(&m->doneMutex);
+
+    if (errorMsg) {
+        lua_pushlstring(L, errorMsg, errorLength);
+        free(errorMsg);
+        const char* stateString = mtstates_state_tostring(L, s); /* -> errorString, stateString */
+        mtstates_ERROR_INVOKING_STATE(L, stateString, lua_tostring(L, -2));
+    }
+}
+
+/* the caller's reference to the future is passed to the message */
+static int postMessage(lua_State* L, MtState* s, int firstArg, int lastArg, MtFuture* f)
+{
+    Mailbox* m = &s->mailbox;
+
+    MailboxMessage* msg = newMessage();
+    if (!msg) {
+        if (f) {
+            mtstates_future_complete(f, 101);
+        }
+        return mtstates_ERROR_OUT_OF_MEMORY(L);
+    }
+    msg->future = f;
+    int arg;
+    for (arg = firstArg; arg <= lastArg; ++arg) {
+        int rc = mtstates_writer_add_value(L, arg, &msg->writer);
+        if (rc != 0) {
+            dropMessage(msg);
+            if (rc > 0) {
+                return luaL_argerror(L, arg, lua_tostring(L, -1));
+            } else {
+                return mtstates_ERROR_OUT_OF_MEMORY(L);
+            }
+        }
+    }
+    async_mutex_lock(&m->mutex);
+    if (atomic_get(&s->closed)) {
+        async_mutex_unlock(&m->mutex);
+        dropMessage(msg);
+        return mtstates_ERROR_OBJECT_CLOSED(L, mtstates_state_tostring(L, s));
+    }
+    if (!m->hasWorker) {
+        mtstates_util_pin_module();
+        atomic_inc(&s->used); /* released by the worker */
+        if (!async_thread_start(&m->worker, workerMain, s)) {
+            atomic_dec(&s->used);
+            async_mutex_unlock(&m->mutex);
+            dropMessage(msg);
+            return mtstates_ERROR_OUT_OF_MEMORY(L);
+        }
+        async_thread_detach(&m->worker);
+        m->hasWorker = true;
+    }
+    if (m->lastMessage) {
+        m->lastMessage->nextMessage = msg;
+    } else {
+        m->firstMessage = msg;
+    }
+    m->lastMessage   = msg;
+    m->postedCount += 1;
+    async_mutex_notify(&m->mutex);
+    async_mutex_unlock(&m->mutex);
+    return 0;
+}
+
+int mtstates_mailbox_post(lua_State* L, MtState* s, int firstArg, int lastArg)
+{
+    raisePendingError(L, s);
+    return postMessage(L, s, firstArg, lastArg, NULL);
+}
+
+int mtstates_mailbox_acall(lua_State* L, MtState* s, int firstArg, int lastArg)
+{
+    MtFuture* f = mtstates_future_new(L, mtstates_state_tostring(L, s)); /* -> stateString, future */
+    postMessage(L, s, firstArg, lastArg, f);
+    return 1;
+}
+
+int mtstates_mailbox_flush(lua_State* L, MtState* s, int arg)
+{
+    Mailbox* m = &s->mailbox;
+
+    bool       isTimed = !lua_isnoneornil(L, arg);
+    lua_Number endTime = 0;
+    if (isTimed) {
+        endTime = mtstates_monotonic_time_seconds() + luaL_checknumber(L, arg);
+    }
+
+    async_mutex_lock(&m->mutex);
+    lua_Integer postedCount = m->postedCount;
+    async_mutex_unlock(&m->mutex);
+
+    bool done = true;
+    async_mutex_lock(&m->doneMutex);
+    while (m->doneCount < postedCount) {
+        if (isTimed) {
+            if (mtstates_monotonic_time_seconds() < endTime) {
+                async_mutex_wait_until(&m->doneMutex, endTime);
+            } else {
+                done = false;
+                break;
+            }
+        } else {
+            async_mutex_wait(&m->doneMutex);
+        }
+    }
+    async_mutex_notify(&m->doneMutex); /* other flushing threads may be waiting */
+    async_mutex_unlock(&m->doneMutex);
+
+    raisePendingError(L, s);
+    lua_pushboolean(L, done);
+    return 1;
+}
@@ -0,0 +1,64 @@
+#ifndef MTSTATES_MAILBOX_H
+#define MTSTATES_MAILBOX_H
+
+#include "util.h"
+#include "receiver_capi_impl.h"
+
+struct MtState;
+struct MtFuture;
+
+typedef struct MailboxMessage {
+    struct MailboxMessage* nextMessage;
+    struct MtFuture*       future;       /* NULL for posted messages */
+    receiver_writer        writer;
+} MailboxMessage;
+
+/**
+ * Messages posted to a state and asynchronous calls are invoked by a worker 
+ * thread that is started with the first message and runs until the state 
+ * is closed.
+ */
+typedef struct Mailbox {
+    Mutex            mutex;        /* protects message queue and worker */
+    MailboxMessage*  firstMessage;
+    MailboxMessage*  lastMessage;
+    lua_Integer      postedCount;
+    bool             hasWorker;
+    bool             stopping;
+    AsyncThread      worker;
+
+    Mutex            doneMutex;    /* protects doneCount and errorMsg */
+    lua_Integer      doneCount;
+    char*            errorMsg;     /* first error of posted messages */
+    size_t           errorLength;
+} Mailbox;
+
+void mtstates_mailbox_init(Mailbox* m);
+
+/**
+ * Signals the worker thread to stop without waiting for it, not yet invoked
+ * messages are discarded by the worker. A message that is currently running
+ * is completed by the worker in the background.
+ */
+void mtstates_mailbox_stop(struct MtState* s);
+
+void mtstates_mailbox_free(Mailbox* m);
+
+int mtstates_mailbox_post(lua_State* L, struct MtState* s, int firstArg, int lastArg);
+
+/**
+ * Pushes a future for the results of the call.
+ */
+int mtstates_mailbox_acall(lua_State* L, struct MtState* s, int firstArg, int lastArg);
+
+int mtstates_mailbox_flush(lua_State* L, struct MtState* s, int arg);
+
+/**
+ * Records the first error of a message that was invoked without caller, 
+ * the error is raised by the next state:post() or state:flush().
+ * ehdata must point to the Mailbox.
+ */
+void mtstates_mailbox_error_handler(void* ehdata, const char* msg, size_t msglen);
+
+
+#endif /* MTSTATES_MAILBOX_H */
@@ -1,5 +1,12 @@
 #include "main.h"
 #include "state.h"
+#include "pool.h"
+#include "future.h"
+#include "method.h"
+#include "iterator.h"
+#include "setup_cache.h"
+#include "shared_carray.h"
+#include "blob.h"
 #include "error.h"
 
 #ifndef MTSTATES_VERSION
@@ -59,9 +66,16 @@ static int Mtstates_type(lua_State* L)
     return 1;
 }
 
+static int Mtstates_now(lua_State* L)
+{
+    lua_pushnumber(L, mtstates_monotonic_time_seconds());
+    return 1;
+}
+
 static const luaL_Reg ModuleFunctions[] = 
 {
     { "type",    Mtstates_type },      
+    { "now",     Mtstates_now  },      
     { NULL,      NULL          } /* sentinel */
 };
 
@@ -75,6 +89,7 @@ DLL_PUBLIC int luaopen_mtstates(lua_State* L)
         if (atomic_set_if_equal(&initStage, 0, 1)) {
             async_mutex_init(&global_mutex);
             mtstates_global_lock = &global_mutex;
+            mtstates_shared_carray_init();
             atomic_set(&initStage, 2);
         } 
         else {
@@ -171,6 +186,12 @@ DLL_PUBLIC int luaopen_mtstates(lua_State* L)
     lua_checkstack(L, LUA_MINSTACK);
     
     mtstates_state_init_module   (L, module);
+    mtstates_pool_init_module    (L, module);
+    mtstates_future_init_module  (L, module);
+    mtstates_method_init_module  (L, module);
+    mtstates_iterator_init_module(L, module);
+    mtstates_blob_init_module    (L, module);
+    mtstates_setup_cache_init_module(L, module);
     mtstates_error_init_module   (L, errorModule);
     
     lua_settop(L, module);
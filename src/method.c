@@ -0,0 +1,123 @@
+#include "method.h"
+#include "state_intern.h"
+
+const char* const MTSTATES_METHOD_CLASS_NAME = "mtstates.method";
+
+typedef struct MethodUserData {
+    MtState*      state;
+    MethodEntry*  entry;   /* owned by the state */
+} MethodUserData;
+
+static void setupMethodMeta(lua_State* L);
+
+static int pushMethodMeta(lua_State* L)
+{
+    if (luaL_newmetatable(L, MTSTATES_METHOD_CLASS_NAME)) {
+        setupMethodMeta(L);
+    }
+    return 1;
+}
+
+void mtstates_method_push(lua_State* L, MtState* s, MethodEntry* e)
+{
+    MethodUserData* udata = lua_newuserdata(L, sizeof(MethodUserData));
+    memset(udata, 0, sizeof(MethodUserData));
+    pushMethodMeta(L);       /* -> udata, meta */
+    lua_setmetatable(L, -2); /* -> udata */
+
+    udata->state = s;
+    udata->entry = e;
+    atomic_inc(&s->used);
+}
+
+static int MtMethod_call2(lua_State* L, bool isTimed)
+{
+    int arg = 1;
+    MethodUserData* udata = luaL_checkudata(L, arg++, MTSTATES_METHOD_CLASS_NAME);
+    return mtstates_state_call_method(L, isTimed, arg, udata->state, udata->entry->ref);
+}
+
+static int MtMethod_call(lua_State* L)
+{
+    return MtMethod_call2(L, false);
+}
+
+static int MtMethod_tcall(lua_State* L)
+{
+    return MtMethod_call2(L, true);
+}
+
+static int MtMethod_name(lua_State* L)
+{
+    MethodUserData* udata = luaL_checkudata(L, 1, MTSTATES_METHOD_CLASS_NAME);
+    lua_pushlstring(L, udata->entry->name, udata->entry->nameLength);
+    return 1;
+}
+
+static int MtMethod_toString(lua_State* L)
+{
+    MethodUserData* udata = luaL_checkudata(L, 1, MTSTATES_METHOD_CLASS_NAME);
+    
+    if (udata->state) {
+        const char* stateString = mtstates_state_tostring(L, udata->state);
+        lua_pushfstring(L, "%s: %p (%s, %s)", MTSTATES_METHOD_CLASS_NAME, udata, 
+                                              udata->entry->name, stateString);
+    } else {
+        lua_pushfstring(L, "%s: invalid", MTSTATES_METHOD_CLASS_NAME);
+    }
+    return 1;
+}
+
+static int MtMethod_release(lua_State* L)
+{
+    MethodUserData* udata = luaL_checkudata(L, 1, MTSTATES_METHOD_CLASS_NAME);
+    MtState*        s     = udata->state;
+    
+    if (s) {
+        if (atomic_dec(&s->used) <= 0) {
+            mtstates_state_free(s);
+        }
+        udata->state = NULL;
+    }
+    return 0;
+}
+
+/* ============================================================================================ */
+
+static const luaL_Reg MethodMethods[] = 
+{
+    { "call",       MtMethod_call     },
+    { "tcall",      MtMethod_tcall    },
+    { "name",       MtMethod_name     },
+    { NULL,         NULL } /* sentinel */
+};
+
+static const luaL_Reg MethodMetaMethods[] = 
+{
+    { "__tostring", MtMethod_toString },
+    { "__gc",       MtMethod_release  },
+    { NULL,         NULL } /* sentinel */
+};
+
+static void setupMethodMeta(lua_State* L)
+{                                                           /* -> meta */
+    lua_pushstring(L, MTSTATES_METHOD_CLASS_NAME);          /* -> meta, className */
+    lua_setfield(L, -2, "__metatable");                     /* -> meta */
+
+    luaL_setfuncs(L, MethodMetaMethods, 0);                 /* -> meta */
+    
+    lua_newtable(L);  /* MethodClass */                     /* -> meta, MethodClass */
+    luaL_setfuncs(L, MethodMethods, 0);                     /* -> meta, MethodClass */
+    lua_setfield (L, -2, "__index");                        /* -> meta */
+}
+
+
+int mtstates_method_init_module(lua_State* L, int module)
+{
+    if (luaL_newmetatable(L, MTSTATES_METHOD_CLASS_NAME)) {
+        setupMethodMeta(L);
+    }
+    lua_pop(L, 1);
+
+    return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef MTSTATES_METHOD_H
+#define MTSTATES_METHOD_H
+
+#include "util.h"
+
+extern const char* const MTSTATES_METHOD_CLASS_NAME;
+
+struct MtState;
+struct MethodEntry;
+
+/**
+ * Pushes a handle for invoking the resolved method of the state.
+ */
+void mtstates_method_push(lua_State* L, struct MtState* s, struct MethodEntry* e);
+
+int mtstates_method_init_module(lua_State* L, int module);
+
+
+#endif /* MTSTATES_METHOD_H */
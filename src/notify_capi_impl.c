@@ -48,12 +48,7 @@ static void notify_capi_releaseNotifier(notify_notifier* n)
 static int notify_capi_notify(notify_notifier* n, notifier_error_handler eh, void* ehdata)
 {
     MtState* state = (MtState*)n;
-    int rc = mtstates_state_call(NULL, false, 0, state, NULL, eh, ehdata);
-    if (rc == 101) {
-        return 1; // closed
-    } else {
-        return rc;
-    }
+    return mtstates_state_notify(state, eh, ehdata);
 }
 
 
@@ -0,0 +1,363 @@
+#include "pool.h"
+#include "state.h"
+#include "error.h"
+#include "main.h"
+#include "state_intern.h"
+
+const char* const MTSTATES_POOL_CLASS_NAME = "mtstates.pool";
+
+typedef struct MtPool {
+    lua_Integer        id;
+    AtomicCounter      used;
+    AtomicCounter      owned;
+    AtomicCounter      closed;
+    AtomicCounter      nextIndex;
+    
+    int                stateCount;
+    MtState**          states;
+
+    struct MtPool**    prevPoolPtr;
+    struct MtPool*     nextPool;
+
+} MtPool;
+
+typedef struct PoolUserData {
+    MtPool*          pool;
+    bool             isOwner;
+} PoolUserData;
+
+
+/*
+ * Pools are only looked up by id in mtstates.pool(), the list is searched
+ * linearly under mtstates_global_lock. Calls to a pool do not use the list.
+ */
+static MtPool* pool_list = NULL;
+
+static MtPool* findPoolWithId(lua_Integer poolId)
+{
+    MtPool* p = pool_list;
+    while (p != NULL) {
+        if (p->id == poolId && !atomic_get(&p->closed)) {
+            return p;
+        }
+        p = p->nextPool;
+    }
+    return NULL;
+}
+
+static const char* toLuaString(lua_State* L, PoolUserData* udata, MtPool* p)
+{
+    if (p) {
+        return lua_pushfstring(L, "%s: %p (id=%d,size=%d)", MTSTATES_POOL_CLASS_NAME, 
+                                                            udata,
+                                                            (int)p->id, 
+                                                            p->stateCount);
+    } else {
+        return lua_pushfstring(L, "%s: invalid", MTSTATES_POOL_CLASS_NAME);
+    }
+}
+
+static void setupPoolMeta(lua_State* L);
+
+static int pushPoolMeta(lua_State* L)
+{
+    if (luaL_newmetatable(L, MTSTATES_POOL_CLASS_NAME)) {
+        setupPoolMeta(L);
+    }
+    return 1;
+}
+
+static PoolUserData* newPoolUserData(lua_State* L)
+{
+    PoolUserData* udata = lua_newuserdata(L, sizeof(PoolUserData));
+    memset(udata, 0, sizeof(PoolUserData));
+    pushPoolMeta(L);         /* -> udata, meta */
+    lua_setmetatable(L, -2); /* -> udata */
+    return udata;
+}
+
+static int Mtstates_newPool(lua_State* L)
+{
+    int arg = 1;
+    lua_Integer n = luaL_checkinteger(L, arg++);
+    if (n < 1 || n > INT_MAX) {
+        return luaL_argerror(L, 1, "positive integer expected");
+    }
+    const int firstArg = arg;
+    const int lastArg  = lua_gettop(L);
+
+    PoolUserData* udata = newPoolUserData(L);
+    int poolUdata = lua_gettop(L);
+
+    MtPool* p = calloc(1, sizeof(MtPool));
+    if (p == NULL) {
+        return mtstates_ERROR_OUT_OF_MEMORY(L);
+    }
+    p->used        = 1;
+    p->owned       = 1;
+    udata->pool    = p; /* now udata is responsible for freeing p */
+    udata->isOwner = true;
+
+    p->states = calloc(n, sizeof(MtState*));
+    if (p->states == NULL) {
+        return mtstates_ERROR_OUT_OF_MEMORY(L);
+    }
+    luaL_checkstack(L, lastArg - firstArg + LUA_MINSTACK, NULL);
+    
+    int i;
+    for (i = 0; i < n; ++i) {
+        lua_pushcfunction(L, mtstates_state_newstate);
+        lua_pushnil(L); /* no state name, arg positions are the same as for newpool */
+        int a;
+        for (a = firstArg; a <= lastArg; ++a) {
+            lua_pushvalue(L, a);
+        }
+        lua_call(L, lastArg - firstArg + 2, 1);
+        
+        StateUserData* stateUdata = lua_touserdata(L, -1);
+        p->states[i] = stateUdata->state;
+        p->stateCount += 1;
+        stateUdata->state = NULL; /* ownership is transfered to pool */
+        lua_pop(L, 1);
+    }
+    
+    async_mutex_lock(mtstates_global_lock);
+    {
+        p->id = atomic_inc(&mtstates_id_counter);
+        if (pool_list) {
+            pool_list->prevPoolPtr = &p->nextPool;
+        }
+        p->nextPool    = pool_list;
+        p->prevPoolPtr = &pool_list;
+        pool_list      = p;
+    }
+    async_mutex_unlock(mtstates_global_lock);
+
+    lua_settop(L, poolUdata);
+    return 1;
+}
+
+static int Mtstates_pool(lua_State* L)
+{
+    int arg = 1;
+    if (lua_type(L, arg) != LUA_TNUMBER || !lua_isinteger(L, arg)) {
+        return luaL_argerror(L, arg, "pool id expected");
+    }
+    lua_Integer poolId = lua_tointeger(L, arg++);
+
+    PoolUserData* udata = newPoolUserData(L);
+
+    async_mutex_lock(mtstates_global_lock);
+    
+    MtPool* p = findPoolWithId(poolId);
+    if (p) {
+        atomic_inc(&p->used);
+        udata->pool = p;
+    }
+    async_mutex_unlock(mtstates_global_lock);
+
+    if (!p) {
+        return mtstates_ERROR_UNKNOWN_OBJECT_pool_id(L, poolId);
+    }
+    return 1;
+}
+
+static void MtPool_free(MtPool* p)
+{
+    if (p->prevPoolPtr) {
+        *p->prevPoolPtr = p->nextPool;
+    }
+    if (p->nextPool) {
+        p->nextPool->prevPoolPtr = p->prevPoolPtr;
+    }
+    int i;
+    for (i = 0; i < p->stateCount; ++i) {
+        MtState* s = p->states[i];
+        if (atomic_dec(&s->used) <= 0) {
+            mtstates_state_free(s);
+        }
+    }
+    if (p->states) {
+        free(p->states);
+    }
+    free(p);
+}
+
+static int MtPool_release(lua_State* L)
+{
+    PoolUserData* udata = luaL_checkudata(L, 1, MTSTATES_POOL_CLASS_NAME);
+    MtPool*       p     = udata->pool;
+
+    if (p) {
+        if (udata->isOwner) {
+            /* without global lock: the mailbox workers of the states are not awaited */
+            if (atomic_dec(&p->owned) == 0) {
+                atomic_set(&p->closed, true);
+                int i;
+                for (i = 0; i < p->stateCount; ++i) {
+                    mtstates_state_disown(p->states[i]);
+                }
+            }
+        }
+        async_mutex_lock(mtstates_global_lock);
+
+        if (atomic_dec(&p->used) == 0) {
+            MtPool_free(p);
+        }
+        udata->pool = NULL;
+
+        async_mutex_unlock(mtstates_global_lock);
+    }
+    return 0;
+}
+
+/**
+ * Picks the next state that is not busy without taking any lock. If reserve 
+ * is true, the state is marked busy so that concurrent pool calls choose 
+ * other states. If all states are busy, the states are taken in turn.
+ * A reservation must be followed by acquireState() which either takes over
+ * the busy mark or clears it.
+ */
+static MtState* selectState(MtPool* p, bool reserve)
+{
+    int n     = p->stateCount;
+    int start = ((unsigned int)atomic_inc(&p->nextIndex)) % n;
+    int i;
+    for (i = 0; i < n; ++i) {
+        MtState* s = p->states[(start + i) % n];
+        if (reserve ? atomic_set_if_equal(&s->busyFlag, MTSTATES_STATE_FREE, MTSTATES_STATE_RESERVED)
+                    : atomic_get(&s->busyFlag) == MTSTATES_STATE_FREE) 
+        {
+            return s;
+        }
+    }
+    return p->states[start];
+}
+
+static int MtPool_call2(lua_State* L, bool isTimed)
+{
+    int arg = 1;
+    PoolUserData* udata = luaL_checkudata(L, arg++, MTSTATES_POOL_CLASS_NAME);
+    MtPool*       p     = udata->pool;
+    
+    if (atomic_get(&p->closed)) {
+        return mtstates_ERROR_OBJECT_CLOSED(L, toLuaString(L, udata, p));
+    }
+    /* reserving is only safe if mtstates_state_call() will not fail with trylock */
+    bool reserve = !isTimed || luaL_checknumber(L, arg) > 0;
+    
+    /* mtstates_state_call() must not raise before acquiring the reserved state */
+    luaL_checkstack(L, LUA_MINSTACK + 3, NULL);
+    
+    return mtstates_state_call(L, isTimed, arg, selectState(p, reserve), NULL, NULL, NULL, NULL);
+}
+
+static int MtPool_call(lua_State* L)
+{
+    return MtPool_call2(L, false);
+}
+
+static int MtPool_tcall(lua_State* L)
+{
+    return MtPool_call2(L, true);
+}
+
+static int MtPool_toString(lua_State* L)
+{
+    PoolUserData* udata = luaL_checkudata(L, 1, MTSTATES_POOL_CLASS_NAME);
+    
+    toLuaString(L, udata, udata->pool);
+    return 1;
+}
+
+static int MtPool_id(lua_State* L)
+{
+    int arg = 1;
+    PoolUserData* udata = luaL_checkudata(L, arg++, MTSTATES_POOL_CLASS_NAME);
+    lua_pushinteger(L, udata->pool->id);
+    return 1;
+}
+
+static int MtPool_size(lua_State* L)
+{
+    int arg = 1;
+    PoolUserData* udata = luaL_checkudata(L, arg++, MTSTATES_POOL_CLASS_NAME);
+    lua_pushinteger(L, udata->pool->stateCount);
+    return 1;
+}
+
+static int MtPool_state(lua_State* L)
+{
+    int arg = 1;
+    PoolUserData* udata = luaL_checkudata(L, arg++, MTSTATES_POOL_CLASS_NAME);
+    MtPool*       p     = udata->pool;
+    lua_Integer   i     = luaL_checkinteger(L, arg);
+    if (i < 1 || i > p->stateCount) {
+        return luaL_argerror(L, arg, "index out of range");
+    }
+    mtstates_state_push_reference(L, p->states[i - 1]);
+    return 1;
+}
+
+static int MtPool_isOwner(lua_State* L)
+{
+    int arg = 1;
+    PoolUserData* udata = luaL_checkudata(L, arg++, MTSTATES_POOL_CLASS_NAME);
+    lua_pushboolean(L, udata->isOwner);
+    return 1;
+}
+
+/* ============================================================================================ */
+
+static const luaL_Reg PoolMethods[] = 
+{
+    { "id",         MtPool_id         },
+    { "size",       MtPool_size       },
+    { "state",      MtPool_state      },
+    { "call",       MtPool_call       },
+    { "tcall",      MtPool_tcall      },
+    { "isowner",    MtPool_isOwner    },
+    { NULL,         NULL } /* sentinel */
+};
+
+static const luaL_Reg PoolMetaMethods[] = 
+{
+    { "__tostring", MtPool_toString },
+    { "__gc",       MtPool_release  },
+    { NULL,         NULL } /* sentinel */
+};
+
+static const luaL_Reg ModuleFunctions[] = 
+{
+    { "newpool",   Mtstates_newPool   },
+    { "pool",      Mtstates_pool      },
+    { NULL,        NULL } /* sentinel */
+};
+
+static void setupPoolMeta(lua_State* L)
+{                                                           /* -> meta */
+    lua_pushstring(L, MTSTATES_POOL_CLASS_NAME);            /* -> meta, className */
+    lua_setfield(L, -2, "__metatable");                     /* -> meta */
+
+    luaL_setfuncs(L, PoolMetaMethods, 0);                   /* -> meta */
+    
+    lua_newtable(L);  /* PoolClass */                       /* -> meta, PoolClass */
+    luaL_setfuncs(L, PoolMethods, 0);                       /* -> meta, PoolClass */
+    lua_setfield (L, -2, "__index");                        /* -> meta */
+}
+
+
+int mtstates_pool_init_module(lua_State* L, int module)
+{
+    if (luaL_newmetatable(L, MTSTATES_POOL_CLASS_NAME)) {
+        setupPoolMeta(L);
+    }
+    lua_pop(L, 1);
+
+    lua_pushvalue(L, module);
+        luaL_setfuncs(L, ModuleFunctions, 0);
+    lua_pop(L, 1);
+
+    return 0;
+}
+
@@ -0,0 +1,11 @@
+#ifndef MTSTATES_POOL_H
+#define MTSTATES_POOL_H
+
+#include "util.h"
+
+extern const char* const MTSTATES_POOL_CLASS_NAME;
+
+int mtstates_pool_init_module(lua_State* L, int module);
+
+
+#endif /* MTSTATES_POOL_H */
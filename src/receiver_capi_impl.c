@@ -1,7 +1,10 @@
+#define CARRAY_CAPI_IMPLEMENT_REQUIRE_CAPI 1
+
 #include "receiver_capi_impl.h"
 #include "state.h"
 #include "state_intern.h"
 #include "carray_capi.h"
+#include "blob.h"
 
 static receiver_object* toReceiver(lua_State* L, int index)
 {
@@ -45,6 +48,7 @@ static receiver_writer* newWriter(size_t initialCapacity, float growFactor)
     if (writer) {
         if (mtstates_membuf_init(&writer->mem, initialCapacity, growFactor)) {
             writer->nargs = 0;
+            writer->retained = 0;
         } else {
             free(writer);
             writer = NULL;
@@ -55,6 +59,7 @@ static receiver_writer* newWriter(size_t initialCapacity, float growFactor)
 static void freeWriter(receiver_writer* writer)
 {
     if (writer) {
+        mtstates_writer_release_values(writer);
         mtstates_membuf_free(&writer->mem);
         free(writer);
     }
@@ -62,6 +67,7 @@ static void freeWriter(receiver_writer* writer)
 
 static void clearWriter(receiver_writer* writer)
 {
+    mtstates_writer_release_values(writer);
     writer->mem.bufferStart  = writer->mem.bufferData;
     writer->mem.bufferLength = 0;
     writer->nargs = 0;
@@ -146,17 +152,21 @@ static int addStringToWriter(receiver_writer* writer, const char* value, size_t
     return rc;
 }
 
+/*
+ * The bytes are stored as one run, nargs counts each byte because the 
+ * receiving state may deliver each byte as separate argument.
+ */
 static int addBytesToWriter(receiver_writer* writer, const unsigned char* value, size_t len)
 {
-    int rc = mtstates_membuf_reserve(&writer->mem, 2*len);
+    size_t args_size = 1 + sizeof(size_t) + len;
+    int rc = mtstates_membuf_reserve(&writer->mem, args_size);
     if (rc == 0) {
         char* dest = writer->mem.bufferStart + writer->mem.bufferLength;
-        size_t i;
-        for (i = 0; i < len; ++i) {
-            *dest++ = BUFFER_BYTE;
-            *dest++ = ((char)(value[i]));
-        }
-        writer->mem.bufferLength += 2*len;
+        *dest++ = BUFFER_BYTES;
+        memcpy(dest, &len, sizeof(size_t));
+        dest += sizeof(size_t);
+        memcpy(dest, value, len);
+        writer->mem.bufferLength += args_size;
         writer->nargs += len;
     }
     return rc;
@@ -211,14 +221,617 @@ static int msgToReceiver(receiver_object* receiver, receiver_writer* writer,
                          receiver_error_handler eh, void* ehdata)
 {
     MtState* state = (MtState*)receiver;
-    int rc = mtstates_state_call(NULL, false, 0, state, writer, eh, ehdata);
+    int rc = mtstates_state_receive(state, writer, clear, nonblock, eh, ehdata);
     if (rc == 0) {
         clearWriter(writer);
     }
-    if (rc == 101) {
-        return 1; // closed
+    return rc;
+}
+
+/* 
+ * Maps pointers of tables and string keys to their ids within one message,
+ * open addressing with linear probing.
+ */
+typedef struct {
+    const void** keys;
+    size_t*      ids;
+    size_t       capacity;  /* power of 2 */
+    size_t       count;
+} PointerMap;
+
+static size_t hashPointer(const void* p, size_t capacity)
+{
+    size_t h = (size_t)p;
+    h ^= h >> 4;
+    h *= (size_t)0x9E3779B97F4A7C15ULL;
+    return (h ^ (h >> 16)) & (capacity - 1);
+}
+
+static void freePointerMap(PointerMap* map)
+{
+    free(map->keys);
+    free(map->ids);
+}
+
+static size_t getPointerId(const PointerMap* map, const void* p)
+{
+    if (map->count > 0) {
+        size_t i = hashPointer(p, map->capacity);
+        while (map->keys[i]) {
+            if (map->keys[i] == p) {
+                return map->ids[i];
+            }
+            i = (i + 1) & (map->capacity - 1);
+        }
+    }
+    return 0;
+}
+
+static int addPointerId(PointerMap* map, const void* p, size_t id)
+{
+    if (2 * (map->count + 1) > map->capacity) {
+        PointerMap newMap;
+        newMap.capacity = map->capacity ? 2 * map->capacity : 32;
+        newMap.count    = 0;
+        newMap.keys     = calloc(newMap.capacity, sizeof(const void*));
+        newMap.ids      = malloc(newMap.capacity * sizeof(size_t));
+        if (!newMap.keys || !newMap.ids) {
+            freePointerMap(&newMap);
+            return -1;
+        }
+        size_t i;
+        for (i = 0; i < map->capacity; ++i) {
+            if (map->keys[i]) {
+                addPointerId(&newMap, map->keys[i], map->ids[i]);
+            }
+        }
+        freePointerMap(map);
+        *map = newMap;
+    }
+    size_t i = hashPointer(p, map->capacity);
+    while (map->keys[i]) {
+        i = (i + 1) & (map->capacity - 1);
+    }
+    map->keys[i] = p;
+    map->ids[i]  = id;
+    map->count  += 1;
+    return 0;
+}
+
+typedef struct {
+    PointerMap map;
+    size_t     tableCount;
+    size_t     keyCount;
+    int        depth;
+    size_t     retained;
+} WriterContext;
+
+static int addValue(lua_State* L, int index, MemBuffer* b, WriterContext* ctx);
+
+/*
+ * Short string keys are interned: the first occurrence is written as 
+ * BUFFER_KEY, following occurrences as BUFFER_KEYREF with the key's id.
+ * Lua interns short strings, i.e. equal keys have the same pointer.
+ */
+static int addKey(lua_State* L, int index, MemBuffer* b, WriterContext* ctx)
+{
+    if (lua_type(L, index) == LUA_TSTRING) {
+        size_t      len;
+        const char* str = lua_tolstring(L, index, &len);
+        if (len <= 0xff) {
+            size_t id = getPointerId(&ctx->map, str);
+            if (id) {
+                unsigned short keyId = (unsigned short)id;
+                if (mtstates_membuf_reserve(b, 1 + sizeof(unsigned short)) != 0) return -1;
+                b->bufferStart[b->bufferLength++] = BUFFER_KEYREF;
+                memcpy(b->bufferStart + b->bufferLength, &keyId, sizeof(unsigned short));
+                b->bufferLength += sizeof(unsigned short);
+                return 0;
+            }
+            if (ctx->keyCount < USHRT_MAX) {
+                if (addPointerId(&ctx->map, str, ++ctx->keyCount) != 0) return -1;
+                if (mtstates_membuf_reserve(b, 2 + len) != 0) return -1;
+                b->bufferStart[b->bufferLength++] = BUFFER_KEY;
+                b->bufferStart[b->bufferLength++] = (char)len;
+                memcpy(b->bufferStart + b->bufferLength, str, len);
+                b->bufferLength += len;
+                return 0;
+            }
+        }
+    }
+    return addValue(L, index, b, ctx);
+}
+
+/*
+ * Tables are written as array count, the values of the array part and the
+ * remaining key value pairs terminated by BUFFER_END. Tables that were
+ * already written in the same message are written as BUFFER_TABLEREF.
+ */
+static int addTable(lua_State* L, int index, MemBuffer* b, WriterContext* ctx)
+{
+    const void* ptr = lua_topointer(L, index);
+    size_t      id  = getPointerId(&ctx->map, ptr);
+    if (id) {
+        if (mtstates_membuf_reserve(b, 1 + sizeof(size_t)) != 0) return -1;
+        b->bufferStart[b->bufferLength++] = BUFFER_TABLEREF;
+        memcpy(b->bufferStart + b->bufferLength, &id, sizeof(size_t));
+        b->bufferLength += sizeof(size_t);
+        return 0;
+    }
+    if (ctx->depth >= MTSTATES_TABLE_MAXDEPTH || !lua_checkstack(L, LUA_MINSTACK)) {
+        lua_pushliteral(L, "table nesting too deep");
+        return 1;
+    }
+    if (addPointerId(&ctx->map, ptr, ++ctx->tableCount) != 0) return -1;
+    ctx->depth += 1;
+
+    size_t n = lua_rawlen(L, index);
+    if (mtstates_membuf_reserve(b, 1 + sizeof(size_t)) != 0) return -1;
+    b->bufferStart[b->bufferLength++] = BUFFER_TABLE;
+    memcpy(b->bufferStart + b->bufferLength, &n, sizeof(size_t));
+    b->bufferLength += sizeof(size_t);
+
+    size_t i;
+    for (i = 1; i <= n; ++i) {
+        lua_rawgeti(L, index, i);                            /* -> value */
+        int rc = addValue(L, lua_gettop(L), b, ctx);
+        if (rc != 0) {
+            return rc;
+        }
+        lua_pop(L, 1);                                       /* -> */
+    }
+    lua_pushnil(L);                                          /* -> nil */
+    while (lua_next(L, index)) {                             /* -> key, value */
+        int key = lua_gettop(L) - 1;
+        if (lua_isinteger(L, key)) {
+            lua_Integer k = lua_tointeger(L, key);
+            if (1 <= k && (size_t)k <= n) {
+                lua_pop(L, 1);                               /* -> key */
+                continue;
+            }
+        }
+        int rc = addKey(L, key, b, ctx);
+        if (rc == 0) {
+            rc = addValue(L, key + 1, b, ctx);
+        }
+        if (rc != 0) {
+            return rc;
+        }
+        lua_pop(L, 1);                                       /* -> key */
+    }
+    if (mtstates_membuf_reserve(b, 1) != 0) return -1;
+    b->bufferStart[b->bufferLength++] = BUFFER_END;
+    ctx->depth -= 1;
+    return 0;
+}
+
+static int addValue(lua_State* L, int index, MemBuffer* b, WriterContext* ctx)
+{
+    int tp = lua_type(L, index);
+    switch (tp) {
+        case LUA_TNIL: {
+            if (mtstates_membuf_reserve(b, 1) != 0) return -1;
+            b->bufferStart[b->bufferLength++] = BUFFER_NIL;
+            break;
+        }
+        case LUA_TBOOLEAN: {
+            if (mtstates_membuf_reserve(b, 2) != 0) return -1;
+            b->bufferStart[b->bufferLength++] = BUFFER_BOOLEAN;
+            b->bufferStart[b->bufferLength++] = lua_toboolean(L, index);
+            break;
+        }
+        case LUA_TNUMBER: {
+            if (lua_isinteger(L, index)) {
+                lua_Integer value = lua_tointeger(L, index);
+                if (mtstates_membuf_reserve(b, 1 + sizeof(lua_Integer)) != 0) return -1;
+                b->bufferStart[b->bufferLength++] = BUFFER_INTEGER;
+                memcpy(b->bufferStart + b->bufferLength, &value, sizeof(lua_Integer));
+                b->bufferLength += sizeof(lua_Integer);
+            } else {
+                lua_Number value = lua_tonumber(L, index);
+                if (mtstates_membuf_reserve(b, 1 + sizeof(lua_Number)) != 0) return -1;
+                b->bufferStart[b->bufferLength++] = BUFFER_NUMBER;
+                memcpy(b->bufferStart + b->bufferLength, &value, sizeof(lua_Number));
+                b->bufferLength += sizeof(lua_Number);
+            }
+            break;
+        }
+        case LUA_TSTRING: {
+            size_t      len;
+            const char* str = lua_tolstring(L, index, &len);
+            if (mtstates_membuf_reserve(b, 1 + sizeof(size_t) + len) != 0) return -1;
+            b->bufferStart[b->bufferLength++] = BUFFER_STRING;
+            memcpy(b->bufferStart + b->bufferLength, &len, sizeof(size_t));
+            b->bufferLength += sizeof(size_t);
+            memcpy(b->bufferStart + b->bufferLength, str, len);
+            b->bufferLength += len;
+            break;
+        }
+        case LUA_TLIGHTUSERDATA: {
+            void* value = lua_touserdata(L, index);
+            if (mtstates_membuf_reserve(b, 1 + sizeof(void*)) != 0) return -1;
+            b->bufferStart[b->bufferLength++] = BUFFER_LIGHTUSERDATA;
+            memcpy(b->bufferStart + b->bufferLength, &value, sizeof(void*));
+            b->bufferLength += sizeof(void*);
+            break;
+        }
+        case LUA_TTABLE: {
+            return addTable(L, index, b, ctx);
+        }
+        case LUA_TUSERDATA: {
+            MtBlob* blob = mtstates_blob_test(L, index);
+            if (blob) {
+                if (mtstates_membuf_reserve(b, 1 + sizeof(MtBlob*)) != 0) return -1;
+                b->bufferStart[b->bufferLength++] = BUFFER_BLOB;
+                memcpy(b->bufferStart + b->bufferLength, &blob, sizeof(MtBlob*));
+                b->bufferLength += sizeof(MtBlob*);
+                mtstates_blob_retain(blob);
+                ctx->retained += 1;
+                break;
+            }
+            StateUserData* sdata = luaL_testudata(L, index, MTSTATES_STATE_CLASS_NAME);
+            if (sdata && sdata->state) {
+                MtState* s = sdata->state;
+                if (mtstates_membuf_reserve(b, 1 + sizeof(MtState*)) != 0) return -1;
+                b->bufferStart[b->bufferLength++] = BUFFER_STATE;
+                memcpy(b->bufferStart + b->bufferLength, &s, sizeof(MtState*));
+                b->bufferLength += sizeof(MtState*);
+                atomic_inc(&s->used);
+                ctx->retained += 1;
+                break;
+            }
+            int errorReason;
+            const carray_capi* capi = carray_get_capi(L, index, &errorReason);
+            if (capi) {
+                carray_info info;
+                const carray* a = capi->toReadableCarray(L, index, &info);
+                if (a) {
+                    size_t len = info.elementSize * info.elementCount;
+                    if (mtstates_membuf_reserve(b, 3 + sizeof(size_t) + len) != 0) return -1;
+                    char* dest = b->bufferStart + b->bufferLength;
+                    *dest++ = BUFFER_CARRAY;
+                    *dest++ = (unsigned char)info.elementType;
+                    *dest++ = (unsigned char)info.elementSize;
+                    memcpy(dest, &info.elementCount, sizeof(size_t));
+                    dest += sizeof(size_t);
+                    memcpy(dest, capi->getReadableElementPtr(a, 0, info.elementCount), len);
+                    b->bufferLength += 3 + sizeof(size_t) + len;
+                    break;
+                }
+            } else if (errorReason == 1) {
+                lua_pushfstring(L, "carray version mismatch");
+                return 1;
+            }
+            /* FALLTHROUGH */
+        }
+        default: {
+            lua_pushfstring(L, "type '%s' not supported", lua_typename(L, tp));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const char* releaseValue(const char* from, const char* end);
+
+int mtstates_writer_add_value(lua_State* L, int index, receiver_writer* w)
+{
+    MemBuffer*    b   = &w->mem;
+    WriterContext ctx = {{0}};
+    int           rc;
+    if (lua_type(L, index) != LUA_TTABLE) {
+        rc = addValue(L, index, b, &ctx);
     } else {
-        return rc;
+        size_t start = b->bufferLength;
+        int    top   = lua_gettop(L);
+        rc = addTable(L, lua_absindex(L, index), b, &ctx);
+        freePointerMap(&ctx.map);
+        if (rc != 0) {
+            if (ctx.retained > 0) {
+                const char* from = b->bufferStart + start;
+                const char* end  = b->bufferStart + b->bufferLength;
+                while (from < end) {
+                    from = releaseValue(from, end);
+                }
+            }
+            b->bufferLength = start;
+            if (rc > 0 && lua_gettop(L) > top + 1) {
+                lua_replace(L, top + 1);                     /* -> msg */
+            }
+            lua_settop(L, (rc > 0) ? top + 1 : top);
+        }
+    }
+    if (rc == 0) {
+        w->nargs += 1;
+        w->retained += ctx.retained;
+    }
+    return rc;
+}
+
+/* 
+ * Skips one value of the buffer and releases the contained blobs and 
+ * states. A table may be incomplete if writing the value was aborted.
+ */
+static const char* releaseValue(const char* from, const char* end)
+{
+    char type = *from++;
+    switch (type) {
+        case BUFFER_BOOLEAN:
+        case BUFFER_BYTE:         return from + 1;
+        case BUFFER_INTEGER:      return from + sizeof(lua_Integer);
+        case BUFFER_NUMBER:       return from + sizeof(lua_Number);
+        case BUFFER_SMALLSTRING:
+        case BUFFER_KEY:          return from + 1 + (((size_t)(*from)) & 0xff);
+        case BUFFER_KEYREF:       return from + sizeof(unsigned short);
+        case BUFFER_LIGHTUSERDATA:return from + sizeof(void*);
+        case BUFFER_TABLEREF:     return from + sizeof(size_t);
+        case BUFFER_STRING:
+        case BUFFER_BYTES: {
+            size_t len;
+            memcpy(&len, from, sizeof(size_t));
+            return from + sizeof(size_t) + len;
+        }
+        case BUFFER_CARRAY: {
+            unsigned char elementSize = (unsigned char) from[1];
+            size_t        elementCount;
+            memcpy(&elementCount, from + 2, sizeof(size_t));
+            return from + 2 + sizeof(size_t) + elementSize * elementCount;
+        }
+        case BUFFER_TABLE: {
+            from += sizeof(size_t);
+            while (from < end && *from != BUFFER_END) {
+                from = releaseValue(from, end);
+            }
+            return from + 1;
+        }
+        case BUFFER_BLOB: {
+            MtBlob* blob;
+            memcpy(&blob, from, sizeof(MtBlob*));
+            mtstates_blob_release(blob);
+            return from + sizeof(MtBlob*);
+        }
+        case BUFFER_STATE: {
+            MtState* s;
+            memcpy(&s, from, sizeof(MtState*));
+            if (atomic_dec(&s->used) <= 0) {
+                mtstates_state_free(s);
+            }
+            return from + sizeof(MtState*);
+        }
+        default: return end; /* invalid record, the remaining values are skipped */
+    }
+}
+
+void mtstates_writer_release_values(receiver_writer* w)
+{
+    if (w->retained > 0) {
+        const char* from = w->mem.bufferStart;
+        const char* end  = from + w->mem.bufferLength;
+        while (from < end) {
+            from = releaseValue(from, end);
+        }
+        w->retained = 0;
+    }
+}
+
+typedef struct {
+    const struct carray_capi** carrayCapi;
+    MtBytesMode                bytesMode;
+    int                        refs;  /* table: positive ids -> tables, negative ids -> keys */
+    lua_Integer                tableCount;
+    lua_Integer                keyCount;
+} ReaderContext;
+
+static const char* pushValue(lua_State* L, const char* from, ReaderContext* ctx);
+
+static const char* pushTable(lua_State* L, const char* from, ReaderContext* ctx)
+{
+    size_t n;
+    memcpy(&n, from, sizeof(size_t));
+    from += sizeof(size_t);
+    
+    luaL_checkstack(L, LUA_MINSTACK, NULL);
+    if (!ctx->refs) {
+        lua_newtable(L);                                     /* -> refs */
+        ctx->refs = lua_gettop(L);
+    }
+    lua_createtable(L, (n < INT_MAX) ? (int)n : 0, 0);      /* -> table */
+    int table = lua_gettop(L);
+    lua_pushvalue(L, table);                                 /* -> table, table */
+    lua_rawseti(L, ctx->refs, ++ctx->tableCount);            /* -> table */
+    
+    size_t i;
+    for (i = 1; i <= n; ++i) {
+        if (*from == BUFFER_NIL) {
+            from += 1;
+        } else {
+            from = pushValue(L, from, ctx);                  /* -> table, value */
+            lua_rawseti(L, table, i);                        /* -> table */
+        }
+    }
+    while (*from != BUFFER_END) {
+        if (*from == BUFFER_KEY) {
+            from += 1;
+            size_t len = ((size_t)(*from++)) & 0xff;
+            lua_pushlstring(L, from, len);                   /* -> table, key */
+            from += len;
+            lua_pushvalue(L, -1);                            /* -> table, key, key */
+            lua_rawseti(L, ctx->refs, -(++ctx->keyCount));   /* -> table, key */
+        } else if (*from == BUFFER_KEYREF) {
+            from += 1;
+            unsigned short keyId;
+            memcpy(&keyId, from, sizeof(unsigned short));
+            from += sizeof(unsigned short);
+            lua_rawgeti(L, ctx->refs, -(lua_Integer)keyId);  /* -> table, key */
+        } else {
+            from = pushValue(L, from, ctx);                  /* -> table, key */
+        }
+        from = pushValue(L, from, ctx);                      /* -> table, key, value */
+        lua_rawset(L, table);                                /* -> table */
+    }
+    return from + 1;
+}
+
+static const char* pushBytes(lua_State* L, const char* from, size_t len, ReaderContext* ctx)
+{
+    switch (ctx->bytesMode) {
+        case MTSTATES_BYTES_STRING: {
+            lua_pushlstring(L, from, len);
+            break;
+        }
+        case MTSTATES_BYTES_CARRAY: {
+            if (!*ctx->carrayCapi) {
+                *ctx->carrayCapi = carray_require_capi(L);
+            }
+            void* data;
+            if (!(*ctx->carrayCapi)->newCarray(L, CARRAY_UCHAR, CARRAY_DEFAULT, len, &data)) {
+                luaL_error(L, "internal error creating carray for type %d", CARRAY_UCHAR);
+            }
+            memcpy(data, from, len);
+            break;
+        }
+        default: {
+            if (len >= INT_MAX) {
+                luaL_error(L, "too many arguments");
+            }
+            luaL_checkstack(L, (int)len, "too many arguments");
+            size_t i;
+            for (i = 0; i < len; ++i) {
+                lua_pushinteger(L, ((lua_Integer)from[i]) & 0xff);
+            }
+            break;
+        }
+    }
+    return from + len;
+}
+
+static const char* pushValue(lua_State* L, const char* from, ReaderContext* ctx)
+{
+    char type = *from++;
+    switch (type) {
+        case BUFFER_BOOLEAN: {
+            lua_pushboolean(L, *from++);
+            break;
+        }
+        case BUFFER_BYTE: {
+            char byte = *from++;
+            lua_Integer value = ((lua_Integer)byte) & 0xff;
+            lua_pushinteger(L, value);
+            break;
+        }
+        case BUFFER_INTEGER: {
+            lua_Integer value;
+            memcpy(&value, from, sizeof(lua_Integer));
+            from += sizeof(lua_Integer);
+            lua_pushinteger(L, value);
+            break;
+        }
+        case BUFFER_NUMBER: {
+            lua_Number value;
+            memcpy(&value, from, sizeof(lua_Number));
+            from += sizeof(lua_Number);
+            lua_pushnumber(L, value);
+            break;
+        }
+        case BUFFER_SMALLSTRING: {
+            size_t len = ((size_t)(*from++)) & 0xff;
+            lua_pushlstring(L, from, len);
+            from += len;
+            break;
+        }
+        case BUFFER_STRING: {
+            size_t len;
+            memcpy(&len, from, sizeof(size_t));
+            from += sizeof(size_t);
+            lua_pushlstring(L, from, len);
+            from += len;
+            break;
+        }
+        case BUFFER_CARRAY: {
+            if (!*ctx->carrayCapi) {
+                *ctx->carrayCapi = carray_require_capi(L);
+            }
+            carray_type   type        = (unsigned char) (*from++);
+            unsigned char elementSize = (unsigned char) (*from++);
+            size_t        elementCount;
+            memcpy(&elementCount, from, sizeof(size_t));
+            from += sizeof(size_t);
+            void* data;
+            if (!(*ctx->carrayCapi)->newCarray(L, type, CARRAY_DEFAULT, elementCount, &data)) {
+                luaL_error(L, "internal error creating carray for type %d", type);
+            }
+            size_t len = elementSize * elementCount;
+            memcpy(data, from, len);
+            from += len;
+            break;
+        }
+        case BUFFER_NIL: {
+            lua_pushnil(L);
+            break;
+        }
+        case BUFFER_LIGHTUSERDATA: {
+            void* value;
+            memcpy(&value, from, sizeof(void*));
+            from += sizeof(void*);
+            lua_pushlightuserdata(L, value);
+            break;
+        }
+        case BUFFER_TABLE: {
+            from = pushTable(L, from, ctx);
+            break;
+        }
+        case BUFFER_TABLEREF: {
+            size_t id;
+            memcpy(&id, from, sizeof(size_t));
+            from += sizeof(size_t);
+            lua_rawgeti(L, ctx->refs, (lua_Integer)id);
+            break;
+        }
+        case BUFFER_BLOB: {
+            MtBlob* blob;
+            memcpy(&blob, from, sizeof(MtBlob*));
+            from += sizeof(MtBlob*);
+            mtstates_blob_push(L, blob);
+            break;
+        }
+        case BUFFER_STATE: {
+            MtState* s;
+            memcpy(&s, from, sizeof(MtState*));
+            from += sizeof(MtState*);
+            mtstates_state_push_reference(L, s);
+            break;
+        }
+        case BUFFER_BYTES: {
+            size_t len;
+            memcpy(&len, from, sizeof(size_t));
+            from += sizeof(size_t);
+            from = pushBytes(L, from, len, ctx);
+            break;
+        }
+        default: {
+            luaL_error(L, "internal error: invalid buffer record type %d", (int)type);
+        }
+    }
+    return from;
+}
+
+void mtstates_writer_push_values(lua_State* L, const receiver_writer* w, 
+                                 const carray_capi** carrayCapi,
+                                 MtBytesMode bytesMode)
+{
+    const char*   from = w->mem.bufferStart;
+    const char*   end  = from + w->mem.bufferLength;
+    ReaderContext ctx;
+    ctx.carrayCapi = carrayCapi;
+    ctx.bytesMode  = bytesMode;
+    ctx.refs       = 0;
+    ctx.tableCount = 0;
+    ctx.keyCount   = 0;
+    while (from < end) {
+        from = pushValue(L, from, &ctx);
+    }
+    if (ctx.refs) {
+        lua_remove(L, ctx.refs);
     }
 }
 
@@ -13,16 +13,61 @@ typedef enum {
     BUFFER_BOOLEAN,
     BUFFER_STRING,
     BUFFER_SMALLSTRING,
-    BUFFER_CARRAY
+    BUFFER_CARRAY,
+    BUFFER_NIL,
+    BUFFER_LIGHTUSERDATA,
+    BUFFER_TABLE,       /* array count, array values, key value pairs, BUFFER_END */
+    BUFFER_TABLEREF,    /* table that was already transferred in the same message */
+    BUFFER_KEY,         /* short string key, interned for following BUFFER_KEYREF */
+    BUFFER_KEYREF,
+    BUFFER_END,
+    BUFFER_BLOB,        /* retained blob pointer, released with the buffer */
+    BUFFER_BYTES,       /* byte run from addBytesToWriter(), see MtBytesMode */
+    BUFFER_STATE        /* retained state pointer, released with the buffer */
 } SerializeDataType;
 
+/* delivery of byte runs from addBytesToWriter() to the state callback */
+typedef enum {
+    MTSTATES_BYTES_INTEGERS,   /* each byte as integer argument */
+    MTSTATES_BYTES_STRING,     /* whole run as one string argument */
+    MTSTATES_BYTES_CARRAY      /* whole run as one uchar carray argument */
+} MtBytesMode;
+
+/* maximal nesting level of transferred tables */
+#define MTSTATES_TABLE_MAXDEPTH 100
+
 
 struct receiver_writer
 {
     int nargs;
     MemBuffer mem;
+    size_t retained; /* number of retained blobs and states in mem */
 };
 
+struct carray_capi;
+
+/**
+ * Appends the value at the given stack index to the writer. Returns 0 on 
+ * success, -1 if memory could not be allocated or a positive value if the
+ * value type is not supported, in this case an error message is pushed.
+ */
+int mtstates_writer_add_value(lua_State* L, int index, receiver_writer* w);
+
+/**
+ * Releases the blobs and states that are referenced by the writer's 
+ * values. Must be called before the writer's memory is freed or cleared.
+ */
+void mtstates_writer_release_values(receiver_writer* w);
+
+/**
+ * Pushes all values of the writer, may raise lua errors. Byte runs are 
+ * pushed according to bytesMode, i.e. the number of pushed values can be
+ * less than w->nargs.
+ */
+void mtstates_writer_push_values(lua_State* L, const receiver_writer* w, 
+                                 const struct carray_capi** carrayCapi,
+                                 MtBytesMode bytesMode);
+
 
 
 #endif /* MTSTATES_RECEIVER_CAPI_IMPL_H */
@@ -0,0 +1,273 @@
+#include "setup_cache.h"
+#include "main.h"
+
+static const char* const MTSTATES_CHUNK_REF_CLASS_NAME = "mtstates.setupchunk";
+
+#define CACHE_BUCKETS 64
+
+static SetupChunk*  cache_buckets[CACHE_BUCKETS];
+static int          cache_count = 0;
+static int          cache_limit = 100;
+static lua_Integer  cache_usage = 0;
+static lua_Integer  cache_hits  = 0;
+static lua_Integer  cache_miss  = 0;
+
+/* unique key for the weak table function -> ChunkRef in the lua registry */
+static const char   function_chunks_key = 0;
+
+typedef struct ChunkRef {
+    SetupChunk* chunk;
+} ChunkRef;
+
+static size_t hashKey(const char* key, size_t keyLength, bool isSource)
+{
+    size_t h = isSource ? 2166136261u : 16777619u;
+    size_t i;
+    for (i = 0; i < keyLength; ++i) {
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return h;
+}
+
+static SetupChunk* findChunk(size_t hash, const char* key, size_t keyLength, bool isSource)
+{
+    SetupChunk* c = cache_buckets[hash % CACHE_BUCKETS];
+    while (c != NULL) {
+        if (   c->hash == hash 
+            && c->isSource == isSource 
+            && c->keyLength == keyLength
+            && memcmp(c->key, key, keyLength) == 0)
+        {
+            return c;
+        }
+        c = c->nextChunk;
+    }
+    return NULL;
+}
+
+static void freeChunk(SetupChunk* c)
+{
+    SetupChunk** ptr = &cache_buckets[c->hash % CACHE_BUCKETS];
+    while (*ptr != c) {
+        ptr = &(*ptr)->nextChunk;
+    }
+    *ptr = c->nextChunk;
+    cache_count -= 1;
+    free(c);
+}
+
+/* evicts least recently used chunks that are not referenced */
+static void evictChunks(int limit)
+{
+    while (cache_count > limit) {
+        SetupChunk* oldest = NULL;
+        int i;
+        for (i = 0; i < CACHE_BUCKETS; ++i) {
+            SetupChunk* c = cache_buckets[i];
+            while (c != NULL) {
+                if (c->refs == 0 && (!oldest || c->lastUsage < oldest->lastUsage)) {
+                    oldest = c;
+                }
+                c = c->nextChunk;
+            }
+        }
+        if (oldest) {
+            freeChunk(oldest);
+        } else {
+            break;
+        }
+    }
+}
+
+SetupChunk* mtstates_setup_cache_find(const char* key, size_t keyLength, bool isSource)
+{
+    size_t hash = hashKey(key, keyLength, isSource);
+
+    async_mutex_lock(mtstates_global_lock);
+
+    SetupChunk* c = findChunk(hash, key, keyLength, isSource);
+    if (c) {
+        c->refs      += 1;
+        c->lastUsage  = ++cache_usage;
+        cache_hits   += 1;
+    } else {
+        cache_miss   += 1;
+    }
+    async_mutex_unlock(mtstates_global_lock);
+    return c;
+}
+
+SetupChunk* mtstates_setup_cache_add(const char* key,  size_t keyLength, bool isSource,
+                                     const char* code, size_t codeLength)
+{
+    size_t hash = hashKey(key, keyLength, isSource);
+
+    async_mutex_lock(mtstates_global_lock);
+
+    SetupChunk* c = findChunk(hash, key, keyLength, isSource);
+    if (!c && cache_limit > 0) {
+        /* for binary chunks the key is the code */
+        size_t len = sizeof(SetupChunk) + (isSource ? keyLength : 0) + codeLength;
+        c = malloc(len);
+        if (c) {
+            char* data = ((char*)c) + sizeof(SetupChunk);
+            memcpy(data, code, codeLength);
+            c->code       = data;
+            c->codeLength = codeLength;
+            if (isSource) {
+                memcpy(data + codeLength, key, keyLength);
+                c->key = data + codeLength;
+            } else {
+                c->key = data;
+            }
+            c->keyLength = keyLength;
+            c->hash      = hash;
+            c->isSource  = isSource;
+            c->refs      = 1; /* referenced before evicting, the new chunk is kept */
+            c->lastUsage = ++cache_usage;
+            c->nextChunk = cache_buckets[hash % CACHE_BUCKETS];
+            cache_buckets[hash % CACHE_BUCKETS] = c;
+            cache_count += 1;
+            evictChunks(cache_limit);
+        }
+    } else if (c) {
+        c->refs      += 1;
+        c->lastUsage  = ++cache_usage;
+    }
+    async_mutex_unlock(mtstates_global_lock);
+    return c;
+}
+
+size_t mtstates_setup_cache_hash(const char* key, size_t keyLength, bool isSource)
+{
+    return hashKey(key, keyLength, isSource);
+}
+
+void mtstates_setup_cache_release(SetupChunk* c)
+{
+    async_mutex_lock(mtstates_global_lock);
+    c->refs -= 1;
+    if (c->refs == 0 && cache_count > cache_limit) {
+        evictChunks(cache_limit);
+    }
+    async_mutex_unlock(mtstates_global_lock);
+}
+
+/* ============================================================================================ */
+
+static int ChunkRef_release(lua_State* L)
+{
+    ChunkRef* ref = luaL_checkudata(L, 1, MTSTATES_CHUNK_REF_CLASS_NAME);
+    if (ref->chunk) {
+        mtstates_setup_cache_release(ref->chunk);
+        ref->chunk = NULL;
+    }
+    return 0;
+}
+
+SetupChunk* mtstates_setup_cache_get_function(lua_State* L, int func)
+{
+    SetupChunk* c = NULL;
+    lua_pushlightuserdata(L, (void*)&function_chunks_key);      /* -> key */
+    lua_rawget(L, LUA_REGISTRYINDEX);                           /* -> chunks */
+    if (lua_istable(L, -1)) {
+        lua_pushvalue(L, func);                                 /* -> chunks, func */
+        lua_rawget(L, -2);                                      /* -> chunks, ref */
+        ChunkRef* ref = lua_touserdata(L, -1);
+        if (ref && ref->chunk) {
+            async_mutex_lock(mtstates_global_lock);
+            c = ref->chunk;
+            c->refs      += 1;
+            c->lastUsage  = ++cache_usage;
+            cache_hits   += 1;
+            async_mutex_unlock(mtstates_global_lock);
+        }
+        lua_pop(L, 1);                                          /* -> chunks */
+    }
+    lua_pop(L, 1);                                              /* -> */
+    return c;
+}
+
+void mtstates_setup_cache_set_function(lua_State* L, int func, SetupChunk* c)
+{
+    func = lua_absindex(L, func);
+    lua_pushlightuserdata(L, (void*)&function_chunks_key);      /* -> key */
+    lua_rawget(L, LUA_REGISTRYINDEX);                           /* -> chunks */
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);                                          /* -> */
+        lua_newtable(L);                                        /* -> chunks */
+        lua_newtable(L);                                        /* -> chunks, meta */
+        lua_pushstring(L, "k");                                 /* -> chunks, meta, "k" */
+        lua_setfield(L, -2, "__mode");                          /* -> chunks, meta */
+        lua_setmetatable(L, -2);                                /* -> chunks */
+        lua_pushlightuserdata(L, (void*)&function_chunks_key);  /* -> chunks, key */
+        lua_pushvalue(L, -2);                                   /* -> chunks, key, chunks */
+        lua_rawset(L, LUA_REGISTRYINDEX);                       /* -> chunks */
+    }
+    lua_pushvalue(L, func);                                     /* -> chunks, func */
+    ChunkRef* ref = lua_newuserdata(L, sizeof(ChunkRef));       /* -> chunks, func, ref */
+    ref->chunk = NULL;
+    if (luaL_newmetatable(L, MTSTATES_CHUNK_REF_CLASS_NAME)) {  /* -> chunks, func, ref, meta */
+        lua_pushcfunction(L, ChunkRef_release);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);                                    /* -> chunks, func, ref */
+
+    async_mutex_lock(mtstates_global_lock);
+    c->refs   += 1;
+    ref->chunk = c;
+    async_mutex_unlock(mtstates_global_lock);
+
+    lua_rawset(L, -3);                                          /* -> chunks */
+    lua_pop(L, 1);                                              /* -> */
+}
+
+/* ============================================================================================ */
+
+static int Mtstates_setupCache(lua_State* L)
+{
+    int arg = 1;
+    bool hasLimit = !lua_isnoneornil(L, arg);
+    lua_Integer limit = 0;
+    if (hasLimit) {
+        limit = luaL_checkinteger(L, arg);
+        if (limit < 0) {
+            return luaL_argerror(L, arg, "non-negative integer expected");
+        }
+        if (limit > INT_MAX) {
+            limit = INT_MAX;
+        }
+    }
+    lua_Integer hits, miss, count;
+    async_mutex_lock(mtstates_global_lock);
+    {
+        if (hasLimit) {
+            cache_limit = (int)limit;
+            evictChunks(cache_limit);
+        }
+        hits  = cache_hits;
+        miss  = cache_miss;
+        count = cache_count;
+    }
+    async_mutex_unlock(mtstates_global_lock);
+    lua_pushinteger(L, hits);
+    lua_pushinteger(L, miss);
+    lua_pushinteger(L, count);
+    return 3;
+}
+
+static const luaL_Reg ModuleFunctions[] = 
+{
+    { "setupcache", Mtstates_setupCache },
+    { NULL,         NULL } /* sentinel */
+};
+
+int mtstates_setup_cache_init_module(lua_State* L, int module)
+{
+    lua_pushvalue(L, module);
+        luaL_setfuncs(L, ModuleFunctions, 0);
+    lua_pop(L, 1);
+
+    return 0;
+}
+
@@ -0,0 +1,51 @@
+#ifndef MTSTATES_SETUP_CACHE_H
+#define MTSTATES_SETUP_CACHE_H
+
+#include "util.h"
+
+typedef struct SetupChunk {
+    size_t              hash;
+    bool                isSource;
+    const char*         key;
+    size_t              keyLength;
+    const char*         code;       /* binary chunk */
+    size_t              codeLength;
+    int                 refs;
+    lua_Integer         lastUsage;
+    struct SetupChunk*  nextChunk;
+} SetupChunk;
+
+/**
+ * Finds the chunk for the given source code (isSource == true) or binary
+ * chunk (isSource == false). Returns NULL if the chunk is not cached.
+ * The returned chunk must be released via mtstates_setup_cache_release().
+ */
+SetupChunk* mtstates_setup_cache_find(const char* key, size_t keyLength, bool isSource);
+
+/**
+ * Adds the binary chunk for the given key. Returns NULL if the chunk
+ * cannot be cached. The returned chunk must be released via 
+ * mtstates_setup_cache_release().
+ */
+SetupChunk* mtstates_setup_cache_add(const char* key,  size_t keyLength, bool isSource,
+                                     const char* code, size_t codeLength);
+
+void mtstates_setup_cache_release(SetupChunk* chunk);
+
+/**
+ * Hash value of the given key as used for SetupChunk.hash
+ */
+size_t mtstates_setup_cache_hash(const char* key, size_t keyLength, bool isSource);
+
+/**
+ * Gets the cached chunk that was associated with the setup function
+ * at the given stack index by mtstates_setup_cache_set_function().
+ */
+SetupChunk* mtstates_setup_cache_get_function(lua_State* L, int func);
+
+void mtstates_setup_cache_set_function(lua_State* L, int func, SetupChunk* chunk);
+
+int mtstates_setup_cache_init_module(lua_State* L, int module);
+
+
+#endif /* MTSTATES_SETUP_CACHE_H */
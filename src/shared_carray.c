@@ -0,0 +1,87 @@
+#include "shared_carray.h"
+
+#define SHARED_BUCKETS 64
+
+/* source carray that is referenced by carrays in other states */
+typedef struct SharedCarray {
+    const void*           data;
+    size_t                elementCount;
+    const carray*         source;
+    const carray_capi*    capi;
+    size_t                refs;
+    struct SharedCarray*  nextShared;
+} SharedCarray;
+
+/*
+ * Own mutex instead of mtstates_global_lock: the release callback is invoked
+ * during garbage collection which may occur while the global lock is held.
+ */
+static Mutex         shared_mutex;
+static SharedCarray* shared_buckets[SHARED_BUCKETS];
+
+static size_t hashData(const void* data)
+{
+    size_t h = (size_t)data;
+    return (h ^ (h >> 7) ^ (h >> 17)) % SHARED_BUCKETS;
+}
+
+void mtstates_shared_carray_init(void)
+{
+    async_mutex_init(&shared_mutex);
+}
+
+bool mtstates_shared_carray_retain(const carray_capi* capi, const carray* a,
+                                   const void* data, size_t elementCount)
+{
+    async_mutex_lock(&shared_mutex);
+
+    SharedCarray** bucket = &shared_buckets[hashData(data)];
+    SharedCarray*  s      = *bucket;
+    while (s && !(s->data == data && s->elementCount == elementCount)) {
+        s = s->nextShared;
+    }
+    if (!s) {
+        s = malloc(sizeof(SharedCarray));
+        if (!s) {
+            async_mutex_unlock(&shared_mutex);
+            return false;
+        }
+        s->data         = data;
+        s->elementCount = elementCount;
+        s->source       = a;
+        s->capi         = capi;
+        s->refs         = 0;
+        s->nextShared   = *bucket;
+        *bucket = s;
+        capi->retainCarray(a);
+    }
+    s->refs += 1;
+
+    async_mutex_unlock(&shared_mutex);
+    return true;
+}
+
+void mtstates_shared_carray_release(void* data, size_t elementCount)
+{
+    const carray*      source = NULL;
+    const carray_capi* capi   = NULL;
+
+    async_mutex_lock(&shared_mutex);
+
+    SharedCarray** ptr = &shared_buckets[hashData(data)];
+    while (*ptr && !((*ptr)->data == data && (*ptr)->elementCount == elementCount)) {
+        ptr = &(*ptr)->nextShared;
+    }
+    SharedCarray* s = *ptr;
+    if (s && --s->refs == 0) {
+        source = s->source;
+        capi   = s->capi;
+        *ptr   = s->nextShared;
+        free(s);
+    }
+    async_mutex_unlock(&shared_mutex);
+
+    if (source) {
+        capi->releaseCarray(source);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef MTSTATES_SHARED_CARRAY_H
+#define MTSTATES_SHARED_CARRAY_H
+
+#include "util.h"
+#include "carray_capi.h"
+
+/**
+ * Readonly carrays are transferred between states without copying the
+ * elements: the target state gets a carray that references the elements
+ * of the source carray which is retained until the referencing carray
+ * is released.
+ */
+
+/**
+ * Must be called once before any other function of this module.
+ */
+void mtstates_shared_carray_init(void);
+
+/**
+ * Retains the source carray a for a new referencing carray. Returns false
+ * if memory could not be allocated.
+ */
+bool mtstates_shared_carray_retain(const carray_capi* capi, const carray* a,
+                                   const void* data, size_t elementCount);
+
+/**
+ * Release callback for carray_capi.newCarrayRef(). Also to be called if the
+ * referencing carray could not be created after mtstates_shared_carray_retain().
+ */
+void mtstates_shared_carray_release(void* data, size_t elementCount);
+
+
+#endif /* MTSTATES_SHARED_CARRAY_H */
@@ -10,49 +10,341 @@
 #include "notify_capi_impl.h"
 #include "receiver_capi_impl.h"
 #include "carray_capi.h"
+#include "setup_cache.h"
+#include "method.h"
+#include "future.h"
+#include "iterator.h"
+#include "shared_carray.h"
+#include "blob.h"
 
 const char* const MTSTATES_STATE_CLASS_NAME = "mtstates.state";
 
 
+typedef struct StateTable {
+    lua_Integer        n;
+    struct StateTable* nextRetired;
+    StateBucket        list[1];
+} StateTable;
+
+/* 
+ * The table of states by id is modified under mtstates_global_lock but can be
+ * read without lock: unlinked states and replaced tables are retired and only 
+ * freed if no reader can access them anymore. Readers are counted for the 
+ * current epoch, retired objects of an epoch are freed if all readers of this 
+ * epoch have left. 
+ *
+ * The table is resized incrementally: while rehashing, new states are inserted
+ * into state_table and every insert or free migrates some buckets from 
+ * rehash_table.
+ */
+#define REHASH_STEPS 4
+
+/*
+ * Callers waiting for a busy state spin at most twice the average call 
+ * duration before parking. The duration is measured for every 16th call 
+ * and states with longer calls than MAX_SPIN_SECONDS are never spun on.
+ */
+#define MAX_SPIN_SECONDS 0.00005
+#define SAMPLE_MASK      15
+
+/*
+ * Maximal number of functions compiled by state:exec() that are kept per 
+ * state. If the limit is reached, the cache is discarded as a whole.
+ */
+#define EXEC_CACHE_LIMIT 64
+
+/*
+ * State callback for setup functions that return a table of functions:
+ * the first argument selects the function.
+ */
+#define METHODS_DISPATCHER \
+    "local methods = ...\n" \
+    "return function(name, ...)\n" \
+    "    local f = methods[name]\n" \
+    "    if not f then error(\"unknown method \"..tostring(name), 2) end\n" \
+    "    return f(...)\n" \
+    "end\n"
+
+/*
+ * Wraps a coroutine returned by the state callback for state:iter() into a
+ * generator function.
+ */
+#define COROUTINE_GENERATOR \
+    "local co = ...\n" \
+    "local coroutine = coroutine or require(\"coroutine\")\n" \
+    "local resume, status = coroutine.resume, coroutine.status\n" \
+    "local function results(ok, ...)\n" \
+    "    if not ok then error(..., 0) end\n" \
+    "    return ...\n" \
+    "end\n" \
+    "return function()\n" \
+    "    if status(co) == \"dead\" then return end\n" \
+    "    return results(resume(co))\n" \
+    "end\n"
+
+/* unique key for the weak table function -> binary chunk in the lua registry */
+static const char    exec_dumps_key    = 0;
+
+/* unique key for the compiled COROUTINE_GENERATOR in the lua registry */
+static const char    coroutine_generator_key = 0;
+
 static AtomicCounter state_counter     = 0;
-static lua_Integer   state_buckets     = 0;
-static int           bucket_usage      = 0;
-static StateBucket*  state_bucket_list = NULL;
+static AtomicPtr     state_table       = NULL;
+static AtomicPtr     rehash_table      = NULL;
+static lua_Integer   rehash_index      = 0;
+
+static AtomicCounter reader_epoch      = 0;
+static AtomicCounter epoch_readers[2]  = { 0, 0 };
+static MtState*      retired_states[2] = { NULL, NULL };
+static StateTable*   retired_tables[2] = { NULL, NULL };
+
+/* index of named states, protected by mtstates_global_lock */
+static lua_Integer   name_buckets      = 0;
+static lua_Integer   named_counter     = 0;
+static MtState**     name_bucket_list  = NULL;
+
+/* spinning is only useful if the state can be released by another processor */
+static int           processor_count   = 1;
+
+inline static void setBusy(MtState* s, bool isBusy)
+{
+    s->isBusy = isBusy;
+    atomic_set(&s->busyFlag, isBusy ? MTSTATES_STATE_BUSY : MTSTATES_STATE_FREE);
+}
+
+/* encoded content of a receiver writer */
+struct InboxMessage {
+    InboxMessage* nextMessage;
+    int           nargs;
+    size_t        length;
+    char          data[1];
+};
+
+/* registry reference of a generator that is released by the thread holding the state */
+struct PendingUnref {
+    PendingUnref* nextUnref;
+    int           ref;
+};
+
+/* stateMutex must be locked or state must not be reachable by other threads */
+static void discardInbox(MtState* s)
+{
+    while (s->firstInbox) {
+        InboxMessage* msg = s->firstInbox;
+        s->firstInbox = msg->nextMessage;
+        free(msg);
+    }
+    s->lastInbox  = NULL;
+    s->inboxBytes = 0;
+}
+
+static int enterReader()
+{
+    while (true) {
+        int e = atomic_get(&reader_epoch);
+        atomic_inc(&epoch_readers[e]);
+        if (atomic_get(&reader_epoch) == e) {
+            return e;
+        }
+        atomic_dec(&epoch_readers[e]);
+    }
+}
+
+static void leaveReader(int e)
+{
+    atomic_dec(&epoch_readers[e]);
+}
+
+/* global lock must be held */
+static void reclaimRetired()
+{
+    int e   = atomic_get(&reader_epoch);
+    int old = 1 - e;
+    if (atomic_get(&epoch_readers[old]) == 0) {
+        while (retired_states[old]) {
+            MtState* s = retired_states[old];
+            retired_states[old] = s->nextRetired;
+            free(s);
+        }
+        while (retired_tables[old]) {
+            StateTable* t = retired_tables[old];
+            retired_tables[old] = t->nextRetired;
+            free(t);
+        }
+        atomic_set(&reader_epoch, old);
+    }
+}
+
+static void retireState(MtState* s)
+{
+    int e = atomic_get(&reader_epoch);
+    s->nextRetired = retired_states[e];
+    retired_states[e] = s;
+    reclaimRetired();
+}
 
-inline static void toBuckets(MtState* s, lua_Integer n, StateBucket* list)
+static void retireTable(StateTable* t)
 {
-    StateBucket* bucket        = &(list[s->id % n]);
+    int e = atomic_get(&reader_epoch);
+    t->nextRetired = retired_tables[e];
+    retired_tables[e] = t;
+    reclaimRetired();
+}
+
+static StateTable* allocTable(lua_Integer n)
+{
+    StateTable* t = calloc(1, sizeof(StateTable) + (n - 1) * sizeof(StateBucket));
+    if (t) {
+        t->n = n;
+    }
+    return t;
+}
+
+inline static StateTable* currentTable()
+{
+    return atomic_get_ptr(&state_table);
+}
+
+inline static void toBuckets(MtState* s, StateTable* t)
+{
+    StateBucket* bucket        = &(t->list[s->id % t->n]);
     MtState**    firstStatePtr = &bucket->firstState;
     if (*firstStatePtr) {
         (*firstStatePtr)->prevStatePtr = &s->nextState;
     }
     s->nextState    = *firstStatePtr;
     s->prevStatePtr =  firstStatePtr;
+    atomic_memory_barrier(); /* s is complete before readers can see it */
     *firstStatePtr  =  s;
-    bucket->count += 1;
-    if (bucket->count > bucket_usage) {
-        bucket_usage = bucket->count;
+}
+
+static void rehashStep(int steps)
+{
+    StateTable* oldTable = atomic_get_ptr(&rehash_table);
+    if (!oldTable) {
+        return;
+    }
+    StateTable* newTable    = currentTable();
+    int         emptyVisits = 10 * steps;
+    
+    while (steps > 0 && rehash_index < oldTable->n) {
+        StateBucket* b = &(oldTable->list[rehash_index]);
+        MtState*     s = b->firstState;
+        if (s) {
+            while (s != NULL) {
+                MtState* s2 = s->nextState;
+                toBuckets(s, newTable);
+                s = s2;
+            }
+            b->firstState = NULL;
+            steps -= 1;
+        } 
+        else if (--emptyVisits == 0) {
+            break;
+        }
+        rehash_index += 1;
+    }
+    if (rehash_index >= oldTable->n) {
+        atomic_set_ptr_if_equal(&rehash_table, oldTable, NULL);
+        retireTable(oldTable);
+    }
+}
+
+static void startRehash(lua_Integer n)
+{
+    StateTable* newTable = allocTable(n);
+    if (newTable) {
+        StateTable* oldTable = currentTable();
+        rehash_index = 0;
+        atomic_set_ptr_if_equal(&rehash_table, NULL,     oldTable);
+        atomic_set_ptr_if_equal(&state_table,  oldTable, newTable);
+    }
+}
+
+static size_t hashName(const char* stateName, size_t stateNameLength)
+{
+    size_t h = 2166136261u;
+    size_t i;
+    for (i = 0; i < stateNameLength; ++i) {
+        h = (h ^ (unsigned char)stateName[i]) * 16777619u;
+    }
+    return h;
+}
+
+inline static void toNameBuckets(MtState* s, lua_Integer n, MtState** list)
+{
+    MtState** firstNamedPtr = &(list[s->nameHash % n]);
+    if (*firstNamedPtr) {
+        (*firstNamedPtr)->prevNamedPtr = &s->nextNamed;
     }
+    s->nextNamed    = *firstNamedPtr;
+    s->prevNamedPtr =  firstNamedPtr;
+    *firstNamedPtr  =  s;
 }
 
-static void newBuckets(lua_Integer n, StateBucket* newList)
+static void newNameBuckets(lua_Integer n, MtState** newList)
 {
-    bucket_usage = 0;
-    if (state_bucket_list) {
+    if (name_bucket_list) {
         lua_Integer i;
-        for (i = 0; i < state_buckets; ++i) {
-            StateBucket* b = &(state_bucket_list[i]);
-            MtState*     s = b->firstState;
+        for (i = 0; i < name_buckets; ++i) {
+            MtState* s = name_bucket_list[i];
             while (s != NULL) {
-                MtState* s2 = s->nextState;
-                toBuckets(s, n, newList);
+                MtState* s2 = s->nextNamed;
+                toNameBuckets(s, n, newList);
                 s = s2;
             }
         }
-        free(state_bucket_list);
+        free(name_bucket_list);
+    }
+    name_buckets     = n;
+    name_bucket_list = newList;
+}
+
+static bool addToNameIndex(MtState* s)
+{
+    s->nameHash = hashName(s->stateName, s->stateNameLength);
+    if (named_counter + 1 > name_buckets) {
+        lua_Integer n = name_buckets ? (2 * name_buckets) : 64;
+        MtState** newList = calloc(n, sizeof(MtState*));
+        if (newList) {
+            newNameBuckets(n, newList);
+        } else if (!name_buckets) {
+            return false;
+        }
+    }
+    toNameBuckets(s, name_buckets, name_bucket_list);
+    named_counter += 1;
+    return true;
+}
+
+static void removeFromNameIndex(MtState* s)
+{
+    if (s->prevNamedPtr) {
+        *s->prevNamedPtr = s->nextNamed;
+        if (s->nextNamed) {
+            s->nextNamed->prevNamedPtr = s->prevNamedPtr;
+        }
+        s->prevNamedPtr = NULL;
+        s->nextNamed    = NULL;
+        
+        named_counter -= 1;
+        if (named_counter == 0) {
+            free(name_bucket_list);
+            name_buckets     = 0;
+            name_bucket_list = NULL;
+        }
+        else if (named_counter * 8 < name_buckets && name_buckets > 64) {
+            /* shrink to the same load factor as after growing */
+            lua_Integer n = 2 * named_counter;
+            if (n < 64) {
+                n = 64;
+            }
+            MtState** newList = calloc(n, sizeof(MtState*));
+            if (newList) {
+                newNameBuckets(n, newList);
+            }
+        }
     }
-    state_buckets     = n;
-    state_bucket_list = newList;
 }
 
 static MtState* findStateWithName(const char* stateName, 
@@ -61,40 +353,37 @@ static MtState* findStateWithName(const char* stateName,
                                   bool considerUninitialized)
 {
     MtState* rslt = NULL;
-    if (stateName && state_bucket_list) {
-        lua_Integer i;
-        for (i = 0; i < state_buckets; ++i) {
-            StateBucket* b = &(state_bucket_list[i]);
-            MtState*     s = b->firstState;
-            while (s != NULL) {
-                if (   s->stateName 
-                    && stateNameLength == s->stateNameLength 
-                    && memcmp(s->stateName, stateName, stateNameLength) == 0
-                    && !atomic_get(&s->closed)
-                    && (considerUninitialized || atomic_get(&s->initialized)))
-                {
-                    if (unique) {
-                        *unique = (rslt == NULL);
-                    }
-                    if (rslt) {
-                        return rslt;
-                    } else {
-                        rslt = s;
-                    }
+    if (stateName && name_bucket_list) {
+        size_t   h = hashName(stateName, stateNameLength);
+        MtState* s = name_bucket_list[h % name_buckets];
+        while (s != NULL) {
+            if (   s->nameHash == h
+                && stateNameLength == s->stateNameLength 
+                && memcmp(s->stateName, stateName, stateNameLength) == 0
+                && !atomic_get(&s->closed)
+                && (considerUninitialized || atomic_get(&s->initialized)))
+            {
+                if (unique) {
+                    *unique = (rslt == NULL);
+                }
+                if (rslt) {
+                    return rslt;
+                } else {
+                    rslt = s;
                 }
-                s = s->nextState;
             }
+            s = s->nextNamed;
         }
     }
     return rslt;
 }
 
-static MtState* findStateWithId(lua_Integer stateId)
+static MtState* findInTable(StateTable* t, lua_Integer stateId)
 {
-    if (state_bucket_list) {
-        MtState* s = state_bucket_list[stateId % state_buckets].firstState;
+    if (t && stateId > 0) {
+        MtState* s = t->list[stateId % t->n].firstState;
         while (s != NULL) {
-            if (s->id == stateId && atomic_get(&s->initialized) && !atomic_get(&s->closed)) {
+            if (s->id == stateId) {
                 return s;
             }
             s = s->nextState;
@@ -103,6 +392,46 @@ static MtState* findStateWithId(lua_Integer stateId)
     return NULL;
 }
 
+static MtState* findStateWithId(lua_Integer stateId)
+{
+    MtState* s = findInTable(currentTable(), stateId);
+    if (!s) {
+        s = findInTable(atomic_get_ptr(&rehash_table), stateId);
+    }
+    if (s && atomic_get(&s->initialized) && !atomic_get(&s->closed)) {
+        return s;
+    }
+    return NULL;
+}
+
+/*
+ * Lookup without global lock. Returns the state with incremented used counter
+ * or NULL if the state was not found. Concurrent rehashing may let the lookup 
+ * miss an existing state, therefore callers have to check again with global lock 
+ * if NULL is returned.
+ */
+static MtState* acquireStateWithId(lua_Integer stateId)
+{
+    MtState* rslt = NULL;
+    int      e    = enterReader();
+    
+    MtState* s = findInTable(currentTable(), stateId);
+    if (!s) {
+        s = findInTable(atomic_get_ptr(&rehash_table), stateId);
+    }
+    if (s && atomic_get(&s->initialized) && !atomic_get(&s->closed)) {
+        int used = atomic_get(&s->used);
+        while (used > 0 && !atomic_set_if_equal(&s->used, used, used + 1)) {
+            used = atomic_get(&s->used);
+        }
+        if (used > 0) {
+            rslt = s;
+        }
+    }
+    leaveReader(e);
+    return rslt;
+}
+
 
 static const char* toLuaString(lua_State* L, StateUserData* udata, MtState* s)
 {
@@ -232,6 +561,7 @@ typedef struct {
     size_t      elementSize;
     size_t      elementCount;
     const void* elementData;
+    bool        shared;       /* readonly carray references elementData */
 } NewCarrayParam;
 
 static int pushClonedCarray(lua_State* L)
@@ -240,6 +570,17 @@ static int pushClonedCarray(lua_State* L)
     if (!param->carrayCapi) {
         param->carrayCapi = carray_require_capi(L);
     }
+    if (param->shared) {
+        carray* a = param->carrayCapi->newCarrayRef(L, param->carrayType, CARRAY_READONLY,
+                                                    (void*)param->elementData, param->elementCount,
+                                                    mtstates_shared_carray_release);
+        if (!a) {
+            return luaL_error(L, "internal error creating carray");
+        }
+        /* the release callback is responsible for the source carray */
+        param->shared = false;
+        return 1;
+    }
     void* newData;
     carray* a = param->carrayCapi->newCarray(L, param->carrayType, CARRAY_DEFAULT, 
                                                 param->elementCount, &newData);
@@ -250,7 +591,75 @@ static int pushClonedCarray(lua_State* L)
     return 1;
 }
 
-static int pushArg(lua_State* L2, lua_State* L, int arg, const carray_capi** carrayCapi)
+typedef struct {
+    const carray_capi** carrayCapi;
+    int                 depth;
+    int                 copies;  /* table in L2: pointer of source table -> copied table */
+} TableCopy;
+
+static int copyValue(lua_State* L2, lua_State* L, int arg, TableCopy* tc);
+
+/*
+ * Copies the table at index arg in L into L2. Tables that are referenced more
+ * than once, e.g. cycles, are copied only once. Metatables are not copied.
+ */
+static int copyTable(lua_State* L2, lua_State* L, int arg, TableCopy* tc)
+{
+    const void* ptr = lua_topointer(L, arg);
+
+    lua_pushlightuserdata(L2, (void*)ptr);
+    if (lua_rawget(L2, tc->copies) != LUA_TNIL) {
+        return 0;
+    }
+    lua_pop(L2, 1);
+    
+    if (   tc->depth >= MTSTATES_TABLE_MAXDEPTH
+        || !lua_checkstack(L,  LUA_MINSTACK) 
+        || !lua_checkstack(L2, LUA_MINSTACK)) 
+    {
+        lua_pushliteral(L2, "table nesting too deep");
+        return 1;
+    }
+    tc->depth += 1;
+
+    size_t n = lua_rawlen(L, arg);
+    lua_createtable(L2, (n < INT_MAX) ? (int)n : 0, 0);     /* -> copy */
+    int copy = lua_gettop(L2);
+    lua_pushlightuserdata(L2, (void*)ptr);                  /* -> copy, ptr */
+    lua_pushvalue(L2, copy);                                /* -> copy, ptr, copy */
+    lua_rawset(L2, tc->copies);                             /* -> copy */
+
+    size_t i;
+    for (i = 1; i <= n; ++i) {
+        if (lua_rawgeti(L, arg, i) != LUA_TNIL) {            /* -> value */
+            if (copyValue(L2, L, lua_gettop(L), tc) != 0) {
+                return 1;
+            }
+            lua_rawseti(L2, copy, i);
+        }
+        lua_pop(L, 1);                                       /* -> */
+    }
+    lua_pushnil(L);                                          /* -> nil */
+    while (lua_next(L, arg)) {                               /* -> key, value */
+        int key = lua_gettop(L) - 1;
+        if (lua_isinteger(L, key)) {
+            lua_Integer k = lua_tointeger(L, key);
+            if (1 <= k && (size_t)k <= n) {
+                lua_pop(L, 1);                               /* -> key */
+                continue;
+            }
+        }
+        if (copyValue(L2, L, key, tc) != 0 || copyValue(L2, L, key + 1, tc) != 0) {
+            return 1;
+        }
+        lua_rawset(L2, copy);
+        lua_pop(L, 1);                                       /* -> key */
+    }
+    tc->depth -= 1;
+    return 0;
+}
+
+static int copyValue(lua_State* L2, lua_State* L, int arg, TableCopy* tc)
 {
     int tp = lua_type(L, arg);
     switch (tp) {
@@ -280,7 +689,23 @@ static int pushArg(lua_State* L2, lua_State* L, int arg, const carray_capi** car
             lua_pushlightuserdata(L2, lua_touserdata(L, arg));
             break;
         }
+        case LUA_TTABLE: {
+            if (copyTable(L2, L, arg, tc) != 0) {
+                return 1;
+            }
+            break;
+        }
         case LUA_TUSERDATA: {
+            MtBlob* blob = mtstates_blob_test(L, arg);
+            if (blob) {
+                mtstates_blob_push(L2, blob);
+                break;
+            }
+            StateUserData* sdata = luaL_testudata(L, arg, MTSTATES_STATE_CLASS_NAME);
+            if (sdata && sdata->state) {
+                mtstates_state_push_reference(L2, sdata->state);
+                break;
+            }
             int errorReason;
             const carray_capi* capi = carray_get_capi(L, arg, &errorReason);
             if (capi) {
@@ -292,18 +717,26 @@ static int pushArg(lua_State* L2, lua_State* L, int arg, const carray_capi** car
                                    param.elementSize  = info.elementSize;
                                    param.elementCount = info.elementCount;
                                    param.elementData  = capi->getReadableElementPtr(a, 0, info.elementCount);
-                                   param.carrayCapi   = *carrayCapi;
+                                   param.carrayCapi   = *tc->carrayCapi;
+                    if ((info.attr & CARRAY_READONLY) && info.elementCount > 0) {
+                        /* readonly elements are shared instead of copied */
+                        param.shared = mtstates_shared_carray_retain(capi, a, param.elementData, 
+                                                                     info.elementCount);
+                    }
                     lua_pushcfunction(L2, pushClonedCarray);
                     lua_pushlightuserdata(L2, &param);
                     int rc = lua_pcall(L2, 1, 1, 0);
                     if (param.carrayCapi) {
-                        *carrayCapi = param.carrayCapi;
+                        *tc->carrayCapi = param.carrayCapi;
+                    }
+                    if (param.shared) {
+                        mtstates_shared_carray_release((void*)param.elementData, info.elementCount);
                     }
                     if (rc != LUA_OK) {
                         int errorIndex = lua_gettop(L2);
                         lua_pushfstring(L2, "error creating carray: %s", lua_tostring(L2, errorIndex));
                         lua_remove(L2, errorIndex);
-                        return arg;
+                        return 1;
                     }
                     break;
                 } else {
@@ -311,16 +744,49 @@ static int pushArg(lua_State* L2, lua_State* L, int arg, const carray_capi** car
                 }
             } else if (errorReason == 1) {
                 lua_pushfstring(L2, "carray version mismatch");
-                return arg;
+                return 1;
             } else {
                 /* FALLTHROUGH */
             }
         }
         default: {
             lua_pushfstring(L2, "type '%s' not supported", lua_typename(L, tp));
-            return arg;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Pushes a copy of the value at index arg in L onto L2. Returns 0 on success,
+ * otherwise arg and an error message is pushed onto L2.
+ */
+static int pushArg(lua_State* L2, lua_State* L, int arg, const carray_capi** carrayCapi)
+{
+    TableCopy tc;
+    tc.carrayCapi = carrayCapi;
+    tc.depth      = 0;
+    tc.copies     = 0;
+    
+    if (lua_type(L, arg) != LUA_TTABLE) {
+        return (copyValue(L2, L, arg, &tc) != 0) ? arg : 0;
+    }
+    int top = lua_gettop(L);
+    lua_newtable(L2);                                        /* -> copies */
+    tc.copies = lua_gettop(L2);
+    if (copyTable(L2, L, lua_absindex(L, arg), &tc) != 0) {  /* -> copies, ..., msg */
+        if (L == L2) {
+            /* self call: partial copies and the traversal share one stack */
+            lua_replace(L, top + 1);                         /* -> msg, ... */
+            lua_settop(L, top + 1);                          /* -> msg */
+        } else {
+            lua_replace(L2, tc.copies);                      /* -> msg, ... */
+            lua_settop(L2, tc.copies);                       /* -> msg */
+            lua_settop(L, top);
         }
+        return arg;
     }
+    lua_remove(L2, tc.copies);                               /* -> copy */
     return 0;
 }
 
@@ -378,6 +844,11 @@ static int Mtstates_newState(lua_State* L)
     return Mtstates_newState1(L, NEW_STATE);
 }
 
+int mtstates_state_newstate(lua_State* L)
+{
+    return Mtstates_newState1(L, NEW_STATE);
+}
+
 static int Mtstates_newState2(lua_State* L);
 static int Mtstates_newState1(lua_State* L, NewStateMode mode)
 {
@@ -405,7 +876,10 @@ static int Mtstates_newState1(lua_State* L, NewStateMode mode)
             async_mutex_unlock(&this->state->stateMutex);
         }
         if (this->L2) {
-            lua_close(this->L2);
+            mtstates_allocator_closestate(&this->state->allocator, this->L2);
+        }
+        if (this->stateChunk) {
+            mtstates_setup_cache_release(this->stateChunk);
         }
         mtstates_membuf_free(&this->tmp);
     }
@@ -435,7 +909,46 @@ static int Mtstates_newState1(lua_State* L, NewStateMode mode)
     }
 }
 
+/* not empty and only functions as values */
+static bool isTableOfFunctions(lua_State* L2, int index)
+{
+    bool hasFunctions = false;
+    lua_pushnil(L2);
+    while (lua_next(L2, index)) {
+        bool isFunction = (lua_type(L2, -1) == LUA_TFUNCTION);
+        lua_pop(L2, 1);
+        if (!isFunction) {
+            lua_pop(L2, 1);
+            return false;
+        }
+        hasFunctions = true;
+    }
+    return hasFunctions;
+}
+
+/*
+ * Returns the name of the first upvalue of the lua function at the given 
+ * index or NULL if the function has no upvalue except _ENV.
+ */
+static const char* getUpvalueName(lua_State* L, int func)
+{
+    const char* varname = lua_getupvalue(L, func, 1);
+    if (varname) {
+        lua_pop(L, 1);
+        if (strcmp(varname, "_ENV") == 0) {
+            /* _ENV -> function usese global variables */
+            varname = lua_getupvalue(L, func, 2);
+            if (varname) {
+                lua_pop(L, 1);
+            }
+        }
+    }
+    return varname;
+}
+
 static int Mtstates_newState3(lua_State* L2);
+static int MtState_call3a(lua_State* L2);
+static int MtState_call4(lua_State* L2);
 
 static int callNewState3(lua_State* L2)
 {
@@ -448,12 +961,103 @@ static int callNewState3(lua_State* L2)
     int rc = lua_pcall(L2, 1, 0, -3);
     
     if (rc != LUA_OK) {
-        setErrorMsg(&this->errorMsg, L2);
+        this->isMemoryError = (rc == LUA_ERRMEM);
+        if (!this->isLError || !this->errorMsg.msg) {
+            /* keep message without stack trace from MtState_call4 */
+            setErrorMsg(&this->errorMsg, L2);
+        }
         return lua_error(L2);
     }
     return 0;
 }
 
+static void parseStateOptions(lua_State* L, int arg, NewStateVars* this)
+{
+    if (lua_getfield(L, arg, "libs") != LUA_TNIL) {
+        if (!lua_isboolean(L, -1)) {
+            this->errorArg = arg;
+            luaL_error(L, "boolean expected for option 'libs'");
+        }
+        this->openlibs = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+    
+    if (lua_getfield(L, arg, "memorylimit") != LUA_TNIL) {
+        if (!lua_isinteger(L, -1) || lua_tointeger(L, -1) < 0) {
+            this->errorArg = arg;
+            luaL_error(L, "non-negative integer expected for option 'memorylimit'");
+        }
+        this->memoryLimit = (size_t)lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+
+    if (lua_getfield(L, arg, "fair") != LUA_TNIL) {
+        if (!lua_isboolean(L, -1)) {
+            this->errorArg = arg;
+            luaL_error(L, "boolean expected for option 'fair'");
+        }
+        this->fair = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+
+    if (lua_getfield(L, arg, "spin") != LUA_TNIL) {
+        if (!lua_isboolean(L, -1)) {
+            this->errorArg = arg;
+            luaL_error(L, "boolean expected for option 'spin'");
+        }
+        this->spin = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+
+    if (lua_getfield(L, arg, "inboxlimit") != LUA_TNIL) {
+        if (!lua_isinteger(L, -1) || lua_tointeger(L, -1) < 0) {
+            this->errorArg = arg;
+            luaL_error(L, "non-negative integer expected for option 'inboxlimit'");
+        }
+        this->inboxLimit = (size_t)lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+
+    if (lua_getfield(L, arg, "coalesce") != LUA_TNIL) {
+        if (!lua_isboolean(L, -1)) {
+            this->errorArg = arg;
+            luaL_error(L, "boolean expected for option 'coalesce'");
+        }
+        this->coalesce = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+
+    if (lua_getfield(L, arg, "bytes") != LUA_TNIL) {
+        const char* name = lua_tostring(L, -1);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            name = "";
+        }
+        if (strcmp(name, "string") == 0) {
+            this->bytesMode = MTSTATES_BYTES_STRING;
+        }
+        else if (strcmp(name, "carray") == 0) {
+            this->bytesMode = MTSTATES_BYTES_CARRAY;
+        }
+        else if (strcmp(name, "integers") != 0) {
+            this->errorArg = arg;
+            luaL_error(L, "invalid value for option 'bytes'");
+        }
+    }
+    lua_pop(L, 1);
+
+    if (lua_getfield(L, arg, "allocator") != LUA_TNIL) {
+        const char* name = lua_tostring(L, -1);
+        if (lua_type(L, -1) == LUA_TSTRING && strcmp(name, "slab") == 0) {
+            this->useSlabs = true;
+        } 
+        else if (lua_type(L, -1) != LUA_TSTRING || strcmp(name, "default") != 0) {
+            this->errorArg = arg;
+            luaL_error(L, "invalid value for option 'allocator'");
+        }
+    }
+    lua_pop(L, 1);
+}
+
 static int Mtstates_newState2(lua_State* L)
 {
     NewStateVars* this = (NewStateVars*)lua_touserdata(L, 1);
@@ -487,6 +1091,19 @@ static int Mtstates_newState2(lua_State* L)
             this->errorArg = arg;
             return luaL_error(L, "state name or id expected");
         }
+        if (stateName == NULL && mode == FIND_STATE) {
+            StateUserData* userData = lua_newuserdata(L, sizeof(StateUserData));
+            memset(userData, 0, sizeof(StateUserData));
+            pushStateMeta(L);        /* -> udata, meta */
+            lua_setmetatable(L, -2); /* -> udata */
+            
+            userData->state = acquireStateWithId(stateId);
+            if (userData->state) {
+                this->nrslts = 1;
+                return this->nrslts;
+            }
+            lua_pop(L, 1); /* -> */
+        }
     
         /* ------------------------------------------------------------------------------------ */
         /* globalLocked */
@@ -523,6 +1140,7 @@ static int Mtstates_newState2(lua_State* L)
                         }
                         if (!atomic_get(&state->initialized)) {
                             if (state->stateName) {
+                                removeFromNameIndex(state);
                                 free(state->stateName);
                                 state->stateName = NULL;
                                 state->stateNameLength = 0;
@@ -568,13 +1186,25 @@ static int Mtstates_newState2(lua_State* L)
     }
     
     this->openlibs = true;
+    this->spin     = false;
     if (arg <= lastArg && lua_type(L, arg) == LUA_TBOOLEAN) {
         this->openlibs = lua_toboolean(L, arg++);
     }
+    else if (arg <= lastArg && lua_type(L, arg) == LUA_TTABLE) {
+        parseStateOptions(L, arg++, this);
+    }
     
     if (arg <= lastArg && lua_type(L, arg) == LUA_TSTRING) {
         this->stateFunction = arg++;
-        this->stateCode = lua_tolstring(L, this->stateFunction, &this->stateCodeLength);
+        this->stateSource = lua_tolstring(L, this->stateFunction, &this->stateSourceLength);
+        this->stateChunk  = mtstates_setup_cache_find(this->stateSource, this->stateSourceLength, true);
+        if (this->stateChunk) {
+            this->stateCode       = this->stateChunk->code;
+            this->stateCodeLength = this->stateChunk->codeLength;
+        } else {
+            this->stateCode       = this->stateSource;
+            this->stateCodeLength = this->stateSourceLength;
+        }
     }
     
     if (this->stateCode == NULL) {
@@ -590,28 +1220,38 @@ static int Mtstates_newState2(lua_State* L)
             return luaL_error(L, "lua function expected");
         }
         this->stateFunction = arg++;
-        const char* varname = lua_getupvalue(L, this->stateFunction, 1);
+        const char* varname = getUpvalueName(L, this->stateFunction);
         if (varname) {
-            if (strcmp(varname, "_ENV") == 0) {
-                /* _ENV -> function usese global variables */
-                lua_pop(L, 1); /* pop result from first lua_getupvalue */
-                varname = lua_getupvalue(L, this->stateFunction, 2);
+            this->errorArg = this->stateFunction;
+            return luaL_error(L, "state function uses upvalue '%s'", varname);
+        }
+
+        this->stateChunk = mtstates_setup_cache_get_function(L, this->stateFunction);
+        if (!this->stateChunk) {
+            mtstates_membuf_reserve(&this->tmp, 4 * 1024);
+            lua_pushvalue(L, this->stateFunction);
+            int rc = lua_dump(L, &dumpWriter, &this->tmp, false);
+            if (rc != 0) {
+                return mtstates_ERROR_OUT_OF_MEMORY(L);
             }
-            if (varname) {
-                this->errorArg = this->stateFunction;
-                return luaL_error(L, "state function uses upvalue '%s'", varname);
+            lua_pop(L, 1);
+            const char* dump    = this->tmp.bufferStart;
+            size_t      dumpLen = this->tmp.bufferLength;
+            this->stateChunk = mtstates_setup_cache_find(dump, dumpLen, false);
+            if (!this->stateChunk) {
+                this->stateChunk = mtstates_setup_cache_add(dump, dumpLen, false, dump, dumpLen);
+            }
+            if (this->stateChunk) {
+                mtstates_setup_cache_set_function(L, this->stateFunction, this->stateChunk);
             }
         }
-
-        mtstates_membuf_reserve(&this->tmp, 4 * 1024);
-        lua_pushvalue(L, this->stateFunction);
-        int rc = lua_dump(L, &dumpWriter, &this->tmp, false);
-        if (rc != 0) {
-            return mtstates_ERROR_OUT_OF_MEMORY(L);
+        if (this->stateChunk) {
+            this->stateCode       = this->stateChunk->code;
+            this->stateCodeLength = this->stateChunk->codeLength;
+        } else {
+            this->stateCode       = this->tmp.bufferStart;
+            this->stateCodeLength = this->tmp.bufferLength;
         }
-        lua_pop(L, 1);
-        this->stateCode       = this->tmp.bufferStart;
-        this->stateCodeLength = this->tmp.bufferLength;
     }
 
     
@@ -634,11 +1274,12 @@ static int Mtstates_newState2(lua_State* L)
     }
     this->state = s;
     async_mutex_init(&s->stateMutex);
+    mtstates_mailbox_init(&s->mailbox);
     
     s->id          = atomic_inc(&mtstates_id_counter);
     s->used        = 1;
     s->owned       = 1;
-    s->isBusy      = true;
+    setBusy(s, true);
     udata->state   = s; /* now udata is responsible for freeing s */
     udata->isOwner = true;
 
@@ -650,18 +1291,25 @@ static int Mtstates_newState2(lua_State* L)
         memcpy(s->stateName, stateName, stateNameLength + 1);
         s->stateNameLength = stateNameLength;
     }
-    if (atomic_get(&state_counter) + 1 > state_buckets * 4 || bucket_usage > 30) {
-        lua_Integer n = state_buckets ? (2 * state_buckets) : 64;
-        StateBucket* newList = calloc(n, sizeof(StateBucket));
-        if (newList) {
-            newBuckets(n, newList);
-        } else if (!state_buckets) {
+    rehashStep(REHASH_STEPS);
+    StateTable* t = currentTable();
+    if (!t) {
+        t = allocTable(64);
+        if (!t) {
             return mtstates_ERROR_OUT_OF_MEMORY(L);
         }
+        atomic_set_ptr_if_equal(&state_table, NULL, t);
+    }
+    else if (!atomic_get_ptr(&rehash_table) && atomic_get(&state_counter) + 1 > t->n * 4) {
+        startRehash(2 * t->n);
     }
-    toBuckets(s, state_buckets, state_bucket_list);
+    toBuckets(s, currentTable());
     atomic_inc(&state_counter);
     
+    if (s->stateName && !addToNameIndex(s)) {
+        return mtstates_ERROR_OUT_OF_MEMORY(L);
+    }
+    
     async_mutex_unlock(mtstates_global_lock); this->globalLocked = false;
 
     /* globalLocked */
@@ -675,7 +1323,18 @@ static int Mtstates_newState2(lua_State* L)
     this->lastArg  = lastArg;
 
     
-    lua_State* L2 = luaL_newstate();
+    mtstates_allocator_init(&s->allocator, this->memoryLimit, this->useSlabs);
+    s->fair = this->fair;
+    s->spin = this->spin;
+    s->inboxLimit = this->inboxLimit;
+    s->coalesce   = this->coalesce;
+    s->bytesMode  = this->bytesMode;
+
+    lua_State* L2 = mtstates_allocator_newstate(&s->allocator);
+    if (L2 == NULL && this->memoryLimit == 0) {
+        /* LuaJIT does not support lua_newstate() for 64bit */
+        L2 = luaL_newstate();
+    }
     if (L2 == NULL) {
         return mtstates_ERROR_OUT_OF_MEMORY(L);
     }
@@ -700,6 +1359,9 @@ static int Mtstates_newState2(lua_State* L)
             if (this->isLError) {
                 freeErrorMsg(errorMsg);
                 return lua_error(L);
+            } else if (this->isMemoryError) {
+                freeErrorMsg(errorMsg);
+                return mtstates_ERROR_OUT_OF_MEMORY_state(L, NULL, lua_tostring(L, -1));
             } else {
                 freeErrorMsg(errorMsg);
                 return mtstates_ERROR_INVOKING_STATE(L, NULL, lua_tostring(L, -1));
@@ -738,7 +1400,9 @@ static int Mtstates_newState3(lua_State* L2)
         lua_pop(L2, 2);
     }
     
-    int rc = luaL_loadbuffer(L2, this->stateCode, this->stateCodeLength, this->stateCode);
+    const char* chunkName = this->stateSource ? this->stateSource : this->stateCode;
+
+    int rc = luaL_loadbuffer(L2, this->stateCode, this->stateCodeLength, chunkName);
 
     if (rc != LUA_OK) {
         this->errorArg = this->stateFunction;
@@ -746,6 +1410,14 @@ static int Mtstates_newState3(lua_State* L2)
         setErrorMsg(&this->errorMsg, L2);
         return lua_error(L2); /* error has bee pushed by loadbuffer */
     }
+    if (this->stateSource && !this->stateChunk) {
+        /* compiled source code is cached as binary chunk for next time */
+        this->tmp.bufferLength = 0;
+        if (lua_dump(L2, &dumpWriter, &this->tmp, false) == 0) {
+            this->stateChunk = mtstates_setup_cache_add(this->stateSource, this->stateSourceLength, true,
+                                                        this->tmp.bufferStart, this->tmp.bufferLength);
+        }
+    }
     int func = lua_gettop(L2);
     rc = pushArgs(L2, L, this->firstArg, this->lastArg, &this->carrayCapi);
     if (rc != 0) {
@@ -773,6 +1445,7 @@ static int Mtstates_newState3(lua_State* L2)
                 lua_pushfstring(L2, "state setup function returned bad parameter #%d: %s", rc - firstrslt + 1, lua_tostring(L, -1));
                 mtstates_push_ERROR_STATE_RESULT(L2, NULL, lua_tostring(L2, -1));
                 this->isLError = true;
+                setErrorMsg(&this->errorMsg, L2);
                 return lua_error(L2);
             } else {
                 this->isLError = true;
@@ -780,20 +1453,47 @@ static int Mtstates_newState3(lua_State* L2)
             }
         }
     }
-    if (nrslts < 1 || lua_type(L2, firstrslt) != LUA_TFUNCTION) {
-        const char* t = (nrslts < 1) ? "nothing" : lua_typename(L2, lua_type(L2, firstrslt));
-        lua_pushfstring(L2, "state setup function returned %s but a function is required as first result parameter", t);
+    int rtype = (nrslts < 1) ? LUA_TNONE : lua_type(L2, firstrslt);
+    if (rtype == LUA_TTABLE && !isTableOfFunctions(L2, firstrslt)) {
+        rtype = LUA_TNONE;
+    }
+    if (rtype != LUA_TFUNCTION && rtype != LUA_TTABLE) {
+        const char* t = (nrslts < 1) ? "nothing" 
+                                     : (rtype == LUA_TNONE) ? "invalid table" 
+                                                            : lua_typename(L2, rtype);
+        lua_pushfstring(L2, "state setup function returned %s but a function or a table of functions is required as first result parameter", t);
         mtstates_push_ERROR_STATE_RESULT(L2, NULL, lua_tostring(L2, -1));
         this->isLError = true;
         return lua_error(L2);
     }
-    lua_pushvalue(L2, firstrslt);
+    lua_pushcfunction(L2, errormsghandler1);
+    this->state->errorhandlerref = luaL_ref(L2, LUA_REGISTRYINDEX);
+    lua_pushcfunction(L2, MtState_call4);
+    this->state->call4ref = luaL_ref(L2, LUA_REGISTRYINDEX);
+    lua_pushcfunction(L2, MtState_call3a);
+    this->state->call3aref = luaL_ref(L2, LUA_REGISTRYINDEX);
+    this->state->execcacheref = LUA_NOREF;
+
+    if (rtype == LUA_TTABLE) {
+        lua_pushvalue(L2, firstrslt);
+        this->state->methodsref = luaL_ref(L2, LUA_REGISTRYINDEX);
+        if (luaL_loadbuffer(L2, METHODS_DISPATCHER, strlen(METHODS_DISPATCHER), "=mtstates.methods") != LUA_OK) {
+            return lua_error(L2);
+        }
+        lua_pushvalue(L2, firstrslt);
+        lua_call(L2, 1, 1);                                 /* -> dispatcher */
+    } else {
+        this->state->methodsref = LUA_NOREF;
+        lua_pushvalue(L2, firstrslt);
+    }
 
     async_mutex_lock(&this->state->stateMutex); this->stateLocked  = true;
 
     this->state->callbackref = luaL_ref(L2, LUA_REGISTRYINDEX);
     this->state->L2 = L2; this->L2 = NULL;
-    this->state->isBusy      = false;
+    this->state->memoryCurrent = this->state->allocator.current;
+    this->state->memoryPeak    = this->state->allocator.peak;
+    setBusy(this->state, false);
     
     atomic_set(&this->state->initialized, true);
 
@@ -829,11 +1529,13 @@ static int MtState_close(lua_State* L)
     }
     
     if (s->L2) {
-        lua_close(s->L2);
+        mtstates_allocator_closestate(&s->allocator, s->L2);
         s->L2 = NULL;
     }
     atomic_set(&s->closed, true);
     async_mutex_unlock(&s->stateMutex);
+    
+    mtstates_mailbox_stop(s);
     return 0;
 }
 
@@ -848,35 +1550,53 @@ static void MtState_free(MtState* s)
     if (s->nextState) {
         s->nextState->prevStatePtr = s->prevStatePtr;
     }
+    removeFromNameIndex(s);
     
     if (s->L2) {
-        lua_close(s->L2);
+        mtstates_allocator_closestate(&s->allocator, s->L2);
     }
     if (s->stateName) {
         free(s->stateName);
     }
+    discardInbox(s);
+    while (s->firstUnref) {
+        PendingUnref* u = s->firstUnref;
+        s->firstUnref = u->nextUnref;
+        free(u);
+    }
+    while (s->firstMethod) {
+        MethodEntry* e = s->firstMethod;
+        s->firstMethod = e->nextMethod;
+        free(e);
+    }
     async_mutex_destruct(&s->stateMutex);
-    free(s);
+    mtstates_mailbox_free(&s->mailbox);
     
     if (wasInBucket) {
+        retireState(s); /* may still be seen by readers without global lock */
+        
         int c = atomic_dec(&state_counter);
         if (c == 0) {
-            if (state_bucket_list)  {
-                free(state_bucket_list);
+            StateTable* t = currentTable();
+            StateTable* r = atomic_get_ptr(&rehash_table);
+            atomic_set_ptr_if_equal(&state_table,  t, NULL);
+            atomic_set_ptr_if_equal(&rehash_table, r, NULL);
+            retireTable(t);
+            if (r) {
+                retireTable(r);
             }
-            state_buckets     = 0;
-            state_bucket_list = NULL;
-            bucket_usage      = 0;
-        }
-        else if (c * 10 < state_buckets) {
-            lua_Integer n = 2 * c;
-            if (n > 64) {
-                StateBucket* newList = calloc(n, sizeof(StateBucket));
-                if (newList) {
-                    newBuckets(n, newList);
-                }
+        }
+        else {
+            rehashStep(REHASH_STEPS);
+            StateTable* t = currentTable();
+            /* hysteresis: after shrinking the load factor is 2, growing starts at 4 */
+            if (!atomic_get_ptr(&rehash_table) && c * 16 < t->n && t->n > 64) {
+                lua_Integer n = c / 2;
+                startRehash(n > 64 ? n : 64);
             }
         }
+    } else {
+        free(s);
     }
 }
 
@@ -887,25 +1607,48 @@ void mtstates_state_free(MtState* state)
     async_mutex_unlock(mtstates_global_lock);
 }
 
+void mtstates_state_disown(MtState* s)
+{
+    bool wasLastOwner = false;
+    async_mutex_lock(&s->stateMutex);
+    if (atomic_dec(&s->owned) == 0) {
+        if (!s->isBusy && s->L2 != NULL) {
+            mtstates_allocator_closestate(&s->allocator, s->L2);
+            s->L2 = NULL;
+        }
+        atomic_set(&s->closed, true);
+        wasLastOwner = true;
+    }
+    async_mutex_unlock(&s->stateMutex);
+    
+    if (wasLastOwner) {
+        mtstates_mailbox_stop(s);
+    }
+}
+
+void mtstates_state_push_reference(lua_State* L, MtState* s)
+{
+    StateUserData* udata = lua_newuserdata(L, sizeof(StateUserData));
+    memset(udata, 0, sizeof(StateUserData));
+    pushStateMeta(L);        /* -> udata, meta */
+    lua_setmetatable(L, -2); /* -> udata */
+
+    udata->state = s;
+    atomic_inc(&s->used);
+}
+
 static int MtState_release(lua_State* L)
 {
     StateUserData* udata = luaL_checkudata(L, 1, MTSTATES_STATE_CLASS_NAME);
     MtState*       s     = udata->state;
 
     if (s) {
-        async_mutex_lock(mtstates_global_lock);
-        
-        async_mutex_lock(&s->stateMutex);
         if (udata->isOwner) {
-            if (atomic_dec(&s->owned) == 0) {
-                if (!s->isBusy && s->L2 != NULL) {
-                    lua_close(s->L2);
-                    s->L2 = NULL;
-                }
-                atomic_set(&s->closed, true);
-            }
+            /* without global lock: the mailbox worker is not awaited */
+            mtstates_state_disown(s);
         }
-        async_mutex_unlock(&s->stateMutex);
+        
+        async_mutex_lock(mtstates_global_lock);
         
         if (atomic_dec(&s->used) == 0) {
             MtState_free(s);
@@ -952,6 +1695,11 @@ static int MtState_interrupt(lua_State* L)
 }
 
 static int MtState_call2(lua_State* L, bool isTimed);
+static int MtState_iter2(lua_State* L, bool release);
+static int callState(lua_State* L, bool isTimed, bool isDeadline, bool isTry, bool isBatch, int arg, 
+                     MtState* s, int callbackRef, const ExecChunk* exec, IterStart* iter,
+                     receiver_writer* w, receiver_writer* results,
+                     notifier_error_handler notify_eh, void* notify_ehdata);
 static int MtState_call3(lua_State* L);
 static int MtState_call3a(lua_State* L);
 static int MtState_call4(lua_State* L2);
@@ -959,8 +1707,10 @@ static int MtState_call4(lua_State* L2);
 
 typedef struct {
     receiver_writer* w;
+    receiver_writer* results;
     int callbackRef;
     const carray_capi* carrayCapi;
+    MtBytesMode bytesMode;
 } MtState_call3a_UserData;
 
 static int MtState_call(lua_State* L)
@@ -968,35 +1718,711 @@ static int MtState_call(lua_State* L)
     return MtState_call2(L, false);
 }
 
-static int MtState_tcall(lua_State* L)
+static int MtState_tcall(lua_State* L)
+{
+    return MtState_call2(L, true);
+}
+
+static int MtState_dcall(lua_State* L)
+{
+    int arg = 1;
+    StateUserData* udata = luaL_checkudata(L, arg++, MTSTATES_STATE_CLASS_NAME);
+    return callState(L, true, true, false, false, arg, udata->state, LUA_NOREF, NULL, NULL, NULL, NULL, NULL, NULL);
+}
+
+static int MtState_call2(lua_State* L, bool isTimed)
+{
+    int arg = 1;
+    StateUserData* udata = luaL_checkudata(L, arg++, MTSTATES_STATE_CLASS_NAME);
+    return mtstates_state_call(L, isTimed, arg, udata->state, NULL, NULL, NULL, NULL);
+}
+
+struct StateWaiter {
+    Mutex        mutex;
+    bool         granted;
+    ThreadId     threadId;
+    StateWaiter* nextWaiter;
+};
+
+/*
+ * Marks the state as not busy or hands it over to the next waiter in fair 
+ * mode. stateMutex must be locked.
+ */
+static void releaseState(MtState* s)
+{
+    if (s->busySince > 0) {
+        lua_Number d = mtstates_monotonic_time_seconds() - s->busySince;
+        s->avgBusySeconds += (d - s->avgBusySeconds) / 4;
+        s->busySince = 0;
+    }
+    if (atomic_get(&s->owned) == 0 && s->L2) {
+        mtstates_allocator_closestate(&s->allocator, s->L2);
+        s->L2 = NULL;
+    }
+    s->memoryCurrent = s->allocator.current;
+    s->memoryPeak    = s->allocator.peak;
+    
+    StateWaiter* w = s->firstWaiter;
+    if (w) {
+        /* the state stays busy, new callers cannot overtake the waiter */
+        s->firstWaiter = w->nextWaiter;
+        if (!s->firstWaiter) {
+            s->lastWaiter = NULL;
+        }
+        s->waitingCount  -= 1;
+        s->calledByThread = w->threadId;
+        async_mutex_lock(&w->mutex);
+        w->granted = true;
+        async_mutex_notify(&w->mutex);
+        async_mutex_unlock(&w->mutex);
+    } else {
+        setBusy(s, false);
+        async_mutex_notify(&s->stateMutex);
+    }
+}
+
+/*
+ * Enqueues the caller and waits until the busy state is handed over.
+ * stateMutex must be locked and is locked again on return. Returns 0 if 
+ * the state has been handed over or 100 on timeout.
+ */
+static int waitInQueue(MtState* s, ThreadId myThreadId, bool isTimed, lua_Number endTime)
+{
+    StateWaiter w;
+    async_mutex_init(&w.mutex);
+    w.granted    = false;
+    w.threadId   = myThreadId;
+    w.nextWaiter = NULL;
+    if (s->lastWaiter) {
+        s->lastWaiter->nextWaiter = &w;
+    } else {
+        s->firstWaiter = &w;
+    }
+    s->lastWaiter    = &w;
+    s->waitingCount += 1;
+    
+    async_mutex_lock(&w.mutex);
+    async_mutex_unlock(&s->stateMutex);
+    while (!w.granted) {
+        if (isTimed) {
+            if (mtstates_monotonic_time_seconds() < endTime) {
+                async_mutex_wait_until(&w.mutex, endTime);
+            } else {
+                break;
+            }
+        } else {
+            async_mutex_wait(&w.mutex);
+        }
+    }
+    async_mutex_unlock(&w.mutex);
+    async_mutex_lock(&s->stateMutex);
+    
+    int rc = 0;
+    if (!w.granted) {
+        StateWaiter** ptr  = &s->firstWaiter;
+        StateWaiter*  prev = NULL;
+        while (*ptr != &w) {
+            prev = *ptr;
+            ptr  = &prev->nextWaiter;
+        }
+        *ptr = w.nextWaiter;
+        if (s->lastWaiter == &w) {
+            s->lastWaiter = prev;
+        }
+        s->waitingCount -= 1;
+        rc = 100; // time out
+    }
+    async_mutex_destruct(&w.mutex);
+    return rc;
+}
+
+/*
+ * Busy waits for the state if its calls are known to be shorter than the time
+ * needed for parking and waking up a thread. stateMutex must be locked and is 
+ * locked again on return.
+ */
+static void spinWhileBusy(MtState* s, bool isTimed, lua_Number deadline)
+{
+    lua_Number avg = s->avgBusySeconds;
+    if (processor_count < 2 || avg <= 0 || avg > MAX_SPIN_SECONDS) {
+        return;
+    }
+    lua_Number endTime = mtstates_monotonic_time_seconds() + 2 * avg;
+    if (isTimed && deadline < endTime) {
+        endTime = deadline;
+    }
+    async_mutex_unlock(&s->stateMutex);
+    do {
+        int i;
+        for (i = 0; i < 32 && atomic_get(&s->busyFlag) == MTSTATES_STATE_BUSY; ++i) {
+            atomic_spin_pause();
+        }
+    } while (   atomic_get(&s->busyFlag) == MTSTATES_STATE_BUSY 
+             && mtstates_monotonic_time_seconds() < endTime);
+    async_mutex_lock(&s->stateMutex);
+}
+
+/*
+ * Waits until the state is not busy and marks it busy for the current thread.
+ * stateMutex must be locked and is unlocked on return. Returns 0 on success,
+ * 100 on timeout or 101 if the state is closed.
+ */
+static int acquireState(MtState* s, bool isTimed, lua_Number endTime, bool* isSelfCall)
+{
+    if (s->L2 == NULL) {
+        setBusy(s, s->isBusy); /* clears a reservation of the pool */
+        async_mutex_unlock(&s->stateMutex);
+        return 101; // closed
+    }
+    ThreadId myThreadId = async_current_threadid();
+    
+    if (s->isBusy && s->calledByThread == myThreadId) {
+        *isSelfCall = true;
+        async_mutex_unlock(&s->stateMutex);
+        return 0;
+    }
+    if (s->isBusy) {
+        if (s->fair) {
+            if (waitInQueue(s, myThreadId, isTimed, endTime) != 0) {
+                async_mutex_unlock(&s->stateMutex);
+                return 100; // time out
+            }
+        } else {
+            s->waitingCount += 1;
+            if (s->spin) {
+                spinWhileBusy(s, isTimed, endTime);
+            }
+            while (s->isBusy) {
+                if (isTimed) {
+                    if (mtstates_monotonic_time_seconds() < endTime) {
+                        async_mutex_wait_until(&s->stateMutex, endTime);
+                    } else {
+                        s->waitingCount -= 1;
+                        async_mutex_unlock(&s->stateMutex);
+                        return 100; // time out
+                    }
+                } else {
+                    async_mutex_wait(&s->stateMutex);
+                }
+            }
+            s->waitingCount -= 1;
+        }
+    }
+    setBusy(s, true);
+    s->calledByThread = myThreadId;
+    if ((++s->callCounter & SAMPLE_MASK) == 0) {
+        s->busySince = mtstates_monotonic_time_seconds();
+    }
+    
+    if (s->L2 == NULL) {
+        /* closed while waiting */
+        releaseState(s);
+        async_mutex_unlock(&s->stateMutex);
+        return 101;
+    }
+    async_mutex_unlock(&s->stateMutex);
+    return 0;
+}
+
+/*
+ * Invokes the state callback with the writer's content as arguments. The 
+ * state must be acquired by the current thread.
+ */
+static int invokeWriter(MtState* s, int callbackRef, receiver_writer* w, receiver_writer* results,
+                        notifier_error_handler notify_eh, void* notify_ehdata)
+{
+    int notifier_rc = 0;
+    int nargs = w ? w->nargs : 0;
+    
+    if (lua_checkstack(s->L2, nargs + 10))
+    {
+        MtState_call3a_UserData ud3a;
+        ud3a.w = w;
+        ud3a.results = results;
+        ud3a.callbackRef = callbackRef;
+        ud3a.carrayCapi = s->carrayCapi;
+        ud3a.bytesMode = s->bytesMode;
+        
+        int l2start = lua_gettop(s->L2);
+        lua_rawgeti(s->L2, LUA_REGISTRYINDEX, s->errorhandlerref);
+        lua_rawgeti(s->L2, LUA_REGISTRYINDEX, s->call3aref);
+        lua_pushlightuserdata(s->L2, &ud3a);
+        int lua_rc = lua_pcall(s->L2, 1, 0, l2start + 1);
+        
+        s->carrayCapi = ud3a.carrayCapi;
+        
+        if (lua_rc != LUA_OK) {
+            if (notify_eh) {
+                size_t       msglen = 0;
+                const char*  msg    = lua_tolstring(s->L2, -1, &msglen);
+                notify_eh(notify_ehdata, msg, msglen);
+            }
+            notifier_rc = 990;
+        }
+        lua_settop(s->L2, l2start);
+    } else {
+        notifier_rc = 999;
+    }
+    return notifier_rc;
+}
+
+/* invocation without caller, errors are reported like errors of posted messages */
+static void invokeDetached(MtState* s, receiver_writer* w)
+{
+    if (!atomic_get(&s->closed)) {
+        int rc = invokeWriter(s, s->callbackref, w, NULL, mtstates_mailbox_error_handler, &s->mailbox);
+        if (rc == 999) {
+            const char* details = "not enough memory";
+            mtstates_mailbox_error_handler(&s->mailbox, details, strlen(details));
+        }
+    }
+}
+
+/*
+ * Invokes the messages that were queued in the inbox and pending coalesced 
+ * notifications while the state was busy and releases the state.
+ */
+static void finishCall(MtState* s)
+{
+    async_mutex_lock(&s->stateMutex);
+    while (true) {
+        if (s->firstUnref) {
+            PendingUnref* u = s->firstUnref;
+            s->firstUnref = NULL;
+            async_mutex_unlock(&s->stateMutex);
+            while (u) {
+                PendingUnref* next = u->nextUnref;
+                luaL_unref(s->L2, LUA_REGISTRYINDEX, u->ref);
+                free(u);
+                u = next;
+            }
+        }
+        else if (s->firstInbox) {
+            InboxMessage* msg = s->firstInbox;
+            s->firstInbox = msg->nextMessage;
+            if (!s->firstInbox) {
+                s->lastInbox = NULL;
+            }
+            s->inboxBytes -= msg->length;
+            async_mutex_unlock(&s->stateMutex);
+    
+            receiver_writer w;
+            memset(&w, 0, sizeof(receiver_writer));
+            w.nargs              = msg->nargs;
+            w.mem.bufferData     = msg->data;
+            w.mem.bufferStart    = msg->data;
+            w.mem.bufferLength   = msg->length;
+            w.mem.bufferCapacity = msg->length;
+            invokeDetached(s, &w);
+            free(msg);
+        }
+        else if (s->coalesce && atomic_set(&s->notifyPending, false)) {
+            async_mutex_unlock(&s->stateMutex);
+            invokeDetached(s, NULL);
+        }
+        else {
+            break;
+        }
+        async_mutex_lock(&s->stateMutex);
+    }
+    releaseState(s);
+    async_mutex_unlock(&s->stateMutex);
+}
+
+int mtstates_state_notify(MtState* s, notifier_error_handler notify_eh, void* notify_ehdata)
+{
+    if (!s->coalesce) {
+        int rc = mtstates_state_call(NULL, false, 0, s, NULL, NULL, notify_eh, notify_ehdata);
+        return (rc == 101) ? 1 : rc;
+    }
+    if (atomic_get(&s->closed)) {
+        return 1; // closed
+    }
+    if (atomic_set(&s->notifyPending, true)) {
+        return 0; /* already pending */
+    }
+    async_mutex_lock(&s->stateMutex);
+    if (s->L2 == NULL) {
+        atomic_set(&s->notifyPending, false);
+        async_mutex_unlock(&s->stateMutex);
+        return 1; // closed
+    }
+    if (s->isBusy) {
+        /* the thread holding the state invokes the callback before releasing */
+        async_mutex_unlock(&s->stateMutex);
+        return 0;
+    }
+    bool isSelfCall = false;
+    if (acquireState(s, false, 0, &isSelfCall) != 0) {
+        atomic_set(&s->notifyPending, false);
+        return 1; // closed
+    }
+    atomic_set(&s->notifyPending, false);
+    int rc = invokeWriter(s, s->callbackref, NULL, NULL, notify_eh, notify_ehdata);
+    finishCall(s);
+    return rc;
+}
+
+int mtstates_state_receive(MtState* s, receiver_writer* w, bool clear, bool nonblock,
+                           notifier_error_handler notify_eh, void* notify_ehdata)
+{
+    async_mutex_lock(&s->stateMutex);
+    if (s->L2 == NULL) {
+        async_mutex_unlock(&s->stateMutex);
+        return 1; // closed
+    }
+    if (clear) {
+        discardInbox(s);
+    }
+    if (s->isBusy && s->calledByThread != async_current_threadid()) {
+        if (s->inboxLimit > 0) {
+            size_t length = w->mem.bufferLength;
+            int    rc     = 0;
+            if (length > s->inboxLimit) {
+                rc = 5;
+            } else if (s->inboxBytes + length > s->inboxLimit) {
+                rc = 4;
+            } else {
+                InboxMessage* msg = malloc(sizeof(InboxMessage) + length);
+                if (msg) {
+                    msg->nextMessage = NULL;
+                    msg->nargs       = w->nargs;
+                    msg->length      = length;
+                    memcpy(msg->data, w->mem.bufferStart, length);
+                    if (s->lastInbox) {
+                        s->lastInbox->nextMessage = msg;
+                    } else {
+                        s->firstInbox = msg;
+                    }
+                    s->lastInbox   = msg;
+                    s->inboxBytes += length;
+                    async_mutex_unlock(&s->stateMutex);
+                    return 0;
+                }
+                rc = 6;
+            }
+            if (nonblock) {
+                async_mutex_unlock(&s->stateMutex);
+                return rc;
+            }
+            /* blocking: wait for the state if the message cannot be queued */
+        }
+        else if (nonblock) {
+            async_mutex_unlock(&s->stateMutex);
+            return 3;
+        }
+    }
+    async_mutex_unlock(&s->stateMutex);
+    
+    int rc = mtstates_state_call(NULL, nonblock, 0, s, w, NULL, notify_eh, notify_ehdata);
+    switch (rc) {
+        case 100: return 3; // not ready
+        case 101: return 1; // closed
+        case 999: return 6; // out of memory
+        default:  return rc;
+    }
+}
+
+typedef struct {
+    MtState*    state;
+    const char* name;
+    size_t      nameLength;
+    int         ref;
+} ResolveMethodVars;
+
+static int resolveMethod3(lua_State* L2)
+{
+    ResolveMethodVars* this = (ResolveMethodVars*)lua_touserdata(L2, 1);
+    
+    lua_rawgeti(L2, LUA_REGISTRYINDEX, this->state->methodsref); /* -> methods */
+    lua_pushlstring(L2, this->name, this->nameLength);           /* -> methods, name */
+    lua_rawget(L2, -2);                                          /* -> methods, method */
+    if (lua_type(L2, -1) == LUA_TFUNCTION) {
+        this->ref = luaL_ref(L2, LUA_REGISTRYINDEX);             /* -> methods */
+    }
+    return 0;
+}
+
+/* stateMutex must be locked */
+static MethodEntry* findMethod(MtState* s, const char* name, size_t nameLength)
+{
+    MethodEntry* e = s->firstMethod;
+    while (e && (e->nameLength != nameLength || memcmp(e->name, name, nameLength) != 0)) {
+        e = e->nextMethod;
+    }
+    return e;
+}
+
+/*
+ * Resolves the function of the methods table once per state and name, the 
+ * state is only acquired if the method has not been resolved before.
+ */
+static int MtState_method(lua_State* L)
+{
+    int arg = 1;
+    StateUserData* udata = luaL_checkudata(L, arg++, MTSTATES_STATE_CLASS_NAME);
+    MtState*       s     = udata->state;
+    size_t         nameLength;
+    const char*    name  = luaL_checklstring(L, arg, &nameLength);
+    
+    async_mutex_lock(&s->stateMutex);
+    MethodEntry* e = findMethod(s, name, nameLength);
+    if (e) {
+        async_mutex_unlock(&s->stateMutex);
+        mtstates_method_push(L, s, e);
+        return 1;
+    }
+    bool isSelfCall = false;
+    if (acquireState(s, false, 0, &isSelfCall) != 0) {
+        return mtstates_ERROR_OBJECT_CLOSED(L, mtstates_state_tostring(L, s));
+    }
+    ResolveMethodVars vars;
+    vars.state      = s;
+    vars.name       = name;
+    vars.nameLength = nameLength;
+    vars.ref        = LUA_NOREF;
+    
+    bool isMemoryError = false;
+    if (s->methodsref != LUA_NOREF) {
+        lua_State* L2 = s->L2;
+        int l2start = lua_gettop(L2);
+        if (lua_checkstack(L2, LUA_MINSTACK)) {
+            lua_pushcfunction(L2, resolveMethod3);
+            lua_pushlightuserdata(L2, &vars);
+            isMemoryError = (lua_pcall(L2, 1, 0, 0) != LUA_OK);
+        } else {
+            isMemoryError = true;
+        }
+        lua_settop(L2, l2start);
+    }
+    if (vars.ref != LUA_NOREF) {
+        e = malloc(sizeof(MethodEntry) + nameLength);
+        if (e) {
+            e->ref        = vars.ref;
+            e->nameLength = nameLength;
+            memcpy(e->name, name, nameLength);
+            e->name[nameLength] = '\0';
+            async_mutex_lock(&s->stateMutex);
+            e->nextMethod  = s->firstMethod;
+            s->firstMethod = e;
+            async_mutex_unlock(&s->stateMutex);
+        } else {
+            isMemoryError = true;
+        }
+    }
+    if (!isSelfCall) {
+        finishCall(s);
+    }
+    if (isMemoryError) {
+        return mtstates_ERROR_OUT_OF_MEMORY(L);
+    }
+    if (!e) {
+        if (s->methodsref == LUA_NOREF) {
+            return luaL_argerror(L, arg, "state setup function did not return a table of functions");
+        } else {
+            return luaL_argerror(L, arg, lua_pushfstring(L, "unknown method %s", name));
+        }
+    }
+    mtstates_method_push(L, s, e);
+    return 1;
+}
+
+typedef struct {
+    bool        init;
+    luaL_Buffer buffer;
+} DumpBuffer;
+
+static int dumpToBuffer(lua_State* L, const void* p, size_t sz, void* ud)
+{
+    DumpBuffer* d = (DumpBuffer*) ud;
+    if (!d->init) {
+        /* in Lua 5.4 luaL_buffinit pushes a value, the function must be on top for lua_dump */
+        d->init = true;
+        luaL_buffinit(L, &d->buffer);
+    }
+    luaL_addlstring(&d->buffer, (const char*)p, sz);
+    return 0;
+}
+
+/*
+ * Replaces the lua function at the given index by its binary chunk. The
+ * chunk is remembered for the function in a weak table.
+ */
+static void replaceByDump(lua_State* L, int func)
+{
+    lua_pushlightuserdata(L, (void*)&exec_dumps_key);       /* -> key */
+    lua_rawget(L, LUA_REGISTRYINDEX);                       /* -> dumps */
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);                                      /* -> */
+        lua_newtable(L);                                    /* -> dumps */
+        lua_newtable(L);                                    /* -> dumps, meta */
+        lua_pushstring(L, "k");                             /* -> dumps, meta, "k" */
+        lua_setfield(L, -2, "__mode");                      /* -> dumps, meta */
+        lua_setmetatable(L, -2);                            /* -> dumps */
+        lua_pushlightuserdata(L, (void*)&exec_dumps_key);   /* -> dumps, key */
+        lua_pushvalue(L, -2);                               /* -> dumps, key, dumps */
+        lua_rawset(L, LUA_REGISTRYINDEX);                   /* -> dumps */
+    }
+    lua_pushvalue(L, func);                                 /* -> dumps, func */
+    lua_rawget(L, -2);                                      /* -> dumps, dump */
+    if (lua_type(L, -1) != LUA_TSTRING) {
+        lua_pop(L, 1);                                      /* -> dumps */
+        lua_pushvalue(L, func);                             /* -> dumps, func */
+        DumpBuffer d;
+        d.init = false;
+        if (lua_dump(L, &dumpToBuffer, &d, false) != 0 || !d.init) {
+            mtstates_ERROR_OUT_OF_MEMORY(L);
+        }
+        luaL_pushresult(&d.buffer);                         /* -> dumps, func, dump */
+        lua_remove(L, -2);                                  /* -> dumps, dump */
+        lua_pushvalue(L, func);                             /* -> dumps, dump, func */
+        lua_pushvalue(L, -2);                               /* -> dumps, dump, func, dump */
+        lua_rawset(L, -4);                                  /* -> dumps, dump */
+    }
+    lua_replace(L, func);                                   /* -> dumps */
+    lua_pop(L, 1);                                          /* -> */
+}
+
+/*
+ * Invokes the given lua function or source code within the state. The function
+ * must not have upvalues, the same as for the state setup function.
+ */
+static int MtState_exec(lua_State* L)
+{
+    int arg = 1;
+    StateUserData* udata = luaL_checkudata(L, arg++, MTSTATES_STATE_CLASS_NAME);
+    ExecChunk      exec;
+    
+    exec.isSource = (lua_type(L, arg) == LUA_TSTRING);
+    if (!exec.isSource) {
+        if (lua_type(L, arg) != LUA_TFUNCTION || lua_iscfunction(L, arg)) {
+            return luaL_argerror(L, arg, "lua function or string expected");
+        }
+        const char* varname = getUpvalueName(L, arg);
+        if (varname) {
+            return luaL_argerror(L, arg, lua_pushfstring(L, "function uses upvalue '%s'", varname));
+        }
+        replaceByDump(L, arg);
+    }
+    exec.key  = lua_tolstring(L, arg, &exec.keyLength);
+    exec.hash = mtstates_setup_cache_hash(exec.key, exec.keyLength, exec.isSource);
+    
+    return callState(L, false, false, false, false, arg + 1, udata->state, LUA_NOREF, &exec, NULL, NULL, NULL, NULL, NULL);
+}
+
+static int MtState_callBatch(lua_State* L)
+{
+    int arg = 1;
+    StateUserData* udata = luaL_checkudata(L, arg++, MTSTATES_STATE_CLASS_NAME);
+    luaL_checktype(L, arg, LUA_TTABLE);
+    lua_settop(L, arg + 1);
+    return callState(L, false, false, false, true, arg, udata->state, LUA_NOREF, NULL, NULL, NULL, NULL, NULL, NULL);
+}
+
+int mtstates_state_call(lua_State* L, bool isTimed, int arg, 
+                        MtState* s, receiver_writer* w, receiver_writer* results,
+                        notifier_error_handler notify_eh, void* notify_ehdata)
+{
+    return callState(L, isTimed, false, false, false, arg, s, LUA_NOREF, NULL, NULL, w, results, notify_eh, notify_ehdata);
+}
+
+int mtstates_state_call_method(lua_State* L, bool isTimed, int arg, MtState* s, int ref)
+{
+    return callState(L, isTimed, false, false, false, arg, s, ref, NULL, NULL, NULL, NULL, NULL, NULL);
+}
+
+static int MtState_iter2(lua_State* L, bool release)
+{
+    int arg = 1;
+    StateUserData* udata = luaL_checkudata(L, arg++, MTSTATES_STATE_CLASS_NAME);
+    IterStart      iter;
+    iter.release = release;
+    iter.isHeld  = false;
+    iter.ref     = LUA_NOREF;
+    return callState(L, false, false, false, false, arg, udata->state, LUA_NOREF, NULL, &iter, NULL, NULL, NULL, NULL);
+}
+
+void mtstates_state_hold(MtState* s, const void* holder)
+{
+    async_mutex_lock(&s->stateMutex);
+    s->holder = holder;
+    async_mutex_unlock(&s->stateMutex);
+}
+
+void mtstates_state_takeover(MtState* s, const void* holder)
+{
+    async_mutex_lock(&s->stateMutex);
+    if (s->isBusy && s->holder == holder) {
+        s->calledByThread = async_current_threadid();
+    }
+    async_mutex_unlock(&s->stateMutex);
+}
+
+void mtstates_state_unhold(MtState* s)
 {
-    return MtState_call2(L, true);
+    async_mutex_lock(&s->stateMutex);
+    s->holder = NULL;
+    async_mutex_unlock(&s->stateMutex);
+    finishCall(s);
 }
 
-static int MtState_call2(lua_State* L, bool isTimed)
+void mtstates_state_unref(MtState* s, int ref, bool isHeld)
 {
-    int arg = 1;
-    StateUserData* udata = luaL_checkudata(L, arg++, MTSTATES_STATE_CLASS_NAME);
-    return mtstates_state_call(L, isTimed, arg, udata->state, NULL, NULL, NULL);
+    if (isHeld) {
+        luaL_unref(s->L2, LUA_REGISTRYINDEX, ref);
+        return;
+    }
+    async_mutex_lock(&s->stateMutex);
+    if (s->isBusy && s->calledByThread != async_current_threadid()) {
+        /* no waiting, e.g. within __gc: released by finishCall() of the other thread */
+        PendingUnref* u = malloc(sizeof(PendingUnref));
+        if (u) {
+            u->ref        = ref;
+            u->nextUnref  = s->firstUnref;
+            s->firstUnref = u;
+        }
+        async_mutex_unlock(&s->stateMutex);
+        return;
+    }
+    bool isSelfCall = false;
+    if (acquireState(s, false, 0, &isSelfCall) == 0) {
+        luaL_unref(s->L2, LUA_REGISTRYINDEX, ref);
+        if (!isSelfCall) {
+            finishCall(s);
+        }
+    }
 }
 
-int mtstates_state_call(lua_State* L, bool isTimed, int arg, 
-                        MtState* s, receiver_writer* w,
-                        notifier_error_handler notify_eh, void* notify_ehdata)
+/* 
+ * callbackRef: LUA_NOREF for the state callback, exec: not NULL for state:exec(),
+ * iter: not NULL for keeping the first result as generator for state:iter(),
+ * isTry: returns -1 without waiting if the state is busy in another thread,
+ * the arguments are then at their original stack positions.
+ */
+static int callState(lua_State* L, bool isTimed, bool isDeadline, bool isTry, bool isBatch, int arg, 
+                     MtState* s, int callbackRef, const ExecChunk* exec, IterStart* iter,
+                     receiver_writer* w, receiver_writer* results,
+                     notifier_error_handler notify_eh, void* notify_ehdata)
 {
     int lastArg = L ? lua_gettop(L) : 0;
     int nargs   = lastArg;
 
-    lua_Number endTime;
+    lua_Number endTime = 0;
     lua_Number waitSeconds;
     
     if (isTimed) {
-        if (L) {
-            waitSeconds = luaL_checknumber(L, arg++);
+        lua_Number now = mtstates_monotonic_time_seconds();
+        if (isDeadline) {
+            endTime     = luaL_checknumber(L, arg++);
+            waitSeconds = endTime - now;
         } else {
-            waitSeconds = ((lua_Number)arg) / 1000;
+            if (L) {
+                waitSeconds = luaL_checknumber(L, arg++);
+            } else {
+                waitSeconds = ((lua_Number)arg) / 1000;
+            }
+            endTime = now + waitSeconds;
         }
-        endTime = mtstates_current_time_seconds() + waitSeconds;
     }
 
     /* ------------------------------------------------------------------- */
@@ -1012,11 +2438,26 @@ int mtstates_state_call(lua_State* L, bool isTimed, int arg,
         this = &vars;
         this->L             = L;
         this->carrayCapi    = s->carrayCapi;
+        this->callbackRef   = callbackRef;
+        this->exec          = exec;
+        this->iter          = iter;
         this->isTimed       = isTimed;
+        this->isBatch       = isBatch;
         this->state         = s;
         this->firstArg      = arg;
         this->lastArg       = lastArg;
 
+        if (isBatch) {
+            this->batchResults = -1;
+            if (!lua_isnoneornil(L, arg + 1)) {
+                lua_Integer n = luaL_checkinteger(L, arg + 1);
+                if (n < 0 || n > INT_MAX) {
+                    return luaL_argerror(L, arg + 1, "non-negative integer expected");
+                }
+                this->batchResults = (int)n;
+            }
+        }
+
         if (L == s->L2) 
         {
             lua_pushcfunction(L, errormsghandler1);
@@ -1036,7 +2477,16 @@ int mtstates_state_call(lua_State* L, bool isTimed, int arg,
     
     /* ------------------------------------------------------------------- */
 
-    if (!isTimed || waitSeconds > 0) {
+    if (isTry) {
+        bool isLocked = async_mutex_trylock(&s->stateMutex);
+        if (!isLocked || (s->isBusy && s->calledByThread != async_current_threadid())) {
+            if (isLocked) {
+                async_mutex_unlock(&s->stateMutex);
+            }
+            lua_remove(L, func); /* arguments are at their original positions */
+            return -1;
+        }
+    } else if (!isTimed || waitSeconds > 0) {
         async_mutex_lock(&s->stateMutex);
     } else if (!async_mutex_trylock(&s->stateMutex)) {
         if (L) {
@@ -1047,46 +2497,28 @@ int mtstates_state_call(lua_State* L, bool isTimed, int arg,
         }
     }
 
-    if (s->L2 == NULL) {
-        async_mutex_unlock(&s->stateMutex);
-        if (L) {
-            return mtstates_ERROR_OBJECT_CLOSED(L, mtstates_state_tostring(L, s));
+    bool isSelfCall = false;
+    int  acquireRc  = acquireState(s, isTimed, endTime, &isSelfCall);
+    if (acquireRc != 0) {
+        if (!L) {
+            return acquireRc;
+        } else if (acquireRc == 100) {
+            lua_pushboolean(L, false);
+            return 1;
         } else {
-            return 101; // closed
+            return mtstates_ERROR_OBJECT_CLOSED(L, mtstates_state_tostring(L, s));
         }
     }
-    ThreadId myThreadId = async_current_threadid();
-    bool isSelfCall = (s->isBusy && s->calledByThread == myThreadId);
-    
-    if (s->isBusy && s->calledByThread != myThreadId) {
-        do {
-            if (isTimed) {
-                lua_Number now = mtstates_current_time_seconds();
-                if (now < endTime) {
-                    async_mutex_wait_millis(&s->stateMutex, (int)((endTime - now) * 1000 + 0.5));
-                } else {
-                    async_mutex_unlock(&s->stateMutex);
-                    if (L) {
-                        lua_pushboolean(L, false);
-                        return 1;
-                    } else {
-                        return 100; // time out
-                    }
-                }
-            } else {
-                async_mutex_wait(&s->stateMutex);
-            }
-        } while (s->isBusy);
-    }
-    s->isBusy = true;
-    s->calledByThread = myThreadId;
-    async_mutex_unlock(&s->stateMutex);
     
     /* ------------------------------------------------------------------- */
     
     if (L) 
     {
         int l2start = lua_gettop(s->L2);
+        
+        if (iter) {
+            iter->isHeld = !iter->release && !isSelfCall;
+        }
     
         int rc = lua_pcall(L, nargs, LUA_MULTRET, msgh);
     
@@ -1095,15 +2527,12 @@ int mtstates_state_call(lua_State* L, bool isTimed, int arg,
         if (L != s->L2) {
             lua_settop(s->L2, l2start);
         }
-        if (!isSelfCall) {
-            async_mutex_lock(&s->stateMutex);
-            s->isBusy = false;
-            if (atomic_get(&s->owned) == 0 && s->L2) {
-                lua_close(s->L2);
-                s->L2 = NULL;
-            }
-            async_mutex_notify(&s->stateMutex);
-            async_mutex_unlock(&s->stateMutex);
+        if (iter && iter->ref != LUA_NOREF) {
+            /* iterator was not created */
+            luaL_unref(s->L2, LUA_REGISTRYINDEX, iter->ref);
+        }
+        if (!isSelfCall && !(iter && iter->isHeld && rc == LUA_OK)) {
+            finishCall(s);
         }
         
         /* ------------------------------------------------------------------- */
@@ -1132,68 +2561,18 @@ int mtstates_state_call(lua_State* L, bool isTimed, int arg,
     else {
         /* ------------------------------------------------------------------- */
 
-        int notifier_rc = 0;
-        int nargs = w ? w->nargs : 0;
-        
-        if (lua_checkstack(s->L2, nargs + 10))
-        {
-            MtState_call3a_UserData ud3a;
-            ud3a.w = w;
-            ud3a.callbackRef = s->callbackref;
-            ud3a.carrayCapi = s->carrayCapi;
-            
-            int l2start = lua_gettop(s->L2);
-            int lua_rc = lua_cpcall(s->L2, MtState_call3a, &ud3a);
-            
-            s->carrayCapi = ud3a.carrayCapi;
-            
-            if (lua_rc != LUA_OK) {
-                if (notify_eh) {
-                    size_t       msglen = 0;
-                    const char*  msg    = lua_tolstring(s->L2, -1, &msglen);
-                    notify_eh(notify_ehdata, msg, msglen);
-                }
-                notifier_rc = 990;
-            }
-            lua_settop(s->L2, l2start);
-        } else {
-            notifier_rc = 999;
-        }
+        int notifier_rc = invokeWriter(s, (callbackRef != LUA_NOREF) ? callbackRef : s->callbackref, 
+                                       w, results, notify_eh, notify_ehdata);
+
         if (!isSelfCall) {
-            async_mutex_lock(&s->stateMutex);
-            s->isBusy = false;
-            if (atomic_get(&s->owned) == 0 && s->L2) {
-                lua_close(s->L2);
-                s->L2 = NULL;
-            }
-            async_mutex_notify(&s->stateMutex);
-            async_mutex_unlock(&s->stateMutex);
+            finishCall(s);
         }
-
         return notifier_rc;
 
         /* ------------------------------------------------------------------- */
     }
 }
 
-static int MtState_callCall3(lua_State* L2)
-{
-    CallStateVars* this = (CallStateVars*)lua_touserdata(L2, 1);
-    MtState*   s  = this->state;
-
-    lua_pushcfunction(L2, errormsghandler1); // may raise error in Lua 5.1
-    lua_pushcfunction(L2, MtState_call4);
-    lua_pushlightuserdata(L2, this);
- 
-    int rc = lua_pcall(L2, 1, 0, -3);
-
-    if (rc != LUA_OK) {
-        setErrorMsg(&this->errorMsg, L2);
-        return lua_error(L2);
-    }
-    return 0;
-}
-    
 static int MtState_call3(lua_State* L)
 {
     CallStateVars* this = (CallStateVars*)lua_touserdata(L, 1);
@@ -1202,11 +2581,24 @@ static int MtState_call3(lua_State* L)
     lua_State* L2 = s->L2;
 
     if (L2 != L) {
-        int rc = lua_cpcall(L2, MtState_callCall3, this);
+        if (!lua_checkstack(L2, LUA_MINSTACK)) {
+            return mtstates_ERROR_OUT_OF_MEMORY(L);
+        }
+        /* cached functions: pushing does not raise errors */
+        lua_rawgeti(L2, LUA_REGISTRYINDEX, s->errorhandlerref);  /* -> errorHandler */
+        lua_rawgeti(L2, LUA_REGISTRYINDEX, s->call4ref);         /* -> errorHandler, call4 */
+        lua_pushlightuserdata(L2, this);                         /* -> errorHandler, call4, this */
+        
+        int rc = lua_pcall(L2, 1, 0, -3);
 
         ErrorMsg* errorMsg = &this->errorMsg;
 
         if (rc != LUA_OK) {
+            this->isMemoryError = (rc == LUA_ERRMEM);
+            if (!this->isLError || !errorMsg->msg) {
+                /* keep message without stack trace from MtState_call4 */
+                setErrorMsg(errorMsg, L2);
+            }
             if (errorMsg->msg) {
                 lua_pushstring(L, errorMsg->msg); 
             }
@@ -1221,6 +2613,10 @@ static int MtState_call3(lua_State* L)
             if (this->isLError) {
                 freeErrorMsg(errorMsg);
                 return lua_error(L);
+            } else if (this->isMemoryError) {
+                const char* stateString = mtstates_state_tostring(L, s); /* -> errorString, stateString */
+                freeErrorMsg(errorMsg);
+                return mtstates_ERROR_OUT_OF_MEMORY_state(L, stateString, lua_tostring(L, -2));
             } else {
                 const char* stateString = mtstates_state_tostring(L, s); /* -> errorString, stateString */
                 freeErrorMsg(errorMsg);
@@ -1228,10 +2624,17 @@ static int MtState_call3(lua_State* L)
             }
         } else {
             freeErrorMsg(errorMsg);
+            if (this->iter) {
+                /* iterator takes over the generator and the acquired state */
+                this->nrslts = mtstates_iterator_push(L, s, this->iter);
+            }
             return this->nrslts;
         }
     } else {
         MtState_call4(L2);
+        if (this->iter) {
+            this->nrslts = mtstates_iterator_push(L, s, this->iter);
+        }
         return this->nrslts;
     }
 }
@@ -1241,83 +2644,243 @@ static int MtState_call3a(lua_State* L2)
     MtState_call3a_UserData* ud3a = (MtState_call3a_UserData*)lua_touserdata(L2, 1);
     receiver_writer* w = ud3a->w;
 
-    int nargs = w ? w->nargs : 0;
+    lua_rawgeti(L2, LUA_REGISTRYINDEX, ud3a->callbackRef);   /* -> callback */
+    int func = lua_gettop(L2);
+
+    if (w) {
+        mtstates_writer_push_values(L2, w, &ud3a->carrayCapi, ud3a->bytesMode);
+    }
+    /* byte runs may be pushed as one value, i.e. less than w->nargs */
+    int nargs = lua_gettop(L2) - func;
+    lua_call(L2, nargs, ud3a->results ? LUA_MULTRET : 0);
+
+    if (ud3a->results) {
+        int firstrslt = func;
+        int lastrslt  = lua_gettop(L2);
+        int i;
+        luaL_checkstack(L2, LUA_MINSTACK, NULL);
+        for (i = firstrslt; i <= lastrslt; ++i) {
+            int rc = mtstates_writer_add_value(L2, i, ud3a->results);
+            if (rc > 0) {
+                lua_pushfstring(L2, "state callback function returned bad parameter #%d: %s", i - firstrslt + 1, lua_tostring(L2, -1));
+                lua_error(L2);
+            } else if (rc < 0) {
+                lua_pushliteral(L2, "not enough memory");
+                lua_error(L2);
+            }
+        }
+    }
+    return 0;
+}
+
+/* 
+ * Invokes the state callback function for every argument tuple of the list at
+ * firstArg in L, the state is acquired only once for all invocations. 
+ * L and L2 may be the same lua state for self calls.
+ */
+static int MtState_callBatch4(lua_State* L2, CallStateVars* this)
+{
+    MtState*   s     = this->state;
+    lua_State* L     = this->L;
+    int        list  = this->firstArg;
+    int        nrslt = this->batchResults;
     
-    lua_pushcfunction(L2, errormsghandler1);                 /* -> errorHandler */
-    int errh = lua_gettop(L2);
+    lua_Integer n = lua_rawlen(L, list);
+    
+    luaL_checkstack(L, LUA_MINSTACK, NULL);
+    if (nrslt < 0) {
+        lua_createtable(L, (n < INT_MAX) ? (int)n : 0, 0);     /* -> rslts */
+    } else {
+        lua_Integer c = n * nrslt;
+        lua_createtable(L, (nrslt == 0 || c / nrslt != n || c >= INT_MAX) ? 0 : (int)c, 1);
+    }
+    int rslts    = lua_gettop(L);
+    int nextRslt = 1;
+    
+    lua_rawgeti(L2, LUA_REGISTRYINDEX, s->callbackref);      /* -> callback */
+    int callback = lua_gettop(L2);
+    
+    lua_Integer i;
+    for (i = 1; i <= n; ++i) {
+        lua_rawgeti(L, list, i);                             /* -> tuple */
+        int tuple = lua_gettop(L);
+        if (!lua_istable(L, tuple)) {
+            lua_pushfstring(L2, "table expected at index %d", (int)i);
+            this->errorArg = list;
+            this->isLError = true;
+            setErrorMsg(&this->errorMsg, L2);
+            return lua_error(L2);
+        }
+        /* raw access: errors in L must not be raised within the pcall of L2 */
+        lua_pushliteral(L, "n");
+        lua_rawget(L, tuple);
+        lua_Integer count;
+        if (lua_isinteger(L, -1)) {
+            count = lua_tointeger(L, -1);
+        } else {
+            count = (lua_Integer)lua_rawlen(L, tuple);
+        }
+        lua_pop(L, 1);
+        if (count < 0 || count > INT_MAX - LUA_MINSTACK) {
+            lua_pushfstring(L2, "invalid field 'n' at index %d", (int)i);
+            this->errorArg = list;
+            this->isLError = true;
+            setErrorMsg(&this->errorMsg, L2);
+            return lua_error(L2);
+        }
+        int nargs = (int)count;
+        if (!lua_checkstack(L, nargs + LUA_MINSTACK)) {
+            this->isLError = true;
+            return mtstates_ERROR_OUT_OF_MEMORY(L2);
+        }
+        int j;
+        for (j = 1; j <= nargs; ++j) {
+            lua_rawgeti(L, tuple, j);                        /* -> tuple, args */
+        }
+        int base = lua_gettop(L2);
+        lua_pushvalue(L2, callback);
+        int rc = pushArgs(L2, L, tuple + 1, tuple + nargs, &this->carrayCapi);
+        if (rc != 0) {
+            if (rc > 0) {
+                lua_pushfstring(L2, "bad parameter #%d at index %d: %s", rc - tuple, (int)i, 
+                                                                          lua_tostring(L2, -1));
+                this->errorArg = list;
+                this->isLError = true;
+                setErrorMsg(&this->errorMsg, L2);
+                return lua_error(L2);
+            } else {
+                this->isLError = true;
+                return mtstates_ERROR_OUT_OF_MEMORY(L2);
+            }
+        }
+        lua_call(L2, nargs, (nrslt < 0) ? LUA_MULTRET : nrslt);
+        int nr = lua_gettop(L2) - base;
+        
+        if (!lua_checkstack(L, LUA_MINSTACK)) {
+            this->isLError = true;
+            return mtstates_ERROR_OUT_OF_MEMORY(L2);
+        }
+        int dest = rslts;
+        if (nrslt < 0) {
+            lua_createtable(L, nr, 1);                       /* -> tuple, args, rslt */
+            dest     = lua_gettop(L);
+            nextRslt = 1;
+        }
+        int k;
+        for (k = 1; k <= nr; ++k) {
+            rc = pushArg(L, L2, base + k, &this->carrayCapi);
+            if (rc != 0) {
+                lua_pushfstring(L2, "state callback function returned bad parameter #%d: %s", k, lua_tostring(L, -1));
+                mtstates_push_ERROR_STATE_RESULT(L2, NULL, lua_tostring(L2, -1));
+                this->isLError = true;
+                setErrorMsg(&this->errorMsg, L2);
+                return lua_error(L2);
+            }
+            lua_rawseti(L, dest, nextRslt++);
+        }
+        if (nrslt < 0) {
+            lua_pushinteger(L, nr);
+            lua_setfield(L, dest, "n");
+            lua_rawseti(L, rslts, i);                        /* -> tuple, args */
+        }
+        lua_settop(L2, base);
+        lua_settop(L, tuple - 1);
+    }
+    if (nrslt >= 0) {
+        lua_pushinteger(L, nextRslt - 1);
+        lua_setfield(L, rslts, "n");
+    }
+    lua_settop(L2, callback - 1);
+    this->nrslts = 1;
+    return 0;
+}
+
+/*
+ * Pushes the function for state:exec(). The function is compiled only once
+ * per state: the cache table maps the hash of the source code or binary 
+ * chunk to the pair {key, function}.
+ */
+static void pushExecFunction(lua_State* L2, CallStateVars* this)
+{
+    MtState*         s    = this->state;
+    const ExecChunk* exec = this->exec;
+    lua_Integer      h    = (lua_Integer)exec->hash;
     
-    lua_rawgeti(L2, LUA_REGISTRYINDEX, ud3a->callbackRef);   /* -> errorHandler, callback */
+    if (s->execcacheref == LUA_NOREF || s->execCacheCount >= EXEC_CACHE_LIMIT) {
+        int ref = s->execcacheref;
+        s->execcacheref   = LUA_NOREF;
+        s->execCacheCount = 0;
+        luaL_unref(L2, LUA_REGISTRYINDEX, ref);
+        lua_newtable(L2);
+        s->execcacheref = luaL_ref(L2, LUA_REGISTRYINDEX);
+    }
+    lua_rawgeti(L2, LUA_REGISTRYINDEX, s->execcacheref);    /* -> cache */
+    lua_rawgeti(L2, -1, h);                                 /* -> cache, entry */
+    if (lua_istable(L2, -1)) {
+        size_t      len;
+        lua_rawgeti(L2, -1, 1);                             /* -> cache, entry, key */
+        const char* key = lua_tolstring(L2, -1, &len);
+        if (key && len == exec->keyLength && memcmp(key, exec->key, len) == 0) {
+            lua_rawgeti(L2, -2, 2);                         /* -> cache, entry, key, func */
+            lua_replace(L2, -4);                            /* -> func, entry, key */
+            lua_pop(L2, 2);                                 /* -> func */
+            return;
+        }
+        lua_pop(L2, 1);                                     /* -> cache, entry */
+    }
+    lua_pop(L2, 1);                                         /* -> cache */
 
-    if (nargs > 0) {
-        const char* from = w->mem.bufferStart;
-        const char* end  = from + w->mem.bufferLength;
-        while (from < end) {
-            char type = *from++;
-            switch (type) {
-                case BUFFER_BOOLEAN: {
-                    lua_pushboolean(L2, *from++);
-                    break;
-                }
-                case BUFFER_BYTE: {
-                    char byte = *from++;
-                    lua_Integer value = ((lua_Integer)byte) & 0xff;
-                    lua_pushinteger(L2, value);
-                    break;
-                }
-                case BUFFER_INTEGER: {
-                    lua_Integer value;
-                    memcpy(&value, from, sizeof(lua_Integer));
-                    from += sizeof(lua_Integer);
-                    lua_pushinteger(L2, value);
-                    break;
-                }
-                case BUFFER_NUMBER: {
-                    lua_Number value;
-                    memcpy(&value, from, sizeof(lua_Number));
-                    from += sizeof(lua_Number);
-                    lua_pushnumber(L2, value);
-                    break;
-                }
-                case BUFFER_SMALLSTRING: {
-                    size_t len = ((size_t)(*from++)) & 0xff;
-                    lua_pushlstring(L2, from, len);
-                    from += len;
-                    break;
-                }
-                case BUFFER_STRING: {
-                    size_t len;
-                    memcpy(&len, from, sizeof(size_t));
-                    from += sizeof(size_t);
-                    lua_pushlstring(L2, from, len);
-                    from += len;
-                    break;
-                }
-                case BUFFER_CARRAY: {
-                    if (!ud3a->carrayCapi) {
-                        ud3a->carrayCapi = carray_require_capi(L2);
-                    }
-                    carray_type   type        = (unsigned char) (*from++);
-                    unsigned char elementSize = (unsigned char) (*from++);
-                    size_t        elementCount;
-                    memcpy(&elementCount, from, sizeof(size_t));
-                    from += sizeof(size_t);
-                    void* data;
-                    if (!ud3a->carrayCapi->newCarray(L2, type, CARRAY_DEFAULT, elementCount, &data)) {
-                        luaL_error(L2, "internal error creating carray for type %d", type);
-                    }
-                    size_t len = elementSize * elementCount;
-                    memcpy(data, from, len);
-                    from += len;
-                    break;
-                }
+    int rc = luaL_loadbuffer(L2, exec->key, exec->keyLength, exec->key);
+    if (rc != LUA_OK) {
+        this->errorArg = this->firstArg - 1;
+        this->isLError = true;
+        setErrorMsg(&this->errorMsg, L2);
+        lua_error(L2); /* error has bee pushed by loadbuffer */
+    }                                                       /* -> cache, func */
+    lua_createtable(L2, 2, 0);                              /* -> cache, func, entry */
+    lua_pushlstring(L2, exec->key, exec->keyLength);        /* -> cache, func, entry, key */
+    lua_rawseti(L2, -2, 1);                                 /* -> cache, func, entry */
+    lua_pushvalue(L2, -2);                                  /* -> cache, func, entry, func */
+    lua_rawseti(L2, -2, 2);                                 /* -> cache, func, entry */
+    lua_rawseti(L2, -3, h);                                 /* -> cache, func */
+    lua_remove(L2, -2);                                     /* -> func */
+    s->execCacheCount += 1;
+}
+
+/*
+ * Keeps the first result of the state callback at index func as generator
+ * for state:iter(), a coroutine is wrapped into a generator function.
+ */
+static void keepGenerator(lua_State* L2, CallStateVars* this, int func)
+{
+    int rtype = lua_type(L2, func);
+    if (rtype == LUA_TTHREAD) {
+        lua_pushlightuserdata(L2, (void*)&coroutine_generator_key);      /* -> key */
+        if (lua_rawget(L2, LUA_REGISTRYINDEX) != LUA_TFUNCTION) {        /* -> wrapper */
+            lua_pop(L2, 1);                                              /* -> */
+            if (luaL_loadbuffer(L2, COROUTINE_GENERATOR, strlen(COROUTINE_GENERATOR), 
+                                "=mtstates.iter") != LUA_OK) {
+                lua_error(L2);
             }
+            lua_pushlightuserdata(L2, (void*)&coroutine_generator_key);  /* -> wrapper, key */
+            lua_pushvalue(L2, -2);                                       /* -> wrapper, key, wrapper */
+            lua_rawset(L2, LUA_REGISTRYINDEX);                           /* -> wrapper */
         }
+        lua_pushvalue(L2, func);                                         /* -> wrapper, co */
+        lua_call(L2, 1, 1);                                              /* -> generator */
+        lua_replace(L2, func);
     }
-    int lua_rc = lua_pcall(L2, nargs, 0, errh);
-    if (lua_rc != LUA_OK) {
+    else if (rtype != LUA_TFUNCTION) {
+        const char* t = (rtype == LUA_TNONE) ? "nothing" : lua_typename(L2, rtype);
+        lua_pushfstring(L2, "state callback function returned %s but a function or a coroutine is required for iteration", t);
+        mtstates_push_ERROR_STATE_RESULT(L2, NULL, lua_tostring(L2, -1));
+        this->isLError = true;
+        setErrorMsg(&this->errorMsg, L2);
         lua_error(L2);
     }
-    return 0;
+    lua_settop(L2, func);
+    this->iter->ref = luaL_ref(L2, LUA_REGISTRYINDEX);
+    this->nrslts   = 0;
 }
 
 static int MtState_call4(lua_State* L2)
@@ -1327,7 +2890,15 @@ static int MtState_call4(lua_State* L2)
     MtState*   s = this->state;
     lua_State* L = this->L;
 
-    lua_rawgeti(L2, LUA_REGISTRYINDEX, s->callbackref);
+    if (this->isBatch) {
+        return MtState_callBatch4(L2, this);
+    }
+    if (this->exec) {
+        pushExecFunction(L2, this);
+    } else {
+        lua_rawgeti(L2, LUA_REGISTRYINDEX, (this->callbackRef != LUA_NOREF) ? this->callbackRef 
+                                                                           : s->callbackref);
+    }
     int func = lua_gettop(L2);
     int rc = pushArgs(L2, L, this->firstArg, this->lastArg, &this->carrayCapi);
     if (rc != 0) {
@@ -1344,6 +2915,10 @@ static int MtState_call4(lua_State* L2)
     int nargs = this->lastArg - this->firstArg + 1;
     lua_call(L2, nargs, LUA_MULTRET);
     luaL_checkstack(L2, LUA_MINSTACK, NULL);
+    if (this->iter) {
+        keepGenerator(L2, this, func);
+        return 0;
+    }
     int firstrslt = func;
     int lastrslt  = lua_gettop(L2);
     int nrslts = lastrslt - firstrslt + 1;
@@ -1357,6 +2932,7 @@ static int MtState_call4(lua_State* L2)
             lua_pushfstring(L2, "state callback function returned bad parameter #%d: %s", rc - firstrslt + 1, lua_tostring(L, -1));
             mtstates_push_ERROR_STATE_RESULT(L2, NULL, lua_tostring(L2, -1));
             this->isLError = true;
+            setErrorMsg(&this->errorMsg, L2);
             return lua_error(L2);
         } else {
             this->isLError = true;
@@ -1399,6 +2975,142 @@ static int MtState_name(lua_State* L)
     }
 }
 
+static int MtState_memory(lua_State* L)
+{
+    int arg = 1;
+    StateUserData* udata = luaL_checkudata(L, arg++, MTSTATES_STATE_CLASS_NAME);
+    MtState*       s     = udata->state;
+    
+    if (!s->allocator.isActive) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "unsupported");
+        return 2;
+    }
+    size_t current, peak;
+    async_mutex_lock(&s->stateMutex);
+    if (s->isBusy && s->calledByThread != async_current_threadid()) {
+        /* the allocator counters are modified by the thread running the state */
+        current = s->memoryCurrent;
+        peak    = s->memoryPeak;
+    } else {
+        current = s->allocator.current;
+        peak    = s->allocator.peak;
+    }
+    async_mutex_unlock(&s->stateMutex);
+    
+    lua_pushinteger(L, (lua_Integer)current);
+    lua_pushinteger(L, (lua_Integer)peak);
+    if (s->allocator.limit > 0) {
+        lua_pushinteger(L, (lua_Integer)s->allocator.limit);
+        return 3;
+    } else {
+        return 2;
+    }
+}
+
+static int MtState_post(lua_State* L)
+{
+    int arg = 1;
+    StateUserData* udata = luaL_checkudata(L, arg++, MTSTATES_STATE_CLASS_NAME);
+    return mtstates_mailbox_post(L, udata->state, arg, lua_gettop(L));
+}
+
+static int MtState_acall(lua_State* L)
+{
+    int arg = 1;
+    StateUserData* udata = luaL_checkudata(L, arg++, MTSTATES_STATE_CLASS_NAME);
+    return mtstates_mailbox_acall(L, udata->state, arg, lua_gettop(L));
+}
+
+#if LUA_VERSION_NUM >= 502
+
+static bool isYieldable(lua_State* L)
+{
+#if LUA_VERSION_NUM == 502
+    /* not yieldable from main thread, yielding across a C-call boundary raises an error */
+    bool isMain = lua_pushthread(L);
+    lua_pop(L, 1);
+    return !isMain;
+#else
+    return lua_isyieldable(L);
+#endif
+}
+
+/* continuation of state:ycall(), ctx is the stack index of the future */
+LUA_KFUNCTION(MtState_ycallK)
+{
+    (void)status;  /* unused arg. */
+    int       future = (int)ctx;
+    MtFuture* f      = mtstates_future_check(L, future);
+
+    lua_settop(L, future);                                /* -> future */
+    if (!mtstates_future_ready(f)) {
+        /* resumed before the call was completed */
+        lua_pushvalue(L, future);                         /* -> future, future */
+        return lua_yieldk(L, 1, ctx, MtState_ycallK);
+    }
+    return mtstates_future_push_results(L, f);
+}
+
+#endif
+
+/*
+ * Invokes the state callback. If the state is busy and the caller is running 
+ * in a coroutine, the call is given to the state's mailbox and the coroutine
+ * yields the future for the results. The results are returned when the 
+ * coroutine is resumed after the future is ready.
+ */
+static int MtState_ycall(lua_State* L)
+{
+    int arg = 1;
+    StateUserData* udata = luaL_checkudata(L, arg++, MTSTATES_STATE_CLASS_NAME);
+    MtState*       s     = udata->state;
+
+#if LUA_VERSION_NUM >= 502
+    if (isYieldable(L)) {
+        int lastArg = lua_gettop(L);
+        int rc      = callState(L, false, false, true, false, arg, s, LUA_NOREF, NULL, NULL, NULL, NULL, NULL, NULL);
+        if (rc >= 0) {
+            return rc;
+        }
+        mtstates_mailbox_acall(L, s, arg, lastArg);       /* -> stateString, future */
+        int future = lua_gettop(L);
+        lua_pushvalue(L, future);                         /* -> stateString, future, future */
+        return lua_yieldk(L, 1, future, MtState_ycallK);
+    }
+#endif
+    return mtstates_state_call(L, false, arg, s, NULL, NULL, NULL, NULL);
+}
+
+static int MtState_iter(lua_State* L)
+{
+    return MtState_iter2(L, false);
+}
+
+static int MtState_riter(lua_State* L)
+{
+    return MtState_iter2(L, true);
+}
+
+static int MtState_flush(lua_State* L)
+{
+    int arg = 1;
+    StateUserData* udata = luaL_checkudata(L, arg++, MTSTATES_STATE_CLASS_NAME);
+    return mtstates_mailbox_flush(L, udata->state, arg);
+}
+
+static int MtState_waiting(lua_State* L)
+{
+    int arg = 1;
+    StateUserData* udata = luaL_checkudata(L, arg++, MTSTATES_STATE_CLASS_NAME);
+    MtState*       s     = udata->state;
+    async_mutex_lock(&s->stateMutex);
+    int waitingCount = s->waitingCount;
+    async_mutex_unlock(&s->stateMutex);
+    lua_pushinteger(L, waitingCount);
+    return 1;
+}
+
 static int MtState_isOwner(lua_State* L)
 {
     int arg = 1;
@@ -1425,9 +3137,21 @@ static const luaL_Reg StateMethods[] =
     { "name",       MtState_name       },
     { "call",       MtState_call       },
     { "tcall",      MtState_tcall      },
+    { "dcall",      MtState_dcall      },
+    { "ycall",      MtState_ycall      },
+    { "method",     MtState_method     },
+    { "exec",       MtState_exec       },
+    { "callbatch",  MtState_callBatch  },
+    { "iter",       MtState_iter       },
+    { "riter",      MtState_riter      },
+    { "post",       MtState_post       },
+    { "acall",      MtState_acall      },
+    { "flush",      MtState_flush      },
     { "interrupt",  MtState_interrupt  },
     { "close",      MtState_close      },
     { "isowner",    MtState_isOwner    },
+    { "memory",     MtState_memory     },
+    { "waiting",    MtState_waiting    },
     { NULL,         NULL } /* sentinel */
 };
 
@@ -1465,6 +3189,8 @@ static void setupStateMeta(lua_State* L)
 
 int mtstates_state_init_module(lua_State* L, int module)
 {
+    processor_count = async_processor_count();
+
     if (luaL_newmetatable(L, MTSTATES_STATE_CLASS_NAME)) {
         setupStateMeta(L);
     }
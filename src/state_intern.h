@@ -1,8 +1,28 @@
 #ifndef MTSTATES_STATE_INTERN
 #define MTSTATES_STATE_INTERN
 
+#include "allocator.h"
+#include "mailbox.h"
+
 typedef struct receiver_writer receiver_writer;
 typedef struct carray_capi     carray_capi;
+typedef struct SetupChunk      SetupChunk;
+typedef struct StateWaiter     StateWaiter;
+typedef struct InboxMessage    InboxMessage;
+typedef struct PendingUnref    PendingUnref;
+
+/* values of MtState.busyFlag */
+#define MTSTATES_STATE_FREE     0
+#define MTSTATES_STATE_RESERVED 1 /* selected by a pool call that is going to acquire the state */
+#define MTSTATES_STATE_BUSY     2 /* isBusy */
+
+/* function of the methods table returned by the setup function */
+typedef struct MethodEntry {
+    struct MethodEntry* nextMethod;
+    int                 ref;         /* registry reference in L2 */
+    size_t              nameLength;
+    char                name[1];
+} MethodEntry;
 
 typedef struct MtState {
     lua_Integer        id;
@@ -14,19 +34,59 @@ typedef struct MtState {
     size_t             stateNameLength;
     Mutex              stateMutex;
     lua_State*         L2;
+    StateAllocator     allocator;
+    size_t             memoryCurrent; /* allocator counters as of the last release */
+    size_t             memoryPeak;    /* for state:memory() while the state is busy */
+    Mailbox            mailbox;
     int                callbackref;
+    int                methodsref;       /* LUA_NOREF if setup function returned a function */
+    MethodEntry*       firstMethod;      /* resolved methods, protected by stateMutex */
+    int                errorhandlerref;  /* cached in L2 to avoid allocations per call */
+    int                call4ref;
+    int                call3aref;
+    int                execcacheref;     /* functions compiled by state:exec() */
+    int                execCacheCount;
     const carray_capi* carrayCapi;
 
     bool               isBusy;
+    AtomicCounter      busyFlag; /* mirrors isBusy for polling without stateMutex, see above */
     ThreadId           calledByThread;
     
+    bool               fair;         /* waiting callers are served in FIFO order */
+    int                waitingCount; /* number of callers waiting for the busy state */
+    StateWaiter*       firstWaiter;  /* queue of waiters in fair mode */
+    StateWaiter*       lastWaiter;
+    
+    bool               spin;           /* waiting callers spin briefly before parking */
+    lua_Integer        callCounter;    /* for sampling the duration of calls */
+    lua_Number         busySince;      /* start of the current call if sampled, else 0 */
+    lua_Number         avgBusySeconds; /* learned average duration of calls */
+    
+    size_t             inboxLimit;  /* max. bytes of queued receiver messages, 0 disables inbox */
+    size_t             inboxBytes;
+    InboxMessage*      firstInbox;  /* receiver messages queued while the state was busy */
+    InboxMessage*      lastInbox;
+    
+    bool               coalesce;      /* notifications are merged while the state is busy */
+    AtomicCounter      notifyPending; /* callback must be invoked before releasing the state */
+    
+    MtBytesMode        bytesMode;     /* delivery of byte runs from the Receiver C API */
+    
+    const void*        holder;      /* iterator that keeps the state acquired */
+    PendingUnref*      firstUnref;  /* generators of iterators collected while the state was busy */
+    
     struct MtState**   prevStatePtr;
     struct MtState*    nextState;
     
+    size_t             nameHash;
+    struct MtState**   prevNamedPtr;
+    struct MtState*    nextNamed;
+    
+    struct MtState*    nextRetired;
+    
 } MtState;
 
 typedef struct {
-    int      count;
     MtState* firstState;
 } StateBucket;
 
@@ -53,8 +113,11 @@ typedef struct
     const carray_capi* carrayCapi;
 
     int         stateFunction;
+    const char* stateSource;
+    size_t      stateSourceLength;
     const char* stateCode;
     size_t      stateCodeLength;
+    SetupChunk* stateChunk;
     MemBuffer   tmp;
     
     int firstArg;
@@ -63,9 +126,17 @@ typedef struct
     MtState* state;
 
     bool openlibs;
+    size_t memoryLimit;
+    bool useSlabs;
+    bool fair;
+    bool spin;
+    size_t inboxLimit;
+    bool coalesce;
+    MtBytesMode bytesMode;
     lua_State* L2;
     
     bool isLError;
+    bool isMemoryError;
     int  errorArg;
     
     ErrorMsg errorMsg;
@@ -74,19 +145,40 @@ typedef struct
 
 } NewStateVars;
 
+typedef struct
+{
+    const char* key;        /* source code or binary chunk */
+    size_t      keyLength;
+    size_t      hash;
+    bool        isSource;
+} ExecChunk;
+
+typedef struct IterStart
+{
+    bool release;   /* state is released between iteration steps */
+    bool isHeld;    /* state stays acquired for the iterator */
+    int  ref;       /* registry reference of the generator in the state */
+} IterStart;
+
 typedef struct
 {
     lua_State* L;
     
     bool isTimed;
+    bool isBatch;
+    int  batchResults;  /* -1: all results of each invocation packed into a table */
     
     MtState* state;
+    int      callbackRef;
+    const ExecChunk* exec;  /* not NULL for state:exec() */
+    IterStart* iter;        /* not NULL for state:iter() */
     const carray_capi* carrayCapi;
     
     int firstArg;
     int lastArg;
 
     bool isLError;
+    bool isMemoryError;
     int  errorArg;
 
     ErrorMsg errorMsg;
@@ -103,10 +195,63 @@ typedef struct StateUserData {
 
 void mtstates_state_free(MtState* state);
 
+void mtstates_state_disown(MtState* state);
+
+int mtstates_state_newstate(lua_State* L);
+
+void mtstates_state_push_reference(lua_State* L, MtState* state);
+
+const char* mtstates_state_tostring(lua_State* L, MtState* state);
+
 typedef void (*mtstates_capi_error_handler)(void* ehdata, const char* msg, size_t msglen);
 
 int mtstates_state_call(lua_State* L, bool isTimed, int arg, 
-                        MtState* s, receiver_writer* writer,
+                        MtState* s, receiver_writer* writer, receiver_writer* results,
                         mtstates_capi_error_handler eh, void* ehdata);
 
+/**
+ * Invokes the state with the writer's content or queues the content in the 
+ * state's inbox if the state is busy. Returns the codes of the receiver C API 
+ * function msgToReceiver().
+ */
+int mtstates_state_receive(MtState* s, receiver_writer* writer, bool clear, bool nonblock,
+                           mtstates_capi_error_handler eh, void* ehdata);
+
+/**
+ * Invokes the function of the methods table with the given registry reference.
+ */
+int mtstates_state_call_method(lua_State* L, bool isTimed, int arg, MtState* s, int ref);
+
+/**
+ * Marks the state that is kept acquired for an iterator as held by the
+ * given iterator.
+ */
+void mtstates_state_hold(MtState* s, const void* holder);
+
+/**
+ * Makes the current thread the caller of the state if the state is held
+ * by the given iterator, i.e. a held iterator can be advanced from another 
+ * thread than the thread that created the iterator.
+ */
+void mtstates_state_takeover(MtState* s, const void* holder);
+
+/**
+ * Releases the state that was kept acquired for an iterator.
+ */
+void mtstates_state_unhold(MtState* s);
+
+/**
+ * Releases the registry reference in the state. isHeld: the state is
+ * acquired by the iterator. Does not block: if the state is busy in another
+ * thread the reference is released by that thread before the state is
+ * released.
+ */
+void mtstates_state_unref(MtState* s, int ref, bool isHeld);
+
+/**
+ * Invokes the state callback without arguments. Returns the codes of the
+ * notify C API function notify().
+ */
+int mtstates_state_notify(MtState* s, mtstates_capi_error_handler eh, void* ehdata);
+
 #endif /* MTSTATES_STATE_INTERN */
@@ -1,3 +1,13 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE /* for dladdr */
+#endif
+
+#include "async_defines.h"
+
+#if !defined(MTSTATES_ASYNC_USE_WIN32)
+    #include <dlfcn.h> /* before util.h, which hides all following declarations */
+#endif
+
 #include "util.h"
 
 lua_Number mtstates_current_time_seconds()
@@ -15,6 +25,43 @@ lua_Number mtstates_current_time_seconds()
     return rslt;
 }
 
+lua_Number mtstates_monotonic_time_seconds()
+{
+#if defined(MTSTATES_ASYNC_USE_WIN32)
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return ((lua_Number)counter.QuadPart) / ((lua_Number)frequency.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return ((lua_Number)t.tv_sec) + ((lua_Number)t.tv_nsec) * 0.000000001;
+#else
+    return mtstates_current_time_seconds();
+#endif
+}
+
+
+void mtstates_util_pin_module()
+{
+    static AtomicCounter pinned = 0;
+    if (atomic_set_if_equal(&pinned, 0, 1)) {
+#if defined(MTSTATES_ASYNC_USE_WIN32)
+        HMODULE module;
+        GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+                           (LPCSTR)&mtstates_util_pin_module, &module);
+#else
+        Dl_info info;
+        if (dladdr((void*)&mtstates_util_pin_module, &info) && info.dli_fname) {
+            dlopen(info.dli_fname, RTLD_NOW | RTLD_NODELETE); /* never closed */
+        }
+#endif
+    }
+}
+
 
 bool mtstates_membuf_init(MemBuffer* b, size_t initialCapacity, lua_Number growFactor)
 {
@@ -17,6 +17,7 @@
     #include <sys/timeb.h>
 #else
     #include <sys/time.h>
+    #include <time.h>
 #endif
 
 #include <lua.h>
@@ -66,6 +67,16 @@
 
 lua_Number mtstates_current_time_seconds();
 
+/* seconds from an unspecified starting point, not affected by system time changes */
+lua_Number mtstates_monotonic_time_seconds();
+
+/*
+ * Keeps the module loaded until the process ends. Must be called before
+ * detached threads are started that may outlive all lua states using
+ * this module.
+ */
+void mtstates_util_pin_module();
+
 typedef struct MemBuffer {
     lua_Number         growFactor;
     char*              bufferData;
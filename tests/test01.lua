@@ -105,7 +105,7 @@ do
     print(s1, s1:id())
     print(s2, s2:id())
     
-    local _, err = pcall(function() s2:call("fooarg", 2, {}) end)
+    local _, err = pcall(function() s2:call("fooarg", 2, print) end)
     print("-------------------------------------")
     PRINT("-- Expected error:")
     print(err)
@@ -279,7 +279,7 @@ do
     local function testcase()
         local _, err = pcall(function()
             mts.newstate(function()
-                return function() end, "", {}
+                return function() end, "", function() end
             end)
         end)
         print("-------------------------------------")
@@ -336,7 +336,7 @@ do
     local s, a, b = mts.newstate(function()
         local mts = require"mtstates"
         local s = mts.newstate(function() return (function() end) end)
-        return function() return s:id(), s; end, "a", "b"
+        return function() return s:id(), function() end; end, "a", "b"
     end)
     assert(a == "a" and b == "b")
     local _, err = pcall(function()
@@ -564,4 +564,54 @@ do
     assert(s3:call() == 6)
 end
 PRINT("==================================================================================")
+do
+    local hits0, miss0 = mtstates.setupcache()
+    local code = "local a = ... return function(b) return a + b end"
+    assert(mtstates.newstate(true, code, 1):call(2) == 3)
+    local hits1, miss1, count1 = mtstates.setupcache()
+    assert(hits1 == hits0 and miss1 == miss0 + 1)
+    assert(mtstates.newstate(true, code, 10):call(2) == 12)
+    local hits2, miss2 = mtstates.setupcache()
+    assert(hits2 == hits1 + 1 and miss2 == miss1)
+
+    local function setup(a) return function(b) return a * b end end
+    assert(mtstates.newstate(setup, 2):call(3) == 6)
+    local hits3, miss3 = mtstates.setupcache()
+    assert(miss3 == miss2 + 1)
+    for i = 1, 3 do
+        assert(mtstates.newstate(setup, i):call(3) == 3 * i)
+    end
+    local hits4, miss4 = mtstates.setupcache()
+    assert(hits4 == hits3 + 3 and miss4 == miss3)
+
+    local _, err = pcall(function() mtstates.newstate("error('fail') " .. code) end)
+    assert(err:match(mtstates.error.invoking_state))
+    local _, err = pcall(function() mtstates.newstate("error('fail') " .. code) end)
+    assert(err:match(mtstates.error.invoking_state))
+    
+    local _, err = pcall(function() mtstates.newstate("(") end)
+    assert(err:match("bad argument #1"))
+
+    local _, _, count = mtstates.setupcache()
+    assert(count > 0)
+    setup = nil
+    collectgarbage()
+    local _, _, count = mtstates.setupcache(0)
+    assert(count == 0)
+    mtstates.setupcache(100)
+    assert(mtstates.newstate(true, code, 1):call(2) == 3)
+
+    -- more distinct setups than the cache limit
+    local states = {}
+    for i = 1, 150 do
+        states[i] = mtstates.newstate(true, "return function() return "..i.." end")
+    end
+    for i = 1, 150 do
+        assert(states[i]:call() == i)
+        assert(mtstates.newstate(true, "return function() return "..i.." end"):call() == i)
+    end
+    local _, _, count = mtstates.setupcache()
+    assert(count >= 100)
+end
+PRINT("==================================================================================")
 print("OK.")
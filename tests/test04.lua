@@ -36,7 +36,7 @@ do
                                         elseif cmd == "add2" then
                                             return thisState:call("add", 1000 + arg)
                                         elseif cmd == "err1" then
-                                            local x = thisState:call("add", {})
+                                            local x = thisState:call("add", function() end)
                                         elseif cmd == "err2" then
                                             return thisState:call("err1")
                                         end
@@ -135,4 +135,41 @@ do
     assert(err:match(mtstates.error.unknown_object))
 end
 PRINT("==================================================================================")
+do
+    local N = 5000
+    local states = {}
+    for i = 1, N do
+        states[i] = mtstates.newstate("named"..i, "return function() return "..i.." end")
+    end
+    states[N + 1] = mtstates.newstate("named7", "return function() return -7 end")
+    for i = 1, N, 97 do
+        local s = mtstates.state("named"..i)
+        if i ~= 7 then
+            assert(s:call() == i)
+        end
+    end
+    local _, err = pcall(function() mtstates.state("named7") end)
+    assert(err:match(mtstates.error.ambiguous_name))
+    
+    for i = 1, N do
+        if i % 10 ~= 0 then
+            states[i] = nil
+        end
+    end
+    collectgarbage()
+    
+    -- name index is shrinked, remaining names are found
+    for i = 10, N, 10 do
+        assert(mtstates.state("named"..i):call() == i)
+    end
+    local _, err = pcall(function() mtstates.state("named11") end)
+    assert(err:match(mtstates.error.unknown_object))
+    assert(mtstates.state("named7"):call() == -7)
+    
+    states = nil
+    collectgarbage()
+    local _, err = pcall(function() mtstates.state("named10") end)
+    assert(err:match(mtstates.error.unknown_object))
+end
+PRINT("==================================================================================")
 print("OK.")
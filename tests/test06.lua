@@ -0,0 +1,155 @@
+local llthreads = require("llthreads2.ex")
+local mtstates  = require("mtstates")
+
+local function PRINT(s)
+    print(s.." ("..debug.getinfo(2).currentline..")")
+end
+local function msgh(err)
+    return debug.traceback(err, 2)
+end
+local function pcall(f, ...)
+    return xpcall(f, msgh, ...)
+end
+
+PRINT("==================================================================================")
+do
+    local pool = mtstates.newpool(3, function(init)
+                                         local mtstates = require("mtstates")
+                                         return function(arg)
+                                             return mtstates.id(), init + arg
+                                         end
+                                     end,
+                                     100)
+    assert(mtstates.type(pool) == "mtstates.pool")
+    assert(pool:isowner())
+    assert(pool:size() == 3)
+    print(pool)
+    local ids = {}
+    for i = 1, pool:size() do
+        local s = pool:state(i)
+        assert(not s:isowner())
+        local id, v = s:call(i)
+        assert(id == s:id() and v == 100 + i)
+        ids[id] = true
+    end
+    local used = {}
+    for i = 1, 6 do
+        local id, v = pool:call(i)
+        assert(ids[id] and v == 100 + i)
+        used[id] = true
+    end
+    local usedCount = 0
+    for _ in pairs(used) do usedCount = usedCount + 1 end
+    assert(usedCount == 3)
+    
+    local ok, id, v = pool:tcall(0, 5)
+    assert(ok and ids[id] and v == 105)
+    
+    local poolId = pool:id()
+    assert(mtstates.pool(poolId):id() == poolId)
+    assert(not mtstates.pool(poolId):isowner())
+    local stateId = pool:state(1):id()
+    pool = nil
+    collectgarbage()
+    local _, err = pcall(function() mtstates.pool(poolId) end)
+    assert(err:match(mtstates.error.unknown_object)) -- no memory leak
+    local _, err = pcall(function() mtstates.state(stateId) end)
+    assert(err:match(mtstates.error.unknown_object)) -- no memory leak
+end
+PRINT("==================================================================================")
+do
+    local pool = mtstates.newpool(2, function()
+                                         local mtstates = require("mtstates")
+                                         local pool
+                                         return function(cmd, arg)
+                                             if cmd == "setpool" then
+                                                 pool = mtstates.pool(arg)
+                                             elseif cmd == "id" then
+                                                 return mtstates.id()
+                                             elseif cmd == "nested" then
+                                                 return mtstates.id(), pool:call("id")
+                                             end
+                                         end
+                                     end)
+    for i = 1, pool:size() do
+        pool:state(i):call("setpool", pool:id())
+    end
+    for i = 1, 4 do
+        local outer, inner = pool:call("nested")
+        assert(outer ~= inner) -- busy state is skipped
+    end
+    local poolId = pool:id()
+    pool = nil
+    collectgarbage()
+    local _, err = pcall(function() mtstates.pool(poolId) end)
+    assert(err:match(mtstates.error.unknown_object)) -- no memory leak
+end
+PRINT("==================================================================================")
+do
+    local pool = mtstates.newpool(2, "return function() end")
+    local p2 = mtstates.pool(pool:id())
+    pool = nil
+    collectgarbage()
+    local _, err = pcall(function() p2:call() end)
+    print("-------------------------------------")
+    PRINT("-- Expected error:")
+    print(err)
+    print("-------------------------------------")
+    assert(err:match(mtstates.error.object_closed))
+end
+PRINT("==================================================================================")
+do
+    local _, err = pcall(function() mtstates.newpool(0, "return function() end") end)
+    print("-------------------------------------")
+    PRINT("-- Expected error:")
+    print(err)
+    print("-------------------------------------")
+    assert(err:match("bad argument #1"))
+
+    local _, err = pcall(function() mtstates.newpool(2, function() return 1 end) end)
+    print("-------------------------------------")
+    PRINT("-- Expected error:")
+    print(err)
+    print("-------------------------------------")
+    assert(err:match(mtstates.error.state_result))
+end
+PRINT("==================================================================================")
+do
+    local pool = mtstates.newpool(4, function()
+                                         local mtstates = require("mtstates")
+                                         local count = 0
+                                         return function(cmd)
+                                             if cmd == "count" then
+                                                 return count
+                                             end
+                                             local t = os.clock() + 0.001
+                                             while os.clock() < t do end
+                                             count = count + 1
+                                         end
+                                     end)
+    local threads = {}
+    for i = 1, 4 do
+        threads[i] = llthreads.new(function(poolId)
+                                       local mtstates = require("mtstates")
+                                       local pool     = mtstates.pool(poolId)
+                                       for j = 1, 50 do
+                                           pool:call("work")
+                                       end
+                                       return true
+                                   end,
+                                   pool:id())
+        threads[i]:start()
+    end
+    for i = 1, 4 do
+        assert(threads[i]:join())
+    end
+    local total = 0
+    for i = 1, pool:size() do
+        local c = pool:state(i):call("count")
+        print("state", i, "count", c)
+        total = total + c
+    end
+    assert(total == 200)
+end
+PRINT("==================================================================================")
+print("OK.")
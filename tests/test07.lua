@@ -0,0 +1,179 @@
+local mtstates  = require("mtstates")
+
+local function PRINT(s)
+    print(s.." ("..debug.getinfo(2).currentline..")")
+end
+local function msgh(err)
+    return debug.traceback(err, 2)
+end
+local function pcall(f, ...)
+    return xpcall(f, msgh, ...)
+end
+
+local canObserve = (mtstates.newstate("return function() end"):memory() ~= nil)
+
+PRINT("==================================================================================")
+if canObserve then
+    local s = mtstates.newstate(function()
+                                    local t
+                                    return function(n)
+                                        if n > 0 then
+                                            t = {}
+                                            for i = 1, n do t[i] = i end
+                                        else
+                                            t = nil
+                                        end
+                                        collectgarbage()
+                                        collectgarbage()
+                                    end
+                                end)
+    local current0, peak0, limit = s:memory()
+    assert(current0 > 0 and peak0 >= current0 and limit == nil)
+    s:call(100000)
+    local current1, peak1 = s:memory()
+    print(current0, peak0, current1, peak1)
+    assert(current1 > current0 + 100000)
+    assert(peak1 >= current1)
+    s:call(0)
+    local current2, peak2 = s:memory()
+    assert(current2 < current1)
+    assert(peak2 == peak1)
+else
+    PRINT("memory accounting not supported")
+end
+PRINT("==================================================================================")
+if canObserve then
+    local s = mtstates.newstate({ memorylimit = 200000 },
+                                function()
+                                    local t
+                                    return function(n)
+                                        t = {}
+                                        for i = 1, n do t[i] = i end
+                                        t = nil
+                                        collectgarbage()
+                                        return n
+                                    end
+                                end)
+    local current, peak, limit = s:memory()
+    assert(limit == 200000)
+    assert(s:call(10) == 10)
+    local _, err = pcall(function() s:call(1000000) end)
+    print(err)
+    assert(err:match(mtstates.error.out_of_memory))
+    current, peak, limit = s:memory()
+    assert(peak <= limit)
+    assert(s:call(20) == 20) -- state is still usable
+else
+    PRINT("memory limit not supported")
+end
+PRINT("==================================================================================")
+if canObserve then
+    local _, err = pcall(function() 
+        mtstates.newstate({ memorylimit = 100 }, "return function() end")
+    end)
+    print(err)
+    assert(err:match(mtstates.error.out_of_memory))
+    
+    local _, err = pcall(function()
+        mtstates.newstate({ memorylimit = 500000 }, "local t = {} for i = 1, 1000000 do t[i] = i end")
+    end)
+    print(err)
+    assert(err:match(mtstates.error.out_of_memory))
+end
+PRINT("==================================================================================")
+do
+    local s = mtstates.newstate({ libs = false }, "return function() return type(string) end")
+    assert(s:call() == "nil")
+    local s = mtstates.newstate("foo", { libs = true }, "return function() return type(string) end")
+    assert(s:name() == "foo")
+    assert(s:call() == "table")
+    
+    local _, err = pcall(function() mtstates.newstate({ memorylimit = -1 }, "return function() end") end)
+    print(err)
+    assert(err:match("bad argument #1"))
+    local _, err = pcall(function() mtstates.newstate({ libs = 1 }, "return function() end") end)
+    print(err)
+    assert(err:match("bad argument #1"))
+end
+PRINT("==================================================================================")
+do
+    local s = mtstates.newstate({ allocator = "slab" },
+                                function()
+                                    local t = {}
+                                    return function(n)
+                                        for i = 1, n do
+                                            t[i] = { tostring(i), i }
+                                        end
+                                        local sum = 0
+                                        for i = 1, n do
+                                            sum = sum + tonumber(t[i][1]) + t[i][2]
+                                        end
+                                        t = {}
+                                        collectgarbage()
+                                        return sum, string.rep("x", n)
+                                    end
+                                end)
+    for _, n in ipairs{ 10, 1000, 100000, 100 } do
+        local sum, str = s:call(n)
+        assert(sum == n * (n + 1))
+        assert(str == string.rep("x", n))
+    end
+    if canObserve then
+        local current, peak = s:memory()
+        print(current, peak)
+        assert(peak > current)
+    end
+    s:close()
+
+    local _, err = pcall(function() mtstates.newstate({ allocator = "foo" }, "return function() end") end)
+    print(err)
+    assert(err:match("bad argument #1"))
+end
+PRINT("==================================================================================")
+if canObserve then
+    local s = mtstates.newstate({ allocator = "slab", memorylimit = 200000 },
+                                "return function(n) local t = {} for i = 1, n do t[i] = {} end return n end")
+    assert(s:call(10) == 10)
+    local _, err = pcall(function() s:call(100000) end)
+    print(err)
+    assert(err:match(mtstates.error.out_of_memory))
+    assert(s:call(20) == 20)
+end
+PRINT("==================================================================================")
+if canObserve then
+    -- the state is busy in the mailbox worker
+    local s = mtstates.newstate(function()
+                                    local t
+                                    return function(n)
+                                        if n > 0 then
+                                            t = {}
+                                            for i = 1, n do t[i] = i end
+                                            local c = os.clock()
+                                            while os.clock() < c + 0.1 do end
+                                        else
+                                            return collectgarbage("count")
+                                        end
+                                    end
+                                end)
+    local current0 = s:memory()
+    local f = s:acall(100000)
+    local observed = {}
+    while not f:ready() do
+        local current, peak = s:memory()
+        assert(peak >= current)
+        observed[current] = true
+    end
+    f:wait()
+    local current1 = s:memory()
+    assert(current1 > current0 + 100000)
+    -- no intermediate values while the table is built
+    for current in pairs(observed) do
+        assert(current == current0 or current == current1)
+    end
+    assert(s:call(0) * 1024 == current1)
+else
+    local r, msg = mtstates.newstate("return function() end"):memory()
+    assert(r == nil and msg == "unsupported")
+end
+PRINT("==================================================================================")
+print("OK.")
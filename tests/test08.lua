@@ -0,0 +1,109 @@
+local llthreads = require("llthreads2.ex")
+local mtstates  = require("mtstates")
+
+local function PRINT(s)
+    print(s.." ("..debug.getinfo(2).currentline..")")
+end
+local function msgh(err)
+    return debug.traceback(err, 2)
+end
+local function pcall(f, ...)
+    return xpcall(f, msgh, ...)
+end
+
+PRINT("==================================================================================")
+do
+    -- lookup by id while other threads are creating and freeing states
+    local target = mtstates.newstate("return function(x) return x * 2 end")
+    local id = target:id()
+    
+    local threads = {}
+    for i = 1, 2 do
+        threads[#threads + 1] = llthreads.new(function(n)
+            local mtstates = require("mtstates")
+            for i = 1, n do
+                local s = mtstates.newstate("return function() end")
+                if i % 50 == 0 then
+                    collectgarbage()
+                end
+            end
+            return true
+        end, 3000)
+    end
+    for i = 1, 3 do
+        threads[#threads + 1] = llthreads.new(function(id, n)
+            local mtstates = require("mtstates")
+            for i = 1, n do
+                local s = mtstates.state(id)
+                assert(s:call(i) == 2 * i)
+                local ok, err = _G.pcall(mtstates.state, id + 1000000)
+                assert(not ok and err:match(mtstates.error.unknown_object))
+            end
+            return true
+        end, id, 3000)
+    end
+    for _, t in ipairs(threads) do
+        t:start()
+    end
+    for _, t in ipairs(threads) do
+        local ok, err = t:join(); assert(ok, err)
+    end
+    assert(mtstates.state(id):call(3) == 6)
+    target:close()
+    local _, err = pcall(function() mtstates.state(id) end)
+    assert(err:match(mtstates.error.unknown_object))
+    target = nil
+    collectgarbage()
+    local _, err = pcall(function() mtstates.state(id) end)
+    assert(err:match(mtstates.error.unknown_object))
+    local _, err = pcall(function() mtstates.state(-1) end)
+    assert(err:match(mtstates.error.unknown_object))
+end
+PRINT("==================================================================================")
+do
+    -- growing and shrinking the table while looking up states
+    local N = 20000
+    local states = {}
+    local ids    = {}
+    for i = 1, N do
+        states[i] = mtstates.newstate("return function() return "..i.." end")
+        ids[i] = states[i]:id()
+        if i % 1000 == 0 then
+            for j = 1, i, 97 do
+                assert(mtstates.state(ids[j]):call() == j)
+            end
+        end
+    end
+    for k = 1, 3 do
+        for i = 1, N do
+            if i % 100 ~= 0 then
+                states[i] = nil
+            end
+        end
+        collectgarbage()
+        for i = 100, N, 100 do
+            assert(mtstates.state(ids[i]):call() == i)
+        end
+        for i = 1, N do
+            if not states[i] then
+                local ok, err = pcall(mtstates.state, ids[i])
+                assert(not ok and err:match(mtstates.error.unknown_object))
+                states[i] = mtstates.newstate("return function() return "..i.." end")
+                ids[i] = states[i]:id()
+            end
+        end
+        for i = 1, N, 37 do
+            assert(mtstates.state(ids[i]):call() == i)
+        end
+    end
+    states = nil
+    collectgarbage()
+    for i = 1, N, 37 do
+        local ok, err = pcall(mtstates.state, ids[i])
+        assert(not ok and err:match(mtstates.error.unknown_object))
+    end
+    local s = mtstates.newstate("return function() return 1 end")
+    assert(mtstates.state(s:id()):call() == 1)
+end
+PRINT("==================================================================================")
+print("OK.")
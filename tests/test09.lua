@@ -0,0 +1,137 @@
+local llthreads = require("llthreads2.ex")
+local mtstates  = require("mtstates")
+
+local function PRINT(s)
+    print(s.." ("..debug.getinfo(2).currentline..")")
+end
+local function msgh(err)
+    return debug.traceback(err, 2)
+end
+local function pcall(f, ...)
+    return xpcall(f, msgh, ...)
+end
+
+PRINT("==================================================================================")
+do
+    local s = mtstates.newstate(function()
+                                    local list = {}
+                                    return function(cmd, ...)
+                                        if cmd == "add" then
+                                            local t = {}
+                                            for i = 1, select("#", ...) do
+                                                t[i] = tostring((select(i, ...)))
+                                            end
+                                            list[#list + 1] = table.concat(t, ",")
+                                        elseif cmd == "get" then
+                                            return table.concat(list, ";")
+                                        end
+                                    end
+                                end)
+    for i = 1, 100 do
+        s:post("add", i, "x", 1.5, true)
+    end
+    assert(s:flush() == true)
+    local list = s:call("get")
+    local expected = {}
+    for i = 1, 100 do
+        expected[i] = i..",x,1.5,true"
+    end
+    assert(list == table.concat(expected, ";"))
+    s:post("add", nil)
+    assert(s:flush(1))
+    assert(s:call("get"):match(";nil$"))
+end
+PRINT("==================================================================================")
+do
+    local s = mtstates.newstate(function()
+                                    return function(arg)
+                                        if arg == "fail" then
+                                            error("failed message")
+                                        end
+                                    end
+                                end)
+    s:post("ok")
+    s:post("fail")
+    s:post("ok")
+    local _, err = pcall(function() s:flush() end)
+    print(err)
+    assert(err:match(mtstates.error.invoking_state))
+    assert(err:match("failed message"))
+    assert(s:flush())
+    
+    local _, err = pcall(function() s:post(print) end)
+    print(err)
+    assert(err:match("bad argument #1 to 'post' %(type 'function' not supported%)"))
+end
+PRINT("==================================================================================")
+do
+    -- posting does not wait for the state
+    local s = mtstates.newstate(function()
+                                    local n = 0
+                                    return function(cmd, t)
+                                        if cmd == "sleep" then
+                                            local c = os.clock()
+                                            while os.clock() < c + t do end
+                                        end
+                                        n = n + 1
+                                        return n
+                                    end
+                                end)
+    s:post("sleep", 0.5)
+    s:post("inc")
+    assert(s:flush(0) == false)
+    assert(s:flush(5) == true)
+    assert(s:call() == 3)
+end
+PRINT("==================================================================================")
+do
+    -- several producer threads
+    local s = mtstates.newstate(function()
+                                    local sum = 0
+                                    return function(v)
+                                        if v then
+                                            sum = sum + v
+                                        else
+                                            return sum
+                                        end
+                                    end
+                                end)
+    local threads = {}
+    for i = 1, 4 do
+        threads[i] = llthreads.new(function(id, n)
+            local mtstates = require("mtstates")
+            local s = mtstates.state(id)
+            for i = 1, n do
+                s:post(i)
+            end
+            return true
+        end, s:id(), 1000)
+        threads[i]:start()
+    end
+    for i = 1, 4 do
+        local ok, err = threads[i]:join()
+        assert(ok, err)
+    end
+    s:flush()
+    assert(s:call() == 4 * (1000 * 1001 / 2))
+end
+PRINT("==================================================================================")
+do
+    local s = mtstates.newstate("return function() end")
+    s:post()
+    s:flush()
+    s:close()
+    local _, err = pcall(function() s:post() end)
+    assert(err:match(mtstates.error.object_closed))
+    
+    -- owner is garbage collected while messages are pending
+    local s = mtstates.newstate("return function() local c = os.clock() while os.clock() < c + 0.01 do end end")
+    local id = s:id()
+    for i = 1, 20 do s:post() end
+    s = nil
+    collectgarbage()
+    local _, err = pcall(function() mtstates.state(id) end)
+    assert(err:match(mtstates.error.unknown_object))
+end
+PRINT("==================================================================================")
+print("OK.")
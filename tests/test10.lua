@@ -0,0 +1,180 @@
+local mtstates  = require("mtstates")
+
+local function PRINT(s)
+    print(s.." ("..debug.getinfo(2).currentline..")")
+end
+local function msgh(err)
+    return debug.traceback(err, 2)
+end
+local function pcall(f, ...)
+    return xpcall(f, msgh, ...)
+end
+
+PRINT("==================================================================================")
+do
+    local s = mtstates.newstate("return function(a, b, ...) return a + b, select('#', ...), ... end")
+    local f = s:acall(1, 2, "x", nil, true)
+    assert(mtstates.type(f) == "mtstates.future")
+    print(f)
+    assert(tostring(f):match("^mtstates.future: "))
+    assert(f:wait() == true)
+    assert(f:ready() == true)
+    local r = { f:results() }
+    assert(r[1] == 3 and r[2] == 3 and r[3] == "x" and r[4] == nil and r[5] == true)
+    -- results can be obtained again
+    assert(select("#", f:results()) == 5)
+end
+PRINT("==================================================================================")
+do
+    -- fan out to several states
+    local states  = {}
+    local futures = {}
+    for i = 1, 10 do
+        states[i] = mtstates.newstate(function()
+                                          return function(x)
+                                              local c = os.clock()
+                                              while os.clock() < c + 0.01 do end
+                                              return x * x
+                                          end
+                                      end)
+    end
+    for i = 1, 10 do
+        futures[i] = states[i]:acall(i)
+    end
+    for i = 1, 10 do
+        assert(futures[i]:results() == i * i)
+    end
+end
+PRINT("==================================================================================")
+do
+    -- calls are invoked in order
+    local s = mtstates.newstate(function()
+                                    local n = 0
+                                    return function(cmd)
+                                        if cmd == "inc" then
+                                            n = n + 1
+                                        end
+                                        return n
+                                    end
+                                end)
+    local futures = {}
+    for i = 1, 100 do
+        futures[i] = s:acall("inc")
+    end
+    assert(s:flush())
+    for i = 1, 100 do
+        assert(futures[i]:ready())
+        assert(futures[i]:results() == i)
+    end
+end
+PRINT("==================================================================================")
+do
+    local s = mtstates.newstate(function()
+                                    return function(arg)
+                                        if arg == "fail" then
+                                            error("failed call")
+                                        elseif arg == "table" then
+                                            return 1, print
+                                        elseif arg == "wait" then
+                                            local c = os.clock()
+                                            while os.clock() < c + 0.5 do end
+                                        end
+                                    end
+                                end)
+    local f = s:acall("fail")
+    local _, err = pcall(function() f:results() end)
+    print(err)
+    assert(err:match(mtstates.error.invoking_state))
+    assert(err:match("failed call"))
+    
+    -- errors of asynchronous calls are not reported by flush
+    assert(s:flush())
+    
+    local f = s:acall("table")
+    local _, err = pcall(function() f:results() end)
+    print(err)
+    assert(err:match(mtstates.error.invoking_state))
+    assert(err:match("state callback function returned bad parameter #2: type 'function' not supported"))
+    
+    local _, err = pcall(function() s:acall(print) end)
+    print(err)
+    assert(err:match("bad argument #1 to 'acall' %(type 'function' not supported%)"))
+    
+    local f = s:acall("wait")
+    assert(f:ready() == false)
+    assert(f:wait(0.01) == false)
+    assert(f:wait() == true)
+    assert(select("#", f:results()) == 0)
+end
+PRINT("==================================================================================")
+do
+    local s = mtstates.newstate(function()
+                                    return function() 
+                                        local c = os.clock() 
+                                        while os.clock() < c + 0.01 do end 
+                                        return true
+                                    end
+                                end)
+    local futures = {}
+    for i = 1, 20 do
+        futures[i] = s:acall()
+    end
+    -- s:close() would raise concurrent_access while the worker invokes a call,
+    -- the last owner being collected closes the state without waiting
+    s = nil
+    collectgarbage()
+    local closed = 0
+    for i = 1, 20 do
+        local ok, err = pcall(function() return futures[i]:results() end)
+        if not ok then
+            assert(err:match(mtstates.error.object_closed))
+            closed = closed + 1
+        end
+    end
+    print("closed", closed)
+    assert(closed > 0)
+    
+    local s = mtstates.newstate("return function() end")
+    s:close()
+    local _, err = pcall(function() s:acall() end)
+    assert(err:match(mtstates.error.object_closed))
+    
+    -- futures outlive the state
+    local s = mtstates.newstate("return function() return 42 end")
+    local f = s:acall()
+    f:wait()
+    s = nil
+    collectgarbage()
+    assert(f:results() == 42)
+end
+PRINT("==================================================================================")
+do
+    -- the worker of an inner state is not awaited when the outer state is closed,
+    -- although the inner state's message calls the outer state
+    local a = mtstates.newstate(function()
+        local mtstates = require("mtstates")
+        local b
+        return function(outer)
+            b = mtstates.newstate(function()
+                local mtstates = require("mtstates")
+                local pcall    = _G.pcall
+                return function(outer)
+                    local t = mtstates.now() + 0.2
+                    while mtstates.now() < t do end
+                    pcall(function() outer:call() end)
+                end
+            end)
+            b:post(outer)
+        end
+    end)
+    a:call(a)
+    local t = mtstates.now()
+    while mtstates.now() < t + 0.05 do end -- inner message is running
+    a:close()
+    a = nil
+    collectgarbage()
+    assert(mtstates.now() < t + 0.15)
+    while mtstates.now() < t + 0.3 do end -- inner message is finished
+end
+PRINT("==================================================================================")
+print("OK.")
@@ -0,0 +1,129 @@
+local mtstates  = require("mtstates")
+
+local function PRINT(s)
+    print(s.." ("..debug.getinfo(2).currentline..")")
+end
+local function msgh(err)
+    return debug.traceback(err, 2)
+end
+local function pcall(f, ...)
+    return xpcall(f, msgh, ...)
+end
+
+PRINT("==================================================================================")
+do
+    local s = mtstates.newstate(function()
+                                    local sum = 0
+                                    return function(cmd, x, ...)
+                                        if cmd == "add" then
+                                            sum = sum + x
+                                            return sum
+                                        elseif cmd == "echo" then
+                                            return x, ...
+                                        elseif cmd == "sum" then
+                                            return sum
+                                        end
+                                    end
+                                end)
+    local list = {}
+    for i = 1, 1000 do
+        list[i] = { "add", i }
+    end
+    local r = s:callbatch(list)
+    assert(#r == 1000)
+    for i = 1, 1000 do
+        assert(r[i].n == 1 and r[i][1] == i * (i + 1) / 2)
+    end
+    assert(s:call("sum") == 500500)
+    
+    local r = s:callbatch({ { "echo", 1, nil, "x", n = 4 }, { "echo" }, { "sum" }, { "echo", true, nil } })
+    assert(#r == 4)
+    assert(r[1].n == 3 and r[1][1] == 1 and r[1][2] == nil and r[1][3] == "x")
+    assert(r[2].n == 1 and r[2][1] == nil)
+    assert(r[3].n == 1 and r[3][1] == 500500)
+    assert(r[4].n == 1 and r[4][1] == true)
+    
+    local r = s:callbatch({})
+    assert(type(r) == "table" and #r == 0)
+    
+    -- results of all invocations in one list
+    local r = s:callbatch({ { "add", 1 }, { "echo", "a", "b" }, { "echo" } }, 1)
+    assert(r.n == 3 and r[1] == 500501 and r[2] == "a" and r[3] == nil)
+    local r = s:callbatch({ { "echo", 1 }, { "echo", 2, 3, 4 } }, 2)
+    assert(r.n == 4 and r[1] == 1 and r[2] == nil and r[3] == 2 and r[4] == 3)
+    local r = s:callbatch({ { "add", 1 }, { "add", 1 } }, 0)
+    assert(r.n == 0 and #r == 0)
+    assert(s:call("sum") == 500503)
+    
+    local _, err = pcall(function() s:callbatch({}, -1) end)
+    assert(err:match("bad argument #2 to 'callbatch' %(non%-negative integer expected%)"))
+end
+PRINT("==================================================================================")
+do
+    local s = mtstates.newstate(function()
+                                    local n = 0
+                                    return function(arg)
+                                        n = n + 1
+                                        if arg == "fail" then
+                                            error("failed call")
+                                        elseif arg == "table" then
+                                            return print
+                                        end
+                                        return n
+                                    end
+                                end)
+    local _, err = pcall(function() s:callbatch({ {}, {"fail"}, {} }) end)
+    print(err)
+    assert(err:match(mtstates.error.invoking_state))
+    assert(err:match("failed call"))
+    -- invocations before the error have been done
+    assert(s:call() == 3)
+    
+    local _, err = pcall(function() s:callbatch({ {}, {"table"} }) end)
+    print(err)
+    assert(err:match(mtstates.error.state_result))
+    
+    local _, err = pcall(function() s:callbatch({ {}, 1 }) end)
+    print(err)
+    assert(err:match("bad argument #1 to 'callbatch' %(table expected at index 2%)"))
+
+    local _, err = pcall(function() s:callbatch({ {}, { 1, print } }) end)
+    print(err)
+    assert(err:match("bad argument #1 to 'callbatch' %(bad parameter #2 at index 2: type 'function' not supported%)"))
+
+    local _, err = pcall(function() s:callbatch() end)
+    print(err)
+    assert(err:match("bad argument #1 to 'callbatch' %(table expected"))
+
+    local _, err = pcall(function() s:callbatch({ {}, { n = -1 } }) end)
+    print(err)
+    assert(err:match("bad argument #1 to 'callbatch' %(invalid field 'n' at index 2%)"))
+
+    -- metamethods of the tuples are not invoked
+    local tuple = setmetatable({}, { __index = function() error("not raw") end })
+    local before = s:call()
+    s:callbatch({ tuple, tuple })
+    assert(s:call() == before + 3)
+end
+PRINT("==================================================================================")
+do
+    -- batch from within the state itself
+    local s = mtstates.newstate(function()
+                                    local mtstates = require("mtstates")
+                                    local sum = 0
+                                    return function(cmd, x)
+                                        if cmd == "batch" then
+                                            local self = mtstates.state(mtstates.id())
+                                            local r = self:callbatch({ { "add", 1 }, { "add", 2 }, { "add", 3 } })
+                                            return r[1][1], r[2][1], r[3][1]
+                                        elseif cmd == "add" then
+                                            sum = sum + x
+                                            return sum
+                                        end
+                                    end
+                                end)
+    local a, b, c = s:call("batch")
+    assert(a == 1 and b == 3 and c == 6)
+end
+PRINT("==================================================================================")
+print("OK.")
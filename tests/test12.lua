@@ -0,0 +1,137 @@
+local llthreads = require("llthreads2.ex")
+local mtstates  = require("mtstates")
+
+local function PRINT(s)
+    print(s.." ("..debug.getinfo(2).currentline..")")
+end
+local function msgh(err)
+    return debug.traceback(err, 2)
+end
+local function pcall(f, ...)
+    return xpcall(f, msgh, ...)
+end
+
+local function newState(fair)
+    return mtstates.newstate({ fair = fair }, function()
+        local mtstates = require("mtstates")
+        local list = {}
+        return function(cmd, arg)
+            if cmd == "hold" then
+                local flag = mtstates.state(arg)
+                while not flag:call() do end
+            elseif cmd == "add" then
+                list[#list + 1] = arg
+            elseif cmd == "get" then
+                return table.concat(list, ",")
+            end
+        end
+    end)
+end
+
+local function newFlag()
+    return mtstates.newstate(function()
+        local v = false
+        return function(set)
+            if set then v = true end
+            return v
+        end
+    end)
+end
+
+PRINT("==================================================================================")
+do
+    -- waiting callers are served in order of arrival
+    local s    = newState(true)
+    local flag = newFlag()
+    assert(s:waiting() == 0)
+    local holder = llthreads.new(function(id, flagId)
+        local mtstates = require("mtstates")
+        mtstates.state(id):call("hold", flagId)
+        return true
+    end, s:id(), flag:id())
+    holder:start()
+    while s:tcall(0) ~= false do end
+    
+    local N = 8
+    local threads = {}
+    for i = 1, N do
+        threads[i] = llthreads.new(function(id, i)
+            local mtstates = require("mtstates")
+            mtstates.state(id):call("add", i)
+            return true
+        end, s:id(), i)
+        threads[i]:start()
+        while s:waiting() < i do end
+    end
+    assert(s:waiting() == N)
+    assert(s:tcall(0.01) == false)
+    assert(s:waiting() == N)
+    flag:call(true)
+    assert(holder:join())
+    for i = 1, N do
+        local ok, err = threads[i]:join(); assert(ok, err)
+    end
+    assert(s:waiting() == 0)
+    local expected = {}
+    for i = 1, N do expected[i] = i end
+    assert(s:call("get") == table.concat(expected, ","))
+end
+PRINT("==================================================================================")
+do
+    -- queue depth is also reported without fair mode
+    local s    = newState(false)
+    local flag = newFlag()
+    local holder = llthreads.new(function(id, flagId)
+        local mtstates = require("mtstates")
+        mtstates.state(id):call("hold", flagId)
+        return true
+    end, s:id(), flag:id())
+    holder:start()
+    while s:tcall(0) ~= false do end
+    local threads = {}
+    for i = 1, 3 do
+        threads[i] = llthreads.new(function(id, i)
+            local mtstates = require("mtstates")
+            mtstates.state(id):call("add", i)
+            return true
+        end, s:id(), i)
+        threads[i]:start()
+        while s:waiting() < i do end
+    end
+    assert(s:waiting() == 3)
+    flag:call(true)
+    assert(holder:join())
+    for i = 1, 3 do
+        local ok, err = threads[i]:join(); assert(ok, err)
+    end
+    assert(s:waiting() == 0)
+    assert(#s:call("get") == 5)
+end
+PRINT("==================================================================================")
+do
+    -- many concurrent callers in fair mode
+    local s = mtstates.newstate({ fair = true }, "local n = 0 return function(x) n = n + x return n end")
+    local threads = {}
+    for i = 1, 4 do
+        threads[i] = llthreads.new(function(id)
+            local mtstates = require("mtstates")
+            local s = mtstates.state(id)
+            for i = 1, 2000 do 
+                s:call(1)
+                s:tcall(0.001, 0)
+            end
+            return true
+        end, s:id())
+        threads[i]:start()
+    end
+    for i = 1, 4 do
+        local ok, err = threads[i]:join(); assert(ok, err)
+    end
+    assert(s:call(0) == 8000)
+    assert(s:waiting() == 0)
+
+    local _, err = pcall(function() mtstates.newstate({ fair = 1 }, "return function() end") end)
+    assert(err:match("bad argument #1 to 'newstate' %(boolean expected for option 'fair'%)"))
+end
+PRINT("==================================================================================")
+print("OK.")
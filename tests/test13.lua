@@ -0,0 +1,100 @@
+local llthreads = require("llthreads2.ex")
+local mtstates  = require("mtstates")
+
+local function PRINT(s)
+    print(s.." ("..debug.getinfo(2).currentline..")")
+end
+local function msgh(err)
+    return debug.traceback(err, 2)
+end
+local function pcall(f, ...)
+    return xpcall(f, msgh, ...)
+end
+
+local function newFlag()
+    return mtstates.newstate(function()
+        local v = false
+        return function(set)
+            if set then v = true end
+            return v
+        end
+    end)
+end
+
+PRINT("==================================================================================")
+do
+    local t1 = mtstates.now()
+    local t2 = mtstates.now()
+    assert(type(t1) == "number")
+    assert(t1 <= t2)
+end
+PRINT("==================================================================================")
+do
+    local s = mtstates.newstate(function()
+        return function(a, b) return a + b, "x" end
+    end)
+    local ok, r1, r2 = s:dcall(mtstates.now() + 1, 1, 2)
+    assert(ok == true and r1 == 3 and r2 == "x")
+
+    -- deadline in the past: state is invoked if it is not busy
+    local ok, r1 = s:dcall(mtstates.now() - 1, 3, 4)
+    assert(ok == true and r1 == 7)
+
+    local ok, err = pcall(function() s:dcall("x") end)
+    assert(not ok and err:match("bad argument #1 to 'dcall' %(number expected"))
+end
+PRINT("==================================================================================")
+do
+    -- busy state: deadlines are met with sub-millisecond precision
+    local s = mtstates.newstate(function()
+        local mtstates = require("mtstates")
+        return function(flagId)
+            if flagId then
+                local flag = mtstates.state(flagId)
+                while not flag:call() do end
+            end
+            return true
+        end
+    end)
+    local flag = newFlag()
+    local holder = llthreads.new(function(id, flagId)
+        local mtstates = require("mtstates")
+        mtstates.state(id):call(flagId)
+        return true
+    end, s:id(), flag:id())
+    holder:start()
+    while s:tcall(0) ~= false do end
+
+    assert(s:dcall(mtstates.now() - 1) == false)
+
+    local t0 = mtstates.now()
+    assert(s:dcall(t0 + 0.0003) == false)
+    local t1 = mtstates.now()
+    assert(t1 - t0 >= 0.0003)
+
+    local t0 = mtstates.now()
+    assert(s:tcall(0.0005) == false)
+    local t1 = mtstates.now()
+    assert(t1 - t0 >= 0.0005)
+
+    flag:call(true)
+    assert(holder:join())
+    assert(s:dcall(mtstates.now() + 1) == true)
+end
+PRINT("==================================================================================")
+do
+    -- futures and flush also accept sub-millisecond timeouts
+    local s = mtstates.newstate(function()
+        return function(n)
+            local x = 0
+            for i = 1, n do x = x + i end
+            return x
+        end
+    end)
+    local f = s:acall(10)
+    assert(f:wait(5) == true)
+    assert(f:results() == 55)
+    assert(s:flush(0.0001) == true)
+end
+PRINT("==================================================================================")
+print("OK.")
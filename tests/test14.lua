@@ -0,0 +1,82 @@
+local mtstates  = require("mtstates")
+
+local function PRINT(s)
+    print(s.." ("..debug.getinfo(2).currentline..")")
+end
+local function msgh(err)
+    return debug.traceback(err, 2)
+end
+local function pcall(f, ...)
+    return xpcall(f, msgh, ...)
+end
+
+PRINT("==================================================================================")
+do
+    local s = mtstates.newstate(function()
+        local list = {}
+        return {
+            add = function(...) 
+                for i = 1, select("#", ...) do
+                    list[#list + 1] = select(i, ...)
+                end
+                return #list
+            end,
+            get = function() 
+                return table.concat(list, ",") 
+            end
+        }
+    end)
+    assert(s:call("add", 1) == 1)
+    
+    local add = s:method("add")
+    local get = s:method("get")
+    assert(mtstates.type(add) == "mtstates.method")
+    assert(tostring(add):match("^mtstates%.method: "))
+    assert(add:name() == "add")
+    
+    assert(add:call(2, 3) == 3)
+    assert(s:method("add"):call(4) == 4)
+    local ok, n = add:tcall(1, 5)
+    assert(ok == true and n == 5)
+    assert(get:call() == "1,2,3,4,5")
+
+    local _, err = pcall(function() s:call("foo") end)
+    assert(err:match(mtstates.error.invoking_state))
+    assert(err:match("unknown method foo"))
+
+    local _, err = pcall(function() s:method("foo") end)
+    assert(err:match("bad argument #1 to 'method' %(unknown method foo%)"))
+
+    s:close()
+    local _, err = pcall(function() add:call(6) end)
+    assert(err:match(mtstates.error.object_closed))
+end
+PRINT("==================================================================================")
+do
+    local s = mtstates.newstate(function() return function() end end)
+    local _, err = pcall(function() s:method("foo") end)
+    assert(err:match("did not return a table of functions"))
+end
+PRINT("==================================================================================")
+do
+    local _, err = pcall(function() mtstates.newstate(function() return { f = function() end, x = 1 } end) end)
+    assert(err:match(mtstates.error.state_result))
+    assert(err:match("returned invalid table"))
+end
+PRINT("==================================================================================")
+do
+    -- handles do not own the state
+    local m
+    do
+        local s = mtstates.newstate(function(a) 
+            return { inc = function(x) return x + a end } 
+        end, 10)
+        m = s:method("inc")
+        assert(m:call(1) == 11)
+    end
+    collectgarbage()
+    local _, err = pcall(function() m:call(1) end)
+    assert(err:match(mtstates.error.object_closed))
+end
+PRINT("==================================================================================")
+print("OK.")
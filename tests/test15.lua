@@ -0,0 +1,77 @@
+local mtstates  = require("mtstates")
+
+local function PRINT(s)
+    print(s.." ("..debug.getinfo(2).currentline..")")
+end
+local function msgh(err)
+    return debug.traceback(err, 2)
+end
+local function pcall(f, ...)
+    return xpcall(f, msgh, ...)
+end
+
+PRINT("==================================================================================")
+do
+    local s = mtstates.newstate(function()
+        counter = 0
+        return function() 
+            counter = counter + 1
+            return counter
+        end
+    end)
+    assert(s:call() == 1)
+    
+    local function get(x) return counter + x end
+    assert(s:exec(get, 10) == 11)
+    assert(s:exec(get, 20) == 21)
+    assert(s:exec("return counter, select('#', ...)", 1, 2, 3) == 1)
+    assert(select(2, s:exec("return counter, select('#', ...)", 1, 2, 3)) == 3)
+    
+    assert(s:exec(function(...) counter = select("#", ...); return ... end, 1, nil, "x") == 1)
+    assert(s:call() == 4)
+    assert(select("#", s:exec("return ...", 1, nil, nil)) == 3)
+    
+    for i = 1, 200 do
+        assert(s:exec("return "..i) == i)
+    end
+    assert(s:exec(get, 0) == 4)
+end
+PRINT("==================================================================================")
+do
+    local s = mtstates.newstate(function() return function() end end)
+    local a = 1
+    local _, err = pcall(function() s:exec(function() return a end) end)
+    assert(err:match("bad argument #1 to 'exec' %(function uses upvalue 'a'%)"))
+
+    local _, err = pcall(function() s:exec(print) end)
+    assert(err:match("bad argument #1 to 'exec' %(lua function or string expected%)"))
+
+    local _, err = pcall(function() s:exec("return +") end)
+    assert(err:match("bad argument #1 to 'exec'"))
+
+    local _, err = pcall(function() s:exec("error('foo')") end)
+    assert(err:match(mtstates.error.invoking_state))
+    assert(err:match("foo"))
+
+    local _, err = pcall(function() s:exec("return ...", print) end)
+    assert(err:match("bad argument #2 to 'exec' %(type 'function' not supported%)"))
+    
+    s:close()
+    local _, err = pcall(function() s:exec("return 1") end)
+    assert(err:match(mtstates.error.object_closed))
+end
+PRINT("==================================================================================")
+do
+    -- exec within the state itself
+    local s = mtstates.newstate("s1", function()
+        local mtstates = require("mtstates")
+        return function()
+            local s = mtstates.state("s1")
+            return s:exec(function(x) return x * 2 end, 21)
+        end
+    end)
+    assert(s:call() == 42)
+    assert(s:call() == 42)
+end
+PRINT("==================================================================================")
+print("OK.")
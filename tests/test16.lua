@@ -0,0 +1,134 @@
+local mtstates  = require("mtstates")
+
+local function PRINT(s)
+    print(s.." ("..debug.getinfo(2).currentline..")")
+end
+local function msgh(err)
+    return debug.traceback(err, 2)
+end
+local function pcall(f, ...)
+    return xpcall(f, msgh, ...)
+end
+
+if _VERSION == "Lua 5.1" then
+    print("Lua 5.1: ycall does not yield")
+    print("OK.")
+    return
+end
+
+local flag = mtstates.newstate("flag", function()
+    local started, released = false, false
+    return function(cmd)
+        if cmd == "start" then 
+            started, released = true, false
+        elseif cmd == "release" then 
+            started, released = false, true
+        end
+        return started, released
+    end
+end)
+
+local s = mtstates.newstate(function()
+    local flag = require("mtstates").state("flag")
+    return function(cmd, x)
+        if cmd == "block" then
+            flag:call("start")
+            while not select(2, flag:call()) do end
+        elseif cmd == "fail" then
+            error("failed "..x)
+        end
+        return x and x * 2
+    end
+end)
+
+local function block()
+    s:post("block")
+    while not flag:call() do end
+end
+
+PRINT("==================================================================================")
+do
+    -- state is not busy: no yield
+    local co = coroutine.create(function(x) return s:ycall("double", x) end)
+    local ok, r = coroutine.resume(co, 1)
+    assert(ok and r == 2 and coroutine.status(co) == "dead")
+    
+    -- not within coroutine: same as call
+    assert(s:ycall("double", 2) == 4)
+end
+PRINT("==================================================================================")
+do
+    block()
+    local co = coroutine.create(function(x) return s:ycall("double", x) end)
+    local ok, token = coroutine.resume(co, 21)
+    assert(ok and mtstates.type(token) == "mtstates.future")
+    assert(coroutine.status(co) == "suspended")
+    
+    -- resuming before the future is ready yields again
+    local ok, token2 = coroutine.resume(co)
+    assert(ok and token2 == token)
+    
+    flag:call("release")
+    assert(token:wait())
+    local ok, r = coroutine.resume(co)
+    assert(ok and r == 42 and coroutine.status(co) == "dead")
+end
+PRINT("==================================================================================")
+do
+    -- many coroutines waiting for one busy state within one thread
+    block()
+    local N = 1000
+    local cos = {}
+    local tokens = {}
+    for i = 1, N do
+        cos[i] = coroutine.create(function(x) return s:ycall("double", x) end)
+        local ok, token = coroutine.resume(cos[i], i)
+        assert(ok and mtstates.type(token) == "mtstates.future")
+        tokens[i] = token
+    end
+    flag:call("release")
+    local sum = 0
+    local done = 0
+    while done < N do
+        for i = 1, N do
+            if cos[i] and tokens[i]:ready() then
+                local ok, r = coroutine.resume(cos[i])
+                assert(ok and r == 2 * i)
+                sum = sum + r
+                cos[i] = nil
+                done = done + 1
+            end
+        end
+    end
+    assert(sum == N * (N + 1))
+end
+PRINT("==================================================================================")
+do
+    block()
+    local co = coroutine.create(function() return s:ycall("fail", 1) end)
+    local ok, token = coroutine.resume(co)
+    assert(ok and mtstates.type(token) == "mtstates.future")
+    flag:call("release")
+    token:wait()
+    local ok, err = coroutine.resume(co)
+    assert(not ok and err:match(mtstates.error.invoking_state))
+    assert(err:match("failed 1"))
+end
+PRINT("==================================================================================")
+do
+    -- arguments are checked whether the state is busy or not
+    local co = coroutine.create(function() return s:ycall("double", print) end)
+    local ok, err = coroutine.resume(co)
+    print(err)
+    assert(not ok and err:match("bad argument #2 to 'ycall' %(type 'function' not supported%)"))
+    
+    block()
+    local co = coroutine.create(function() return s:ycall("double", 3, print) end)
+    local ok, err = coroutine.resume(co)
+    print(err)
+    assert(not ok and err:match("bad argument #3 to 'ycall' %(type 'function' not supported%)"))
+    flag:call("release")
+    assert(s:flush())
+end
+PRINT("==================================================================================")
+print("OK.")
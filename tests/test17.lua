@@ -0,0 +1,158 @@
+local mtstates  = require("mtstates")
+
+local function PRINT(s)
+    print(s.." ("..debug.getinfo(2).currentline..")")
+end
+local function msgh(err)
+    return debug.traceback(err, 2)
+end
+local function pcall(f, ...)
+    return xpcall(f, msgh, ...)
+end
+
+local s = mtstates.newstate(function()
+    return function(cmd, n)
+        if cmd == "range" then
+            local i = 0
+            return function()
+                if i < n then
+                    i = i + 1
+                    return i, i * i
+                end
+            end
+        elseif cmd == "co" then
+            return coroutine.create(function()
+                for i = 1, n do
+                    coroutine.yield(string.rep("x", i))
+                end
+            end)
+        elseif cmd == "fail" then
+            return function() error("generator failed") end
+        elseif cmd == "bad" then
+            return 1
+        else
+            return cmd
+        end
+    end
+end)
+
+PRINT("==================================================================================")
+do
+    local sum, count = 0, 0
+    for i, sq in s:iter("range", 1000) do
+        assert(sq == i * i)
+        sum   = sum + i
+        count = count + 1
+    end
+    assert(count == 1000 and sum == 1000 * 1001 / 2)
+    assert(s:call("x") == "x")
+end
+PRINT("==================================================================================")
+do
+    local n = 0
+    for chunk in s:iter("co", 100) do
+        n = n + 1
+        assert(chunk == string.rep("x", n))
+    end
+    assert(n == 100)
+end
+PRINT("==================================================================================")
+do
+    -- iterator holds the state: other callers from this thread are self calls
+    local it = s:iter("range", 3)
+    assert(mtstates.type(it) == "mtstates.iterator")
+    assert(tostring(it):match("^mtstates%.iterator: "))
+    assert(it() == 1)
+    assert(s:call("y") == "y")
+    assert(it() == 2)
+    it:close()
+    assert(it() == nil)
+    assert(s:tcall(0, "z"))
+end
+PRINT("==================================================================================")
+do
+    -- releasing between steps
+    local it = s:riter("range", 3)
+    assert(it() == 1)
+    assert(select(2, s:tcall(0, "z")) == "z")
+    assert(it() == 2)
+    assert(it() == 3)
+    assert(it() == nil)
+    assert(it() == nil)
+end
+PRINT("==================================================================================")
+do
+    -- abandoned iteration releases the state
+    for i in s:iter("range", 10) do
+        if i == 2 then break end
+    end
+    collectgarbage()
+    assert(s:tcall(0, "z"))
+end
+PRINT("==================================================================================")
+do
+    local it = s:iter("fail")
+    local _, err = pcall(function() it() end)
+    assert(err:match(mtstates.error.invoking_state))
+    assert(err:match("generator failed"))
+    assert(it() == nil)
+    assert(s:tcall(0, "z"))
+
+    local _, err = pcall(function() s:iter("bad") end)
+    assert(err:match(mtstates.error.state_result))
+    assert(err:match("returned number but a function or a coroutine is required"))
+    assert(s:tcall(0, "z"))
+
+    local _, err = pcall(function() s:riter("range", print) end)
+    assert(err:match("bad argument #2 to 'riter' %(type 'function' not supported%)"))
+    assert(s:tcall(0, "z"))
+end
+PRINT("==================================================================================")
+do
+    -- a held iterator kept in another state is advanced by the state's worker thread
+    local b = mtstates.newstate(function()
+        local mtstates = require("mtstates")
+        return function(cmd, n)
+            if cmd == "range" then
+                return coroutine.wrap(function() for i = 1, n do coroutine.yield(i) end end)
+            elseif cmd == "sleep" then
+                local t = mtstates.now() + n
+                while mtstates.now() < t do end
+            end
+            return "free"
+        end
+    end)
+    local a = mtstates.newstate(function(b)
+        local it
+        return function(cmd)
+            if cmd == "start" then
+                it = b:iter("range", 3)
+            end
+            return it()
+        end
+    end, b)
+    assert(a:call("start") == 1)
+    assert(a:acall("next"):results() == 2)
+    assert(a:call("next") == 3)
+    assert(a:acall("next"):results() == nil)
+    local ok, r = b:tcall(1)
+    assert(ok and r == "free")
+
+    -- collecting a riter iterator does not wait for the busy state
+    local it = b:riter("range", 3)
+    assert(it() == 1)
+    b:post("sleep", 0.3)
+    local t = mtstates.now()
+    while b:tcall(0) do
+        assert(mtstates.now() < t + 0.2)
+    end
+    it = nil
+    collectgarbage()
+    collectgarbage()
+    assert(mtstates.now() < t + 0.2)
+    assert(b:flush())
+    local ok, r = b:tcall(1)
+    assert(ok and r == "free")
+end
+PRINT("==================================================================================")
+print("OK.")
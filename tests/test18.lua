@@ -0,0 +1,171 @@
+local mtstates  = require("mtstates")
+
+local function PRINT(s)
+    print(s.." ("..debug.getinfo(2).currentline..")")
+end
+local function msgh(err)
+    return debug.traceback(err, 2)
+end
+local function pcall(f, ...)
+    return xpcall(f, msgh, ...)
+end
+
+local function equals(a, b, seen)
+    if type(a) ~= "table" or type(b) ~= "table" then
+        return a == b
+    end
+    seen = seen or {}
+    if seen[a] then
+        return seen[a] == b
+    end
+    seen[a] = b
+    for k, v in pairs(a) do
+        if not equals(v, b[k], seen) then return false end
+    end
+    for k in pairs(b) do
+        if a[k] == nil then return false end
+    end
+    return true
+end
+
+local s = mtstates.newstate(function()
+    return function(cmd, ...)
+        if cmd == "echo" then
+            return ...
+        elseif cmd == "cycle" then
+            local t = { name = "root" }
+            t.self = t
+            t.list = { t, t }
+            return t
+        elseif cmd == "check" then
+            local t = ...
+            return t.self == t, t.list[1] == t.list[2], rawequal(t.list[1], t)
+        elseif cmd == "deep" then
+            local t = {}
+            for i = 1, (...) do t = { t } end
+            return t
+        elseif cmd == "bad" then
+            return { 1, { print } }
+        end
+    end
+end)
+
+PRINT("==================================================================================")
+do
+    local t = { 1, 2.5, "x", true, { a = 1, b = { "c" } }, [10] = 10, name = "n", [false] = 0 }
+    local r = s:call("echo", t, {}, "y")
+    assert(r ~= t)
+    assert(equals(r, t))
+    assert(equals(select(2, s:call("echo", t, {}, "y")), {}))
+    assert(select(3, s:call("echo", t, {}, "y")) == "y")
+
+    -- holes in the array part
+    local h = s:call("echo", { 1, nil, 3, nil, 5 })
+    assert(h[1] == 1 and h[2] == nil and h[3] == 3 and h[5] == 5)
+
+    -- tables as keys, metatables are not transferred
+    local k = setmetatable({ 1 }, { __index = function() return 0 end })
+    local r = s:call("echo", { [k] = "v" })
+    local rk = next(r)
+    assert(type(rk) == "table" and rk[1] == 1 and rk[2] == nil and r[rk] == "v")
+end
+PRINT("==================================================================================")
+do
+    -- cycles and shared tables keep their identity
+    local t = s:call("cycle")
+    assert(t.name == "root" and t.self == t and t.list[1] == t and t.list[2] == t)
+
+    local a = {}
+    local b = { a, a }
+    a.b = b
+    local r1, r2, r3 = s:call("check", { self = false, list = b })
+    assert(r1 == false and r2 == true and r3 == false)
+    local x = { list = {} }
+    x.self = x
+    x.list[1] = x
+    x.list[2] = x
+    local r1, r2, r3 = s:call("check", x)
+    assert(r1 == true and r2 == true and r3 == true)
+end
+PRINT("==================================================================================")
+do
+    -- nesting limit
+    local t = s:call("deep", 99)
+    local _, err = pcall(function() s:call("deep", 100) end)
+    print(err)
+    assert(err:match(mtstates.error.state_result))
+    assert(err:match("table nesting too deep"))
+
+    local t = {}
+    for i = 1, 200 do t = { t } end
+    local _, err = pcall(function() s:call("echo", t) end)
+    print(err)
+    assert(err:match("bad argument #2 to 'call' %(table nesting too deep%)"))
+
+    local _, err = pcall(function() s:call("echo", 1, { 1, { print } }) end)
+    print(err)
+    assert(err:match("bad argument #3 to 'call' %(type 'function' not supported%)"))
+
+    local _, err = pcall(function() s:call("bad") end)
+    print(err)
+    assert(err:match(mtstates.error.state_result))
+    assert(err:match("type 'function' not supported"))
+    assert(s:call("echo", 1) == 1)
+end
+PRINT("==================================================================================")
+do
+    -- tables via asynchronous calls, i.e. the buffer format of the receiver writer
+    local records = {}
+    for i = 1, 100 do
+        records[i] = { id = i, name = "n"..i, tags = { "a", "b" }, [string.rep("k", 300)] = i }
+    end
+    records.meta = { count = 100 }
+    records.self = records
+    local f = s:acall("echo", records, "z")
+    local r, z = f:results()
+    assert(z == "z")
+    assert(r.self == r and r.meta.count == 100)
+    assert(equals(r, records))
+
+    local f = s:acall("cycle")
+    local t = f:results()
+    assert(t.self == t and t.list[2] == t)
+
+    local t = {}
+    for i = 1, 200 do t = { t } end
+    local _, err = pcall(function() s:acall("echo", t) end)
+    print(err)
+    assert(err:match("bad argument #2 to 'acall' %(table nesting too deep%)"))
+
+    local _, err = pcall(function() s:post("echo", { x = { print } }) end)
+    print(err)
+    assert(err:match("bad argument #2 to 'post' %(type 'function' not supported%)"))
+    assert(s:flush())
+end
+PRINT("==================================================================================")
+do
+    -- failed table copies in self calls do not disturb the caller
+    local s = mtstates.newstate(function()
+        local pcall = _G.pcall
+        local self
+        return function(cmd, arg)
+            if cmd == "init" then
+                self = arg
+            elseif cmd == "echo" then
+                return arg
+            elseif cmd == "bad" then
+                local a, b = "a", "b"
+                local ok, err = pcall(function() return self:call("echo", { 1, { 2, { print } } }) end)
+                assert(not ok and err:match("type 'function' not supported"))
+                local ok, err = pcall(function() return self:call("echo", { 1, { 2, { 3 } } }) end)
+                assert(ok and err[2][2][1] == 3)
+                return a, b, select("#", self:call("echo", { x = { y = 3 } }))
+            end
+        end
+    end)
+    s:call("init", s)
+    local a, b, n = s:call("bad")
+    assert(a == "a" and b == "b" and n == 1)
+end
+PRINT("==================================================================================")
+print("OK.")
@@ -0,0 +1,89 @@
+local mtstates  = require("mtstates")
+
+local function PRINT(s)
+    print(s.." ("..debug.getinfo(2).currentline..")")
+end
+local function msgh(err)
+    return debug.traceback(err, 2)
+end
+local function pcall(f, ...)
+    return xpcall(f, msgh, ...)
+end
+
+PRINT("==================================================================================")
+do
+    local b = mtstates.newblob("hello world")
+    assert(mtstates.type(b) == "mtstates.blob")
+    assert(tostring(b):match("^mtstates%.blob: .* %(length=11%)$"))
+    assert(b:len() == 11)
+    assert(#b == 11)
+    assert(b:tostring() == "hello world")
+    assert(b:sub(1, 5) == "hello")
+    assert(b:sub(7) == "world")
+    assert(b:sub(-5, -2) == "worl")
+    assert(b:sub(0) == "hello world")
+    assert(b:sub(5, 3) == "")
+    assert(b:sub(100) == "")
+    assert(b:byte() == 104)
+    assert(select("#", b:byte(1, -1)) == 11)
+    assert(select(3, b:byte(1, 3)) == 108)
+    assert(b:byte(-1) == 100)
+    assert(select("#", b:byte(20)) == 0)
+
+    local e = mtstates.newblob("")
+    assert(#e == 0 and e:tostring() == "" and e:sub(1) == "")
+
+    local _, err = pcall(function() mtstates.newblob({}) end)
+    assert(err:match("bad argument #1 to 'newblob'"))
+end
+PRINT("==================================================================================")
+do
+    local s = mtstates.newstate(function()
+        local kept
+        return function(cmd, b)
+            if cmd == "keep" then
+                kept = b
+                return #b, b:sub(1, 3)
+            elseif cmd == "get" then
+                return kept
+            elseif cmd == "echo" then
+                return b
+            elseif cmd == "table" then
+                return { b, blob = b }
+            end
+        end
+    end)
+    local data = string.rep("0123456789", 100000)
+    local b = mtstates.newblob(data)
+    local n, head = s:call("keep", b)
+    assert(n == #data and head == "012")
+    b = nil
+    collectgarbage()
+    local b2 = s:call("get")
+    assert(mtstates.type(b2) == "mtstates.blob")
+    assert(#b2 == #data and b2:tostring() == data)
+
+    -- asynchronous calls transfer blobs by reference as well
+    local f = s:acall("echo", b2)
+    local b3 = f:results()
+    assert(#b3 == #data and b3:sub(-10) == "0123456789")
+    local b4 = f:results()
+    assert(b4:tostring() == data)
+    f = nil
+    collectgarbage()
+    assert(b4:sub(1, 1) == "0")
+
+    local t = s:acall("table", b2):results()
+    assert(#t[1] == #data and #t.blob == #data)
+
+    for i = 1, 10 do
+        s:post("echo", mtstates.newblob(tostring(i)))
+    end
+    assert(s:flush())
+
+    -- blobs of messages that are rejected are released
+    local _, err = pcall(function() s:post("echo", { b2, print }) end)
+    assert(err:match("type 'function' not supported"))
+end
+PRINT("==================================================================================")
+print("OK.")
@@ -0,0 +1,81 @@
+local mtstates  = require("mtstates")
+
+local function PRINT(s)
+    print(s.." ("..debug.getinfo(2).currentline..")")
+end
+local function msgh(err)
+    return debug.traceback(err, 2)
+end
+local function pcall(f, ...)
+    return xpcall(f, msgh, ...)
+end
+
+PRINT("==================================================================================")
+do
+    local s1 = mtstates.newstate(function()
+        return function(x) return x * 2 end
+    end)
+    local s2 = mtstates.newstate(function()
+        local states = {}
+        return function(cmd, name, s)
+            if cmd == "add" then
+                assert(not s:isowner())
+                states[name] = s
+                return s:id()
+            elseif cmd == "invoke" then
+                return states[name]:call(s)
+            elseif cmd == "get" then
+                return states[name]
+            elseif cmd == "all" then
+                return states
+            end
+        end
+    end)
+    assert(s2:call("add", "s1", s1) == s1:id())
+    assert(s2:call("invoke", "s1", 21) == 42)
+
+    local r = s2:call("get", "s1")
+    assert(mtstates.type(r) == "mtstates.state")
+    assert(r:id() == s1:id() and not r:isowner())
+    assert(r:call(5) == 10)
+
+    local t = s2:call("all")
+    assert(t.s1:id() == s1:id())
+
+    -- states are transferred by reference in asynchronous calls and messages
+    local f = s2:acall("get", "s1")
+    assert(f:results():call(1) == 2)
+    assert(f:results():id() == s1:id())
+    f = nil
+    collectgarbage()
+
+    s2:post("add", "s1b", s1)
+    assert(s2:flush())
+    assert(s2:call("invoke", "s1b", 4) == 8)
+
+    -- state references do not keep the state alive
+    s1 = nil
+    r  = nil
+    t  = nil
+    collectgarbage()
+    local _, err = pcall(function() s2:call("invoke", "s1", 1) end)
+    assert(err:match(mtstates.error.object_closed))
+
+    -- references to states of messages that are rejected are released
+    local s3 = mtstates.newstate(function() return function() end end)
+    local _, err = pcall(function() s2:post("add", "s3", { s3, print }) end)
+    assert(err:match("type 'function' not supported"))
+end
+PRINT("==================================================================================")
+do
+    local s = mtstates.newstate(function()
+        local self
+        return function(s)
+            if s then self = s else return self:id() end
+        end
+    end)
+    s:call(s)
+    assert(s:call() == s:id())
+end
+PRINT("==================================================================================")
+print("OK.")
@@ -0,0 +1,91 @@
+local llthreads = require("llthreads2.ex")
+local mtmsg     = require("mtmsg")
+local mtstates  = require("mtstates")
+
+local function PRINT(s)
+    print(s.." ("..debug.getinfo(2).currentline..")")
+end
+local function msgh(err)
+    return debug.traceback(err, 2)
+end
+local function pcall(f, ...)
+    return xpcall(f, msgh, ...)
+end
+
+local function newReceiver(coalesce, buffer)
+    return mtstates.newstate({ coalesce = coalesce }, function(bufferId)
+        local mtmsg  = require("mtmsg")
+        local buffer = mtmsg.buffer(bufferId)
+        local invocations, received = 0, 0
+        return function(cmd, n)
+            if cmd == "produce" then
+                for i = 1, n do buffer:addmsg(i) end
+            elseif cmd == "counts" then
+                return invocations, received
+            else
+                invocations = invocations + 1
+                while buffer:nextmsg(0) ~= nil do
+                    received = received + 1
+                end
+            end
+        end
+    end, buffer:id())
+end
+
+PRINT("==================================================================================")
+do
+    -- notifications while the state is busy are merged into one invocation
+    local buffer = mtmsg.newbuffer()
+    local s = newReceiver(true, buffer)
+    buffer:notifier(s)
+    s:call("produce", 10)
+    local invocations, received = s:call("counts")
+    print("coalesce", invocations, received)
+    assert(invocations == 1 and received == 10)
+
+    -- without coalesce each notification invokes the callback
+    local buffer = mtmsg.newbuffer()
+    local s = newReceiver(false, buffer)
+    buffer:notifier(s)
+    s:call("produce", 10)
+    local invocations, received = s:call("counts")
+    print("no coalesce", invocations, received)
+    assert(invocations == 10 and received == 10)
+end
+PRINT("==================================================================================")
+do
+    -- notifications from another thread
+    local buffer = mtmsg.newbuffer()
+    local s = newReceiver(true, buffer)
+    buffer:notifier(s)
+    local thread = llthreads.new(function(bufferId)
+                                     local mtmsg  = require("mtmsg")
+                                     local buffer = mtmsg.buffer(bufferId)
+                                     for i = 1, 1000 do
+                                         buffer:addmsg(i)
+                                     end
+                                 end,
+                                 buffer:id())
+    thread:start()
+    for i = 1, 100 do
+        s:call("counts")
+    end
+    thread:join()
+    local invocations, received = s:call("counts")
+    print("thread", invocations, received)
+    assert(received == 1000 and invocations >= 1 and invocations <= 1000)
+end
+PRINT("==================================================================================")
+do
+    -- notifying a closed state is reported as closed every time
+    local buffer = mtmsg.newbuffer()
+    local s = newReceiver(true, buffer)
+    buffer:notifier(s)
+    s:close()
+    buffer:addmsg(1)
+    buffer:addmsg(2)
+    local _, err = pcall(function() s:call("counts") end)
+    assert(err:match(mtstates.error.object_closed))
+end
+PRINT("==================================================================================")
+print("OK.")